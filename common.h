@@ -270,11 +270,13 @@ void str_maybe_grow (string_t *str, size_t len, bool keep_content)
     } else {
         if (len >= ARRAY_SIZE(str->str_small)) {
             if (keep_content) {
+                // Copy by length, strings may contain null bytes.
+                uint32_t tmp_len = str_len (str);
                 char tmp[ARRAY_SIZE(str->str_small)];
-                strcpy (tmp, str->str_small);
+                memcpy (tmp, str->str_small, tmp_len);
 
                 str_non_small_alloc (str, len);
-                strcpy (str->str, tmp);
+                memcpy (str->str, tmp, tmp_len);
             } else {
                 str_non_small_alloc (str, len);
             }
@@ -2628,6 +2630,53 @@ char* full_file_read (mem_pool_t *pool, const char *path, uint64_t *len)
     return retval;
 }
 
+// Like full_file_read() but the content is read directly into _str_, replacing
+// what it had. Callers that keep the content in a string don't need to copy
+// it. Returns false on failure, then _str_ is left empty.
+bool full_file_read_str (string_t *str, const char *path)
+{
+    bool success = true;
+
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        str_maybe_grow (str, st.st_size, false);
+        char *data = str_data (str);
+
+        int file = open (path, O_RDONLY);
+        if (file != -1) {
+            size_t bytes_read = 0;
+            while (bytes_read != st.st_size) {
+                ssize_t status = read (file, data+bytes_read, st.st_size-bytes_read);
+                if (status <= 0) {
+                    success = false;
+                    if (status == -1) {
+                        printf ("Error reading %s: %s\n", path, strerror(errno));
+                    } else {
+                        printf ("Error reading %s: file got truncated\n", path);
+                    }
+                    break;
+                }
+                bytes_read += status;
+            }
+            data[st.st_size] = '\0';
+
+            close (file);
+        } else {
+            success = false;
+            printf ("Error opening %s: %s\n", path, strerror(errno));
+        }
+
+    } else {
+        success = false;
+        printf ("Could not read %s: %s\n", path, strerror(errno));
+    }
+
+    if (!success) {
+        str_set (str, "");
+    }
+    return success;
+}
+
 bool path_exists (char *path)
 {
     if (path == NULL) return false;
@@ -3059,6 +3108,21 @@ void end_mutex (volatile int *lock) {
     *lock = 0;
 }
 
+///////////////
+//
+//  TIMING
+
+#include <time.h>
+
+// Monotonic wall clock time in milliseconds. Only differences between two
+// calls are meaningful.
+double get_wall_time_ms ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec*1000 + (double)ts.tv_nsec/1000000;
+}
+
 ///////////////////////
 //
 //   SHARED VARIABLE
@@ -0,0 +1,77 @@
+/*
+ * Copiright (C) 2019 Santiago León O.
+ */
+
+// Serializes the geometries in kv_builtin_geometries into .lrep files, these
+// are bundled in the GResource so the editor parses them at startup instead of
+// building them. Called from './pymk generate_builtin_geometries', which
+// writes them to data/repr/builtin/.
+//
+//   ./bin/generate-builtin-geometries data/repr/builtin/
+
+#include "common.h"
+#include "bit_operations.c"
+#include "status.c"
+#include "scanner.c"
+#include "cli_parser.c"
+#include "binary_tree.c"
+
+#include <xkbcommon/xkbcommon.h>
+#include <linux/input-event-codes.h>
+#include "xkb_keycode_names.h"
+#include "kernel_keycode_names.h"
+#include "keysym_names.h"
+
+#include <gtk/gtk.h>
+#include "gresource.c"
+#include "gtk_utils.c"
+#include "fk_popover.c"
+#include "fk_searchable_list.c"
+
+#include "keyboard_view.h"
+#include "keyboard_view_builder.c"
+#include "keyboard_view_as_string.c"
+#include "keyboard_view_repr_store.c"
+#include "keyboard_view.c"
+
+int main (int argc, char **argv)
+{
+    if (argc != 2) {
+        printf ("Usage: %s OUTPUT_DIRECTORY\n", argv[0]);
+        return 1;
+    }
+
+    init_kernel_keycode_names ();
+    init_xkb_keycode_names ();
+
+    bool success = true;
+    string_t path = str_new (argv[1]);
+    if (str_len (&path) > 0 && str_data(&path)[str_len(&path) - 1] != '/') {
+        str_cat_c (&path, "/");
+    }
+    size_t path_len = str_len (&path);
+
+    for (int i=0; i<ARRAY_SIZE(kv_builtin_geometries); i++) {
+        struct kv_builtin_geometry_t *builtin = &kv_builtin_geometries[i];
+
+        struct keyboard_view_t *kv = kv_new ();
+        builtin->func (kv);
+
+        mem_pool_t pool = {0};
+        char *str = kv_to_string (&pool, kv);
+
+        str_put_c (&path, path_len, builtin->name);
+        str_cat_c (&path, ".lrep");
+        if (!ensure_path_exists (str_data(&path)) ||
+            full_file_write (str, strlen (str), str_data(&path))) {
+            printf ("Error writing %s\n", str_data(&path));
+            success = false;
+        }
+
+        mem_pool_destroy (&pool);
+        keyboard_view_destroy (kv);
+    }
+
+    str_free (&path);
+    return success ? 0 : 1;
+}
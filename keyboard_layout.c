@@ -286,6 +286,38 @@ int keyboard_layout_type_get_num_levels (struct key_type_t *type)
     return num_levels;
 }
 
+// Returns the level of _type_ selected when _modifiers_ are active, levels start
+// at 1. Like in xkb, modifiers outside of the type's mask are ignored and
+// combinations without a mapping select level 1.
+int keyboard_layout_type_get_level (struct key_type_t *type, key_modifier_mask_t modifiers)
+{
+    key_modifier_mask_t effective = modifiers & type->modifier_mask;
+
+    struct level_modifier_mapping_t *curr_modifier_mapping = type->modifier_mappings;
+    while (curr_modifier_mapping != NULL) {
+        if (curr_modifier_mapping->modifiers == effective) {
+            return curr_modifier_mapping->level;
+        }
+        curr_modifier_mapping = curr_modifier_mapping->next;
+    }
+
+    return 1;
+}
+
+// Returns the keysym of key _kc_ when _modifiers_ are active. Keys that aren't
+// in the layout or don't have a type produce no symbol.
+xkb_keysym_t keyboard_layout_get_keysym (struct keyboard_layout_t *keymap, int kc,
+                                         key_modifier_mask_t modifiers)
+{
+    struct key_t *key = keymap->keys[kc];
+    if (key == NULL || key->type == NULL) {
+        return XKB_KEY_NoSymbol;
+    }
+
+    int level = keyboard_layout_type_get_level (key->type, modifiers);
+    return key->levels[level-1].keysym;
+}
+
 enum type_level_mapping_result_status_t {
     KEYBOARD_LAYOUT_MOD_MAP_SUCCESS,
     KEYBOARD_LAYOUT_MOD_MAP_MAPPING_ALREADY_ASSIGNED
@@ -378,9 +410,11 @@ void keyboard_layout_destroy (struct keyboard_layout_t *keymap)
 {
     if (keymap == NULL) return;
 
-    mem_pool_destroy (&keymap->pool);
     // TODO: We should add a way of adding single callbacks to a pool.
     mod_mask_binary_tree_destroy (&keymap->modifiers);
+    // NOTE: Layouts may be bootstrapped into their own pool, this must be the
+    // last access to _keymap_.
+    mem_pool_destroy (&keymap->pool);
 }
 
 struct keyboard_layout_t* keyboard_layout_new_default (void)
@@ -414,15 +448,20 @@ struct keyboard_layout_t* keyboard_layout_new_default (void)
 // TODO: If parsing fails, somehow return the error message so we can then show
 // it to the user.
 bool xkb_file_parse (char *xkb_str, struct keyboard_layout_t *keymap);
+bool xkb_file_parse_verbose (char *xkb_str, struct keyboard_layout_t *keymap, string_t *log);
 void xkb_file_write (struct keyboard_layout_t *keymap, string_t *res, struct status_t *status);
-struct keyboard_layout_t* keyboard_layout_new_from_xkb (char *xkb_str)
+
+// Same as keyboard_layout_new_from_xkb() but parser messages are appended to
+// _log_, which may be NULL. Only touches the new layout so it can be called
+// from any thread.
+struct keyboard_layout_t* keyboard_layout_new_from_xkb_verbose (char *xkb_str, string_t *log)
 {
     mem_pool_t bootstrap = ZERO_INIT (mem_pool_t);
     struct keyboard_layout_t *keymap = mem_pool_push_size (&bootstrap, sizeof(struct keyboard_layout_t));
     *keymap = ZERO_INIT (struct keyboard_layout_t);
     keymap->pool = bootstrap;
 
-    if (!xkb_file_parse (xkb_str, keymap)) {
+    if (!xkb_file_parse_verbose (xkb_str, keymap, log)) {
         keyboard_layout_destroy (keymap);
         keymap = NULL;
     }
@@ -430,6 +469,11 @@ struct keyboard_layout_t* keyboard_layout_new_from_xkb (char *xkb_str)
     return keymap;
 }
 
+struct keyboard_layout_t* keyboard_layout_new_from_xkb (char *xkb_str)
+{
+    return keyboard_layout_new_from_xkb_verbose (xkb_str, NULL);
+}
+
 bool keyboard_layout_is_valid (struct keyboard_layout_t *keymap, struct status_t *status)
 {
     bool is_valid = true;
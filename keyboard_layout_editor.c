@@ -54,9 +54,22 @@ struct kle_app_t {
 
     struct keyboard_layout_t *keymap;
 
+    // Set when keymap is edited, the keyboard view's keymap is compiled from
+    // it again before testing it, see compile_edited_keymap().
+    bool keymap_edited;
+
+    // Modifiers of keymap that are active in the keyboard view, computed by
+    // layout_keysym_source() for eval_xkb_mods in eval_xkb_keymap.
+    struct xkb_keymap *eval_xkb_keymap;
+    xkb_mod_mask_t eval_xkb_mods;
+    key_modifier_mask_t eval_modifiers;
+
     string_t curr_keymap_name;
     string_t curr_xkb_str;
 
+    // Layout file being opened, see open_xkb_file_handler().
+    struct kle_layout_load_t *layout_load;
+
     int sidebar_min_width;
 
     // TODO: This will become an enum when we implement different states like
@@ -208,6 +221,23 @@ GtkWidget* intro_button_new (char *icon_name, char *title, char *subtitle)
     return new_button;
 }
 
+// Keymaps are compiled in the background, the current layout changes once the
+// new keymap is installed. _data_ is the name of the layout.
+KV_KEYMAP_READY_CB(layout_keymap_ready)
+{
+    char *name = (char*)data;
+    if (status == KV_KEYMAP_INSTALLED) {
+        str_set (&app.curr_xkb_str, xkb_str);
+        str_set (&app.curr_keymap_name, name);
+
+    } else if (status == KV_KEYMAP_FAILED) {
+        // TODO: Show some kind of feedback about what went wrong with the
+        // keymap.
+    }
+
+    free (name);
+}
+
 void on_custom_layout_selected (GtkListBox *box, GtkListBoxRow *row, gpointer user_data)
 {
     if (row == NULL) {
@@ -218,13 +248,9 @@ void on_custom_layout_selected (GtkListBox *box, GtkListBoxRow *row, gpointer us
     const gchar *curr_layout = gtk_label_get_text (GTK_LABEL (label));
 
     string_t xkb_str = reconstruct_installed_custom_layout_str (curr_layout);
-
-    if (keyboard_view_set_keymap (app.keyboard_view, str_data(&xkb_str))) {
-        str_free (&app.curr_xkb_str);
-        app.curr_xkb_str = xkb_str;
-
-        str_set (&app.curr_keymap_name, curr_layout);
-    }
+    keyboard_view_set_keymap_async (app.keyboard_view, str_data(&xkb_str),
+                                    layout_keymap_ready, strdup (curr_layout));
+    str_free (&xkb_str);
 }
 
 GtkWidget* new_custom_layout_list (struct keyboard_layout_info_t *custom_layouts, int num_custom_layouts)
@@ -383,6 +409,9 @@ FK_POPOVER_BUTTON_PRESSED_CB (set_key_symbol_handler)
     }
 
     if (keysym_set)  {
+        app.keymap_edited = true;
+        keyboard_view_invalidate_key (app.keyboard_view, app.keyboard_view->preview_keys_selection->kc);
+
         GtkWidget *keys_sidebar = app_keys_sidebar_new (&app, app.keyboard_view->preview_keys_selection->kc);
         replace_wrapped_widget_deferred (&app.keys_sidebar, keys_sidebar);
     }
@@ -436,6 +465,9 @@ void on_key_type_changed (GtkComboBox *themes_combobox, gpointer user_data)
         app.keymap->keys[kc] = new_key;
     }
 
+    app.keymap_edited = true;
+    keyboard_view_invalidate_key (app.keyboard_view, kc);
+
     GtkWidget *keys_sidebar = app_keys_sidebar_new (&app, app.keyboard_view->preview_keys_selection->kc);
     replace_wrapped_widget_deferred (&app.keys_sidebar, keys_sidebar);
 }
@@ -535,6 +567,28 @@ KV_SELECT_KEY_CHANGE_NOTIFY_CB(on_selected_key_change)
 }
 /////////////////////////////
 
+// Labels in edit mode don't need the layout to be compiled, but testing it
+// does, the keyboard view's xkb_state must know about the edits. So edited
+// layouts are compiled only when testing starts.
+void compile_edited_keymap (struct kle_app_t *app)
+{
+    string_t xkb_str = {0};
+    struct status_t status = {0};
+    xkb_file_write (app->keymap, &xkb_str, &status);
+
+    if (!status_is_error (&status)) {
+        keyboard_view_set_keymap_async (app->keyboard_view, str_data(&xkb_str),
+                                        layout_keymap_ready, strdup (str_data(&app->curr_keymap_name)));
+        app->keymap_edited = false;
+
+    } else {
+        status_print (&status);
+    }
+
+    mem_pool_destroy (&status.pool);
+    str_free (&xkb_str);
+}
+
 // TODO: Get better icon for this. I'm thinking a gripper grabbing/ungrabbing a
 // key.
 void on_grab_input_button (GtkButton *button, gpointer user_data)
@@ -544,6 +598,9 @@ void on_grab_input_button (GtkButton *button, gpointer user_data)
     }
 
     if (app.is_edit_mode == true) {
+        if (app.keymap_edited) {
+            compile_edited_keymap (&app);
+        }
         kv_set_preview_test (app.keyboard_view);
     }
 }
@@ -614,61 +671,109 @@ void return_to_welcome_handler (GtkButton *button, gpointer   user_data)
         replace_wrapped_widget (&app.window_content, welcome_screen);
     }
 
+    keyboard_view_set_keysym_source (app.keyboard_view, NULL);
     keyboard_layout_destroy (app.keymap);
     mem_pool_destroy (&tmp);
 }
 
-bool edit_xkb_str (struct kle_app_t *app, char *keymap_name, char *xkb_str)
+// While editing, the keyboard view labels keys with the keysyms of app.keymap,
+// so edits show up immediately without writing the layout and compiling it.
+// Keys are invalidated individually when edited. Modifiers still come from the
+// view's compiled keymap, the active ones are translated into modifiers of
+// app.keymap by name, only when the view's state changes.
+KV_KEYSYM_SOURCE_CB(layout_keysym_source)
 {
-    bool success = true;
+    xkb_mod_mask_t xkb_mods = 0;
+    if (kv->xkb_state != NULL) {
+        xkb_mods = xkb_state_serialize_mods (kv->xkb_state, XKB_STATE_MODS_EFFECTIVE);
+    }
 
-    struct keyboard_layout_t *new_layout = keyboard_layout_new_from_xkb (xkb_str);
+    if (app.eval_xkb_keymap != kv->xkb_keymap || app.eval_xkb_mods != xkb_mods) {
+        key_modifier_mask_t modifiers = 0;
+        if (kv->xkb_keymap != NULL) {
+            xkb_mod_index_t num_mods = xkb_keymap_num_mods (kv->xkb_keymap);
+            for (xkb_mod_index_t i=0; i<num_mods && i<32; i++) {
+                if (xkb_mods & (1u << i)) {
+                    enum modifier_result_status_t status;
+                    char *name = (char*)xkb_keymap_mod_get_name (kv->xkb_keymap, i);
+                    key_modifier_mask_t mask = keyboard_layout_get_modifier (app.keymap, name, &status);
+                    if (status == KEYBOARD_LAYOUT_MOD_SUCCESS) {
+                        modifiers |= mask;
+                    }
+                }
+            }
+        }
 
-    if (new_layout != NULL) {
-        app->keymap = new_layout;
+        app.eval_xkb_keymap = kv->xkb_keymap;
+        app.eval_xkb_mods = xkb_mods;
+        app.eval_modifiers = modifiers;
+    }
+
+    return keyboard_layout_get_keysym (app.keymap, kc, app.eval_modifiers);
+}
 
-        app->is_edit_mode = true;
+// Switches the window to editing _new_layout_, the app takes ownership of it.
+void edit_layout (struct kle_app_t *app, char *keymap_name, struct keyboard_layout_t *new_layout)
+{
+    app->keymap = new_layout;
+    app->keymap_edited = false;
+    app->eval_xkb_keymap = NULL;
+    app->eval_xkb_mods = 0;
+    app->eval_modifiers = 0;
+    keyboard_view_set_keysym_source (app->keyboard_view, layout_keysym_source);
 
-        gtk_header_bar_set_title (GTK_HEADER_BAR(app->header_bar), keymap_name);
+    app->is_edit_mode = true;
 
-        // Set the headerbar buttons
-        {
-            GtkWidget *return_to_welcome_button = gtk_button_new_with_label ("Go Back");
-            gtk_widget_set_valign (return_to_welcome_button, GTK_ALIGN_CENTER);
-            add_css_class (return_to_welcome_button, "back-button");
-            g_signal_connect (return_to_welcome_button, "clicked", G_CALLBACK (return_to_welcome_handler), NULL);
-
-            GtkWidget *headerbar_buttons = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
-            gtk_container_add (GTK_CONTAINER (headerbar_buttons), return_to_welcome_button);
-            app->keymap_test_button = new_keymap_test_button();
-            gtk_container_add (GTK_CONTAINER (headerbar_buttons), app->keymap_test_button);
-            replace_wrapped_widget (&app->headerbar_buttons, headerbar_buttons);
-            gtk_widget_show_all (headerbar_buttons);
-        }
+    gtk_header_bar_set_title (GTK_HEADER_BAR(app->header_bar), keymap_name);
 
-        GtkWidget *stack = gtk_stack_new ();
-        gtk_widget_set_halign (stack, GTK_ALIGN_CENTER);
-        {
-            kv_set_preview_keys (app->keyboard_view);
-            app->keys_sidebar = app_keys_sidebar_new (app, app->keyboard_view->preview_keys_selection->kc);
-            gtk_stack_add_titled (GTK_STACK(stack), wrap_gtk_widget(app->keys_sidebar), "keys", "Keys");
-        }
+    // Set the headerbar buttons
+    {
+        GtkWidget *return_to_welcome_button = gtk_button_new_with_label ("Go Back");
+        gtk_widget_set_valign (return_to_welcome_button, GTK_ALIGN_CENTER);
+        add_css_class (return_to_welcome_button, "back-button");
+        g_signal_connect (return_to_welcome_button, "clicked", G_CALLBACK (return_to_welcome_handler), NULL);
+
+        GtkWidget *headerbar_buttons = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
+        gtk_container_add (GTK_CONTAINER (headerbar_buttons), return_to_welcome_button);
+        app->keymap_test_button = new_keymap_test_button();
+        gtk_container_add (GTK_CONTAINER (headerbar_buttons), app->keymap_test_button);
+        replace_wrapped_widget (&app->headerbar_buttons, headerbar_buttons);
+        gtk_widget_show_all (headerbar_buttons);
+    }
 
-        {
-            GtkWidget *types_stack = gtk_label_new ("Types");
-            gtk_stack_add_titled (GTK_STACK(stack), types_stack, "types", "Types");
-        }
+    GtkWidget *stack = gtk_stack_new ();
+    gtk_widget_set_halign (stack, GTK_ALIGN_CENTER);
+    {
+        kv_set_preview_keys (app->keyboard_view);
+        app->keys_sidebar = app_keys_sidebar_new (app, app->keyboard_view->preview_keys_selection->kc);
+        gtk_stack_add_titled (GTK_STACK(stack), wrap_gtk_widget(app->keys_sidebar), "keys", "Keys");
+    }
+
+    {
+        GtkWidget *types_stack = gtk_label_new ("Types");
+        gtk_stack_add_titled (GTK_STACK(stack), types_stack, "types", "Types");
+    }
+
+    GtkWidget *stack_buttons = gtk_stack_switcher_new ();
+    gtk_widget_set_halign (stack_buttons, GTK_ALIGN_CENTER);
+    gtk_widget_set_margins (stack_buttons, 12);
+    gtk_stack_switcher_set_stack (GTK_STACK_SWITCHER(stack_buttons), GTK_STACK(stack));
+
+    GtkWidget *grid = gtk_grid_new ();
+    gtk_widget_set_halign (grid, GTK_ALIGN_CENTER);
+    gtk_grid_attach (GTK_GRID(grid), stack_buttons, 0, 0, 1, 1);
+    gtk_grid_attach (GTK_GRID(grid), stack, 0, 1, 1, 1);
+    replace_wrapped_widget (&app->sidebar, grid);
+}
 
-        GtkWidget *stack_buttons = gtk_stack_switcher_new ();
-        gtk_widget_set_halign (stack_buttons, GTK_ALIGN_CENTER);
-        gtk_widget_set_margins (stack_buttons, 12);
-        gtk_stack_switcher_set_stack (GTK_STACK_SWITCHER(stack_buttons), GTK_STACK(stack));
+bool edit_xkb_str (struct kle_app_t *app, char *keymap_name, char *xkb_str)
+{
+    bool success = true;
 
-        GtkWidget *grid = gtk_grid_new ();
-        gtk_widget_set_halign (grid, GTK_ALIGN_CENTER);
-        gtk_grid_attach (GTK_GRID(grid), stack_buttons, 0, 0, 1, 1);
-        gtk_grid_attach (GTK_GRID(grid), stack, 0, 1, 1, 1);
-        replace_wrapped_widget (&app->sidebar, grid);
+    struct keyboard_layout_t *new_layout = keyboard_layout_new_from_xkb (xkb_str);
+
+    if (new_layout != NULL) {
+        edit_layout (app, keymap_name, new_layout);
 
     } else {
         // TODO: xkb file parsing failed, show an error message.
@@ -683,6 +788,184 @@ void edit_layout_handler (GtkButton *button, gpointer user_data)
     edit_xkb_str (&app, str_data(&app.curr_keymap_name), str_data(&app.curr_xkb_str));
 }
 
+// Opening a layout file parses it with our parser into the IR, and compiles it
+// with libxkbcommon for the keyboard view. The file is read once into
+// xkb_str, both stages run concurrently in their own thread over it, and when
+// both finish the results are published together from an idle callback in the
+// GTK thread. Then xkb_str becomes app.curr_xkb_str without being copied.
+//
+// If any stage fails nothing is published and the errors of both stages are
+// reported together, with the time each one took.
+struct kle_layout_load_t {
+    string_t fname;
+    string_t name;
+    string_t xkb_str;
+    double start;
+    double read_ms;
+
+    pthread_mutex_t mutex;
+    int num_running;
+
+    pthread_t parse_thread;
+    struct keyboard_layout_t *layout;
+    string_t parse_log;
+    double parse_ms;
+
+    pthread_t compile_thread;
+    struct xkb_keymap *xkb_keymap;
+    struct xkb_state *xkb_state;
+    string_t compile_log;
+    double compile_ms;
+};
+
+void kle_layout_load_destroy (struct kle_layout_load_t *load)
+{
+    if (load->layout != NULL) {
+        keyboard_layout_destroy (load->layout);
+    }
+
+    if (load->xkb_state != NULL) {
+        xkb_state_unref (load->xkb_state);
+    }
+
+    if (load->xkb_keymap != NULL) {
+        xkb_keymap_unref (load->xkb_keymap);
+    }
+
+    str_free (&load->fname);
+    str_free (&load->name);
+    str_free (&load->xkb_str);
+    str_free (&load->parse_log);
+    str_free (&load->compile_log);
+    pthread_mutex_destroy (&load->mutex);
+    free (load);
+}
+
+void kle_layout_load_report (struct kle_layout_load_t *load, bool success)
+{
+    if (!success) {
+        printf ("Could not open %s\n", str_data(&load->fname));
+
+        if (load->layout == NULL) {
+            printf ("Parsing failed:\n%s", str_data(&load->parse_log));
+        }
+
+        if (load->xkb_keymap == NULL) {
+            printf ("libxkbcommon failed:\n%s", str_data(&load->compile_log));
+        }
+    }
+
+    // Timings of successful loads are logged along with the view's render
+    // timings, see struct kv_timing_t.
+    if (!success || app.keyboard_view->timing.log) {
+        printf ("Opening %s: read %.2f ms, parse %.2f ms, compile %.2f ms, total %.2f ms\n",
+                str_data(&load->name), load->read_ms, load->parse_ms, load->compile_ms,
+                get_wall_time_ms () - load->start);
+    }
+}
+
+gboolean kle_layout_load_publish (gpointer user_data)
+{
+    struct kle_layout_load_t *load = (struct kle_layout_load_t*)user_data;
+    pthread_join (load->parse_thread, NULL);
+    pthread_join (load->compile_thread, NULL);
+
+    // A file opened after this one replaced it.
+    if (app.layout_load != load) {
+        kle_layout_load_destroy (load);
+        return G_SOURCE_REMOVE;
+    }
+    app.layout_load = NULL;
+
+    bool success = load->layout != NULL && load->xkb_keymap != NULL;
+    if (success) {
+        keyboard_view_set_compiled_keymap (app.keyboard_view, str_data(&load->xkb_str),
+                                           load->xkb_keymap, load->xkb_state);
+        load->xkb_keymap = NULL;
+        load->xkb_state = NULL;
+
+        edit_layout (&app, str_data(&load->name), load->layout);
+        load->layout = NULL;
+
+        str_free (&app.curr_xkb_str);
+        app.curr_xkb_str = load->xkb_str;
+        load->xkb_str = ZERO_INIT(string_t);
+
+        str_free (&app.curr_keymap_name);
+        app.curr_keymap_name = load->name;
+        load->name = ZERO_INIT(string_t);
+    }
+
+    kle_layout_load_report (load, success);
+    kle_layout_load_destroy (load);
+    return G_SOURCE_REMOVE;
+}
+
+void kle_layout_load_stage_done (struct kle_layout_load_t *load)
+{
+    pthread_mutex_lock (&load->mutex);
+    load->num_running--;
+    if (load->num_running == 0) {
+        g_idle_add (kle_layout_load_publish, load);
+    }
+    pthread_mutex_unlock (&load->mutex);
+}
+
+void* kle_layout_load_parse_thread (void *data)
+{
+    struct kle_layout_load_t *load = (struct kle_layout_load_t*)data;
+
+    double start = get_wall_time_ms ();
+    load->layout = keyboard_layout_new_from_xkb_verbose (str_data(&load->xkb_str), &load->parse_log);
+    load->parse_ms = get_wall_time_ms () - start;
+
+    kle_layout_load_stage_done (load);
+    return NULL;
+}
+
+void* kle_layout_load_compile_thread (void *data)
+{
+    struct kle_layout_load_t *load = (struct kle_layout_load_t*)data;
+
+    double start = get_wall_time_ms ();
+    kv_compile_keymap_unshared (str_data(&load->xkb_str), &load->xkb_keymap, &load->xkb_state,
+                                &load->compile_log);
+    load->compile_ms = get_wall_time_ms () - start;
+
+    kle_layout_load_stage_done (load);
+    return NULL;
+}
+
+void kle_layout_load_start (char *fname)
+{
+    struct kle_layout_load_t *load = malloc (sizeof(struct kle_layout_load_t));
+    *load = ZERO_INIT(struct kle_layout_load_t);
+    pthread_mutex_init (&load->mutex, NULL);
+    load->start = get_wall_time_ms ();
+    str_set (&load->fname, fname);
+
+    {
+        mem_pool_t tmp = {0};
+        char *name;
+        path_split (&tmp, fname, NULL, &name);
+        str_set (&load->name, name);
+        mem_pool_destroy (&tmp);
+    }
+
+    if (!full_file_read_str (&load->xkb_str, fname)) {
+        kle_layout_load_destroy (load);
+        return;
+    }
+    load->read_ms = get_wall_time_ms () - load->start;
+
+    // Publishing of a previous file that is still loading is skipped.
+    app.layout_load = load;
+
+    load->num_running = 2;
+    pthread_create (&load->parse_thread, NULL, kle_layout_load_parse_thread, load);
+    pthread_create (&load->compile_thread, NULL, kle_layout_load_compile_thread, load);
+}
+
 // TODO: Do we want to add opened xkb files to the layout list?. It can be
 // useful so it's easy to open a file we recently worked on. The problem is it
 // becomes confusing what the layout list contains. How do we distinguish
@@ -720,35 +1003,9 @@ void open_xkb_file_handler (GtkButton *button, gpointer user_data)
     if (result == GTK_RESPONSE_ACCEPT) {
         fname = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER(dialog));
 
-        mem_pool_t tmp = {0};
         // NOTE: gtk_file_chooser_get_filename() returns an absolute path.
-        char *file_content = full_file_read (&tmp, fname, NULL);
-
-        char *name;
-        path_split (&tmp, fname, NULL, &name);
-
-        // We only set curr_xkb_str and curr_keymap_name if parsing of the file is
-        // successful. Both, from our parser, and from libxkbcommon's parser for
-        // the view's state.
-        // TODO: data is originally stored in a temporary pool and then maybe copied
-        // into strings here. Is it useful for common.h to have functions that write
-        // directly to strings?, then here we would just free the old ones and
-        // replace them with the new ones. This won't necessarily be faster, we are
-        // comparing the speed of copying the full file content, with the speed of
-        // freeing the old one. My thinking is a free 'should' be faster than a
-        // copy, but who knows. I won't think much about this for now.
-        // @performance
-        if (edit_xkb_str (&app, name, file_content) &&
-            keyboard_view_set_keymap (app.keyboard_view, file_content)) {
-            str_set (&app.curr_xkb_str, file_content);
-            str_set (&app.curr_keymap_name, name);
-
-        } else {
-            // TODO: Show some kind of feedback about what went wrong with the
-            // keymap file.
-        }
-
-        mem_pool_destroy (&tmp);
+        kle_layout_load_start (fname);
+        g_free (fname);
     }
 
     gtk_widget_destroy (dialog);
@@ -1150,6 +1407,12 @@ int main (int argc, char *argv[])
 
     }
 
+    if (app.layout_load != NULL) {
+        pthread_join (app.layout_load->parse_thread, NULL);
+        pthread_join (app.layout_load->compile_thread, NULL);
+        kle_layout_load_destroy (app.layout_load);
+    }
+
     xmlCleanupParser();
     str_free (&app.curr_keymap_name);
     str_free (&app.curr_xkb_str);
@@ -120,6 +120,14 @@ void kv_remove_key_sgmt (struct keyboard_view_t *kv, struct sgmt_t **sgmt_ptr,
     // multirow deletion needs the next_multirow pointers. Clearing is done
     // at kv_allocate_key().
     struct sgmt_t *tmp = (*sgmt_ptr)->next_sgmt;
+    if (row != NULL) {
+        kv_mark_glue_dirty_row (kv, row);
+    } else if (tmp != NULL) {
+        kv_mark_glue_dirty (kv, tmp);
+    } else {
+        kv_mark_glue_dirty_all (kv);
+    }
+
     (*sgmt_ptr)->next_sgmt = kv->spare_keys;
     kv->spare_keys = *sgmt_ptr;
     *sgmt_ptr = tmp;
@@ -154,7 +162,7 @@ void kv_remove_key (struct keyboard_view_t *kv, struct sgmt_t **key_ptr)
 
     struct sgmt_t *multirow_parent = kv_get_multirow_parent(*key_ptr);
     // Remove the pointer to *key_ptr from the lookup table
-    kv->keys_by_kc[multirow_parent->kc] = NULL;
+    kv_set_key_by_kc (kv, multirow_parent->kc, NULL);
 
     if (is_multirow_key(*key_ptr)) {
         // Rows are singly linked lists so we don't have the pointers to the
@@ -341,6 +349,168 @@ bool compute_key_size_full (struct keyboard_view_t *kv, struct sgmt_t *key, stru
     return is_rectangular;
 }
 
+void kv_geometry_rebuild (struct keyboard_view_t *kv)
+{
+    struct kv_geometry_t *geo = &kv->geometry;
+    mem_pool_destroy (&geo->pool);
+    geo->pool = ZERO_INIT(mem_pool_t);
+
+    int num_rows = 0, num_sgmts = 0, num_multirow_parents = 0;
+    for (struct row_t *curr_row = kv->first_row; curr_row; curr_row = curr_row->next_row) {
+        for (struct sgmt_t *curr_sgmt = curr_row->first_key; curr_sgmt; curr_sgmt = curr_sgmt->next_sgmt) {
+            if (is_multirow_parent (curr_sgmt)) {
+                num_multirow_parents++;
+            }
+            num_sgmts++;
+        }
+        num_rows++;
+    }
+
+    geo->num_sgmts = num_sgmts;
+    geo->sgmts = mem_pool_push_array (&geo->pool, num_sgmts, struct sgmt_t*);
+    geo->x = mem_pool_push_array (&geo->pool, num_sgmts, float);
+    geo->y = mem_pool_push_array (&geo->pool, num_sgmts, float);
+    geo->w = mem_pool_push_array (&geo->pool, num_sgmts, float);
+    geo->h = mem_pool_push_array (&geo->pool, num_sgmts, float);
+    geo->is_rectangular = mem_pool_push_array (&geo->pool, num_sgmts, bool);
+    geo->row_idx = mem_pool_push_array (&geo->pool, num_sgmts, int);
+    geo->parent_idx = mem_pool_push_array (&geo->pool, num_sgmts, int);
+
+    geo->num_rows = num_rows;
+    geo->rows = mem_pool_push_array (&geo->pool, num_rows, struct row_t*);
+    geo->row_y = mem_pool_push_array (&geo->pool, num_rows, float);
+    geo->row_h = mem_pool_push_array (&geo->pool, num_rows, float);
+    geo->row_first = mem_pool_push_array (&geo->pool, num_rows+1, int);
+
+    // Multirow parents are always in the top row of their key, so they are
+    // found before the rest of the segments. Keep a list of them to resolve
+    // the parent index of the other segments.
+    mem_pool_t pool = {0};
+    int *multirow_parents = mem_pool_push_array (&pool, num_multirow_parents, int);
+    int multirow_parents_len = 0;
+
+    int i = 0, r = 0;
+    float y = 0;
+    for (struct row_t *curr_row = kv->first_row; curr_row; curr_row = curr_row->next_row) {
+        float row_h = curr_row->height*kv->default_key_size;
+        geo->rows[r] = curr_row;
+        geo->row_y[r] = y;
+        geo->row_h[r] = row_h;
+        geo->row_first[r] = i;
+
+        float x = 0;
+        for (struct sgmt_t *curr_sgmt = curr_row->first_key; curr_sgmt; curr_sgmt = curr_sgmt->next_sgmt) {
+            x += (curr_sgmt->internal_glue + get_sgmt_user_glue(curr_sgmt))*kv->default_key_size;
+
+            float key_width, key_height;
+            geo->is_rectangular[i] = compute_key_size (kv, curr_sgmt, curr_row, &key_width, &key_height);
+            geo->sgmts[i] = curr_sgmt;
+            geo->x[i] = x;
+            geo->y[i] = y;
+            geo->w[i] = key_width;
+            geo->h[i] = key_height;
+            geo->row_idx[i] = r;
+
+            geo->parent_idx[i] = i;
+            if (is_multirow_parent (curr_sgmt)) {
+                multirow_parents[multirow_parents_len++] = i;
+
+            } else if (is_multirow_key (curr_sgmt)) {
+                struct sgmt_t *parent = kv_get_multirow_parent (curr_sgmt);
+                for (int j=0; j<multirow_parents_len; j++) {
+                    if (geo->sgmts[multirow_parents[j]] == parent) {
+                        geo->parent_idx[i] = multirow_parents[j];
+                        break;
+                    }
+                }
+            }
+
+            x += key_width;
+            i++;
+        }
+
+        y += row_h;
+        r++;
+    }
+    geo->row_first[r] = i;
+
+    mem_pool_destroy (&pool);
+
+    // Build the point query grid. Keyboard sizes are usually multiples of a
+    // quarter of a key, so that's the size we use for cells. This keeps the
+    // number of rows or segments in a single cell small.
+    assert (kv->default_key_size > 0 && "kv_new() sets KV_DEFAULT_KEY_SIZE");
+    geo->cell_size = kv->default_key_size/4;
+
+    geo->num_row_cells = (int)(y/geo->cell_size) + 1;
+    geo->row_cells = mem_pool_push_array (&geo->pool, geo->num_row_cells, int);
+    r = 0;
+    for (int c=0; c<geo->num_row_cells; c++) {
+        float cell_y = c*geo->cell_size;
+        while (r < num_rows && geo->row_y[r] + geo->row_h[r] <= cell_y) {
+            r++;
+        }
+        geo->row_cells[c] = r;
+    }
+
+    int num_col_cells = 0;
+    geo->col_cells_first = mem_pool_push_array (&geo->pool, num_rows+1, int);
+    for (r=0; r<num_rows; r++) {
+        geo->col_cells_first[r] = num_col_cells;
+
+        int end = geo->row_first[r+1];
+        if (end > geo->row_first[r]) {
+            num_col_cells += (int)((geo->x[end-1] + geo->w[end-1])/geo->cell_size) + 1;
+        }
+    }
+    geo->col_cells_first[num_rows] = num_col_cells;
+
+    geo->col_cells = mem_pool_push_array (&geo->pool, num_col_cells, int);
+    for (r=0; r<num_rows; r++) {
+        int end = geo->row_first[r+1];
+        i = geo->row_first[r];
+        for (int c=geo->col_cells_first[r]; c<geo->col_cells_first[r+1]; c++) {
+            float cell_x = (c - geo->col_cells_first[r])*geo->cell_size;
+            while (i < end && geo->x[i] + geo->w[i] <= cell_x) {
+                i++;
+            }
+            geo->col_cells[c] = i;
+        }
+    }
+
+    geo->default_key_size = kv->default_key_size;
+    geo->valid = true;
+}
+
+struct kv_geometry_t* kv_get_geometry (struct keyboard_view_t *kv)
+{
+    if (!kv->geometry.valid || kv->geometry.default_key_size != kv->default_key_size) {
+        kv_geometry_rebuild (kv);
+    }
+
+    return &kv->geometry;
+}
+
+// Returns the index of sgmt in the geometry table or -1 if it isn't there. If
+// the row is known, passing its index makes this search only that row,
+// otherwise pass -1.
+int kv_geometry_find (struct kv_geometry_t *geo, int row_idx, struct sgmt_t *sgmt)
+{
+    int start = 0, end = geo->num_sgmts;
+    if (row_idx >= 0) {
+        start = geo->row_first[row_idx];
+        end = geo->row_first[row_idx+1];
+    }
+
+    for (int i=start; i<end; i++) {
+        if (geo->sgmts[i] == sgmt) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
 static inline
 bool is_supporting_sgmt (struct sgmt_t *sgmt)
 {
@@ -414,6 +584,7 @@ float bnd_delta_update (float old_val, float new_val, float boundary)
 void kv_adjust_sgmt_glue (struct keyboard_view_t *kv, struct sgmt_t *sgmt, float delta_glue)
 {
     if (sgmt != NULL && delta_glue != 0) {
+        kv_mark_glue_dirty (kv, sgmt);
         struct sgmt_t *parent = kv_get_multirow_parent (sgmt);
 
         if (!is_multirow_key(sgmt)) {
@@ -589,6 +760,7 @@ void kv_adjust_edge_glue (struct keyboard_view_t *kv,
     // Update the user glue of each info key, based on the computed data.
     for (int i=0; i<num_info; i++) {
         if (debug_info) old_glue_dbg[i] = info[i].key->user_glue;
+        kv_mark_glue_dirty (kv, info[i].key);
 
         if (info[i].min_glue_blocked == INFINITY) {
             // The key is fully visible.
@@ -659,6 +831,8 @@ void kv_adjust_left_edge (struct keyboard_view_t *kv, struct sgmt_t *sgmt, float
     int num_rows = kv_get_num_rows (kv);
     if (num_rows == 0) return;
 
+    kv_mark_glue_dirty_all (kv);
+
     struct sgmt_t fake_edge[num_rows];
     struct row_t *curr_row = kv->first_row;
 
@@ -893,8 +1067,218 @@ void cr_render_multirow_key (cairo_t *cr, double x, double y, struct keyboard_vi
                          row->height*kv->default_key_size - 2*KEY_LEFT_MARGIN - 1);
 }
 
+void kv_key_surface_cache_clear (struct kv_key_surface_cache_t *cache)
+{
+    for (int i=0; i<cache->num_entries; i++) {
+        struct kv_key_surface_t *entry = &cache->entries[i];
+        cairo_surface_destroy (entry->surface);
+        str_free (&entry->id);
+    }
+
+    cache->num_entries = 0;
+    cache->lru_first = NULL;
+    cache->lru_last = NULL;
+    for (int i=0; i<KV_KEY_SURFACE_CACHE_BUCKETS; i++) {
+        cache->buckets[i] = NULL;
+    }
+}
+
+static inline
+void kv_key_surface_lru_remove (struct kv_key_surface_cache_t *cache, struct kv_key_surface_t *entry)
+{
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_first = entry->lru_next;
+    }
+
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_last = entry->lru_prev;
+    }
+
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static inline
+void kv_key_surface_lru_push (struct kv_key_surface_cache_t *cache, struct kv_key_surface_t *entry)
+{
+    entry->lru_next = cache->lru_first;
+    if (cache->lru_first != NULL) {
+        cache->lru_first->lru_prev = entry;
+    } else {
+        cache->lru_last = entry;
+    }
+    cache->lru_first = entry;
+}
+
+// Returns an unused entry, evicting the least recently used one if the cache is
+// full.
+struct kv_key_surface_t* kv_key_surface_cache_get_free (struct kv_key_surface_cache_t *cache)
+{
+    struct kv_key_surface_t *entry;
+    if (cache->num_entries < KV_KEY_SURFACE_CACHE_SIZE) {
+        entry = &cache->entries[cache->num_entries++];
+        *entry = ZERO_INIT (struct kv_key_surface_t);
+
+    } else {
+        entry = cache->lru_last;
+        kv_key_surface_lru_remove (cache, entry);
+
+        struct kv_key_surface_t **pos = &cache->buckets[entry->hash%KV_KEY_SURFACE_CACHE_BUCKETS];
+        while (*pos != entry) {
+            pos = &(*pos)->bucket_next;
+        }
+        *pos = entry->bucket_next;
+        entry->bucket_next = NULL;
+
+        cairo_surface_destroy (entry->surface);
+        entry->surface = NULL;
+    }
+
+    return entry;
+}
+
+// Renders a key by painting a surface where it was previously rendered. Keys
+// are identified by everything that affects how they look (shape, size, color,
+// label and subpixel position), so changes to the geometry never return stale
+// surfaces, surfaces of keys that aren't used anymore are eventually evicted.
+//
+// _is_rectangular_ chooses between cr_render_key() and cr_render_multirow_key(),
+// _width_ and _height_ are only used by the first one.
+void kv_render_key_cached (cairo_t *cr, struct keyboard_view_t *kv, double x, double y,
+                           struct row_t *row, struct sgmt_t *key, bool is_rectangular,
+                           float width, float height, char *label, dvec4 color)
+{
+    // Painting cached surfaces into a vector surface (SVG, PDF, PS) would embed
+    // bitmaps, draw the key's paths instead.
+    cairo_surface_type_t target_type = cairo_surface_get_type (cairo_get_target (cr));
+    if (target_type == CAIRO_SURFACE_TYPE_SVG ||
+        target_type == CAIRO_SURFACE_TYPE_PDF ||
+        target_type == CAIRO_SURFACE_TYPE_PS) {
+        cairo_save (cr);
+        cairo_set_line_width (cr, 1);
+        if (is_rectangular) {
+            cr_render_key (cr, x, y, width, height, label, color);
+        } else {
+            cr_render_multirow_key (cr, x, y, kv, row, key, label, color);
+        }
+        cairo_restore (cr);
+        return;
+    }
+
+    struct kv_key_surface_cache_t *cache = &kv->key_surfaces;
+
+    double scale_x, scale_y;
+    cairo_surface_get_device_scale (cairo_get_target (cr), &scale_x, &scale_y);
+    if (cache->default_key_size != kv->default_key_size || cache->scale != scale_x) {
+        kv_key_surface_cache_clear (cache);
+        cache->default_key_size = kv->default_key_size;
+        cache->scale = scale_x;
+    }
+
+    double base_x = floor (x), base_y = floor (y);
+    double frac_x = x - base_x, frac_y = y - base_y;
+
+    string_t *id = &cache->scratch_id;
+    if (is_rectangular) {
+        str_set_printf (id, "R %g %g", width, height);
+
+    } else {
+        // The shape of a non rectangular key depends on the width and
+        // alignment of all its segments and on the height of the rows they
+        // are in.
+        str_set_printf (id, "M");
+        struct sgmt_t *curr_sgmt = key;
+        struct row_t *curr_row = row;
+        do {
+            str_cat_printf (id, " %d:%d:%g:%g", curr_sgmt->type == KEY_MULTIROW_SEGMENT_SIZED,
+                            curr_sgmt->align, curr_sgmt->width, curr_row->height);
+            curr_sgmt = curr_sgmt->next_multirow;
+            curr_row = curr_row->next_row;
+        } while (!is_multirow_parent (curr_sgmt));
+    }
+    str_cat_printf (id, " %g %g %g %g %g|%s", frac_x, frac_y, ARGS_RGB(color), label);
+
+    uint32_t hash = kv_str_hash (str_data(id));
+    struct kv_key_surface_t **bucket = &cache->buckets[hash%KV_KEY_SURFACE_CACHE_BUCKETS];
+
+    struct kv_key_surface_t *entry = *bucket;
+    while (entry != NULL) {
+        if (entry->hash == hash && strcmp (str_data(&entry->id), str_data(id)) == 0) {
+            break;
+        }
+        entry = entry->bucket_next;
+    }
+
+    if (entry != NULL) {
+        kv_key_surface_lru_remove (cache, entry);
+
+    } else {
+        // Compute the extents of the key relative to (base_x, base_y).
+        double x1, y1, x2, y2;
+        if (is_rectangular) {
+            x1 = frac_x;
+            y1 = frac_y;
+            x2 = frac_x + width;
+            y2 = frac_y + height;
+
+        } else {
+            cairo_save (cr);
+            cairo_identity_matrix (cr);
+            cairo_set_line_width (cr, 1);
+            cr_non_rectangular_key_path (cr, frac_x, frac_y, 0, kv, row, key);
+            cairo_stroke_extents (cr, &x1, &y1, &x2, &y2);
+            cairo_new_path (cr);
+            cairo_restore (cr);
+        }
+
+        entry = kv_key_surface_cache_get_free (cache);
+        str_set (&entry->id, str_data(id));
+        entry->hash = hash;
+        entry->offset_x = floor (x1);
+        entry->offset_y = floor (y1);
+
+        int surface_width = ceil (x2) - entry->offset_x + 1;
+        int surface_height = ceil (y2) - entry->offset_y + 1;
+        entry->surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                                     ceil (surface_width*cache->scale),
+                                                     ceil (surface_height*cache->scale));
+        cairo_surface_set_device_scale (entry->surface, cache->scale, cache->scale);
+
+        cairo_t *surface_cr = cairo_create (entry->surface);
+        cairo_set_line_width (surface_cr, 1);
+        double key_x = frac_x - entry->offset_x;
+        double key_y = frac_y - entry->offset_y;
+        if (is_rectangular) {
+            cr_render_key (surface_cr, key_x, key_y, width, height, label, color);
+        } else {
+            cr_render_multirow_key (surface_cr, key_x, key_y, kv, row, key, label, color);
+        }
+        cairo_destroy (surface_cr);
+
+        entry->bucket_next = *bucket;
+        *bucket = entry;
+    }
+
+    kv_key_surface_lru_push (cache, entry);
+
+    cairo_set_source_surface (cr, entry->surface, base_x + entry->offset_x, base_y + entry->offset_y);
+    cairo_paint (cr);
+}
+
 void keyboard_view_get_margins (struct keyboard_view_t *kv, double *left_margin, double *top_margin)
 {
+    // Keyboard views created with kv_new() have no widget, they are rendered
+    // into a surface of the same size as the keyboard.
+    if (kv->widget == NULL) {
+        if (left_margin != NULL) *left_margin = 0;
+        if (top_margin != NULL) *top_margin = 0;
+        return;
+    }
+
     double kbd_width, kbd_height;
     kv_get_size (kv, &kbd_width, &kbd_height);
 
@@ -938,9 +1322,262 @@ char *keysym_representations[][2] = {
       {"Return", "↵ "}
       };
 
+void kv_invalidate_labels (struct keyboard_view_t *kv)
+{
+    kv->label_generation++;
+}
+
+// Returns true if the state labels depend on changed since the label cache was
+// last updated. Key presses that don't change the effective modifiers or layout
+// keep the same labels.
+bool kv_labels_changed (struct keyboard_view_t *kv,
+                        xkb_mod_mask_t *mods_out, xkb_layout_index_t *layout_out)
+{
+    xkb_mod_mask_t mods = 0;
+    xkb_layout_index_t layout = 0;
+    if (kv->xkb_state != NULL) {
+        mods = xkb_state_serialize_mods (kv->xkb_state, XKB_STATE_MODS_EFFECTIVE);
+        layout = xkb_state_serialize_layout (kv->xkb_state, XKB_STATE_LAYOUT_EFFECTIVE);
+    }
+
+    if (mods_out != NULL) *mods_out = mods;
+    if (layout_out != NULL) *layout_out = layout;
+
+    return kv->label_generation == 0 ||
+        kv->label_mods != mods ||
+        kv->label_layout != layout ||
+        kv->label_cache_mode != kv->label_mode;
+}
+
+void kv_update_label_cache (struct keyboard_view_t *kv)
+{
+    xkb_mod_mask_t mods;
+    xkb_layout_index_t layout;
+    if (kv_labels_changed (kv, &mods, &layout)) {
+        kv->label_mods = mods;
+        kv->label_layout = layout;
+        kv->label_cache_mode = kv->label_mode;
+        kv_invalidate_labels (kv);
+    }
+}
+
+xkb_keysym_t kv_get_keysym (struct keyboard_view_t *kv, int kc)
+{
+    if (kv->keysym_source_cb != NULL) {
+        return kv->keysym_source_cb (kv, kc);
+
+    } else if (kv->xkb_state != NULL) {
+        // @keycode_offset
+        return xkb_state_key_get_one_sym(kv->xkb_state, kc + 8);
+    }
+
+    return XKB_KEY_NoSymbol;
+}
+
+// NOTE: Call kv_update_label_cache() before this, otherwise the returned label
+// may be stale.
+char* kv_get_key_label (struct keyboard_view_t *kv, struct sgmt_t *key)
+{
+    if (is_unassigned (key)) {
+        return "";
+    }
+
+    struct kv_label_t *label = &kv->label_cache[key->kc];
+    if (label->generation == kv->label_generation) {
+        return label->str;
+    }
+
+    char *buff = label->str;
+    int buff_size = ARRAY_SIZE(label->str);
+    buff[0] = '\0';
+
+    switch (kv->label_mode) {
+        case KV_KEYSYM_LABELS:
+            if (key->kc == KEY_FN) {
+                strcpy (buff, "Fn");
+            }
+
+            xkb_keysym_t keysym = XKB_KEY_NoSymbol;
+            if (buff[0] == '\0') {
+                int buff_len = 0;
+                keysym = kv_get_keysym (kv, key->kc);
+                buff_len = xkb_keysym_to_utf8(keysym, buff, buff_size - 1);
+                buff[buff_len] = '\0';
+            }
+
+            if (buff[0] == '\0' || // Keysym is non printable
+                buff[0] == ' ' ||
+                buff[0] == '\x1b' || // Escape
+                buff[0] == '\x7f' || // Del
+                buff[0] == '\n' ||
+                buff[0] == '\r' ||
+                buff[0] == '\b' ||
+                buff[0] == '\t' )
+            {
+                xkb_keysym_get_name(keysym, buff, buff_size-1);
+                if (strcmp (buff, "NoSymbol") == 0) {
+                    buff[0] = '\0';
+                }
+
+                int i;
+                for (i=0; i < ARRAY_SIZE(keysym_representations); i++) {
+                    if (strcmp (buff, keysym_representations[i][0]) == 0) {
+                        strcpy (buff, keysym_representations[i][1]);
+                        break;
+                    }
+                }
+            }
+            break;
+
+        case KV_KEYCODE_LABELS:
+            snprintf (buff, buff_size, "%i", key->kc);
+            break;
+
+        default: break; // Leave an empty label
+    }
+
+    label->generation = kv->label_generation;
+    return buff;
+}
+
+// Timings are only measured if something shows them, otherwise we would be
+// calling get_wall_time_ms() for each key in every frame for nothing.
+static inline
+bool kv_timing_enabled (struct keyboard_view_t *kv)
+{
+    return kv->timing.show_overlay || kv->timing.log;
+}
+
+void kv_timing_push (struct kv_timing_series_t *series, double ms)
+{
+    series->samples[series->next] = ms;
+    series->next = (series->next + 1)%KV_TIMING_WINDOW;
+    if (series->num_samples < KV_TIMING_WINDOW) {
+        series->num_samples++;
+    }
+}
+
+templ_sort (kv_timing_sort, float, *a < *b)
+
+// Returns the _p_ percentile of the samples in the window, _p_ is in [0,1].
+float kv_timing_percentile (struct kv_timing_series_t *series, float p)
+{
+    if (series->num_samples == 0) {
+        return 0;
+    }
+
+    float sorted[KV_TIMING_WINDOW];
+    memcpy (sorted, series->samples, series->num_samples*sizeof(float));
+    kv_timing_sort (sorted, series->num_samples);
+    return sorted[(int)(p*(series->num_samples - 1) + 0.5)];
+}
+
+void str_cat_kv_timing_series (string_t *str, char *name, struct kv_timing_series_t *series)
+{
+    str_cat_printf (str, "%-8s p50 %6.2f  p95 %6.2f  p99 %6.2f ms", name,
+                    kv_timing_percentile (series, 0.5),
+                    kv_timing_percentile (series, 0.95),
+                    kv_timing_percentile (series, 0.99));
+}
+
+void str_cat_kv_timing (string_t *str, struct kv_timing_t *timing)
+{
+    struct {
+        char *name;
+        struct kv_timing_series_t *series;
+    } measurements[] = {
+        {"frame", &timing->frame},
+        {"labels", &timing->labels},
+        {"keys", &timing->keys},
+        {"multirow", &timing->multirow},
+        {"update", &timing->update},
+        {"latency", &timing->input_latency}
+    };
+
+    for (int i=0; i<ARRAY_SIZE(measurements); i++) {
+        if (i > 0) {
+            str_cat_c (str, "\n");
+        }
+        str_cat_kv_timing_series (str, measurements[i].name, measurements[i].series);
+    }
+}
+
+// The writer thread pushes its samples while holding the mutex.
+void str_cat_kv_autosave_stats (string_t *str, struct kv_autosave_writer_t *writer)
+{
+    if (writer->started) {
+        pthread_mutex_lock (&writer->mutex);
+    }
+
+    str_cat_printf (str, "autosave %" PRIu64 " requests, %" PRIu64 " writes\n",
+                    writer->num_requests, writer->num_writes);
+    str_cat_kv_timing_series (str, "write", &writer->write_time);
+    str_cat_c (str, "\n");
+    str_cat_kv_timing_series (str, "to disk", &writer->latency);
+
+    if (writer->started) {
+        pthread_mutex_unlock (&writer->mutex);
+    }
+}
+
+void kv_timing_log (struct keyboard_view_t *kv)
+{
+    string_t str = {0};
+    str_set_printf (&str, "Render timing, %" PRIu64 " frames:\n", kv->timing.num_frames);
+    str_cat_kv_timing (&str, &kv->timing);
+    str_cat_printf (&str, "\nmotion   %" PRIu64 " events processed, %" PRIu64 " dropped\n",
+                    kv->motion_events_processed, kv->motion_events_dropped);
+    str_cat_kv_autosave_stats (&str, &kv->autosave_writer);
+    printf ("%s\n", str_data(&str));
+    str_free (&str);
+}
+
+#define KV_TIMING_OVERLAY_MARGIN 5
+void kv_render_timing_overlay (cairo_t *cr, struct keyboard_view_t *kv)
+{
+    string_t str = {0};
+    str_cat_kv_timing (&str, &kv->timing);
+
+    PangoLayout *text_layout = pango_cairo_create_layout (cr);
+    {
+        PangoFontDescription *font_desc = pango_font_description_from_string ("Monospace 9");
+        pango_layout_set_font_description (text_layout, font_desc);
+        pango_font_description_free (font_desc);
+    }
+    pango_layout_set_text (text_layout, str_data(&str), str_len(&str));
+
+    PangoRectangle logical;
+    pango_layout_get_pixel_extents (text_layout, NULL, &logical);
+
+    // Draw it in the bottom left corner, away from the toolbar.
+    GdkRectangle *rect = &kv->timing.overlay_rect;
+    rect->width = logical.width + 2*KV_TIMING_OVERLAY_MARGIN;
+    rect->height = logical.height + 2*KV_TIMING_OVERLAY_MARGIN;
+    rect->x = KV_TIMING_OVERLAY_MARGIN;
+    rect->y = KV_TIMING_OVERLAY_MARGIN;
+    if (kv->widget != NULL) {
+        rect->y = gtk_widget_get_allocated_height (kv->widget) - rect->height - KV_TIMING_OVERLAY_MARGIN;
+    }
+
+    cairo_rectangle (cr, rect->x, rect->y, rect->width, rect->height);
+    cairo_set_source_rgba (cr, 0, 0, 0, 0.7);
+    cairo_fill (cr);
+
+    cairo_set_source_rgb (cr, 1, 1, 1);
+    cairo_move_to (cr, rect->x + KV_TIMING_OVERLAY_MARGIN, rect->y + KV_TIMING_OVERLAY_MARGIN);
+    pango_cairo_show_layout (cr, text_layout);
+
+    g_object_unref (text_layout);
+    str_free (&str);
+}
+
 gboolean keyboard_view_render (GtkWidget *widget, cairo_t *cr, gpointer data)
 {
     struct keyboard_view_t *kv = (struct keyboard_view_t*)data;
+    bool is_timed = kv_timing_enabled (kv);
+    double frame_start = is_timed ? get_wall_time_ms () : 0;
+    double labels_ms = 0, keys_ms = 0, multirow_ms = 0;
+
     cairo_set_source_rgba (cr, 1, 1, 1, 1);
     cairo_paint(cr);
     cairo_set_line_width (cr, 1);
@@ -948,75 +1585,58 @@ gboolean keyboard_view_render (GtkWidget *widget, cairo_t *cr, gpointer data)
     mem_pool_t pool = {0};
     double left_margin, top_margin;
     keyboard_view_get_margins (kv, &left_margin, &top_margin);
+    kv_update_label_cache (kv);
 
-    double y_pos = top_margin;
-    struct row_t *curr_row = kv->first_row;
-    while (curr_row != NULL) {
-        struct sgmt_t *curr_key = curr_row->first_key;
-        double x_pos = left_margin;
-        while (curr_key != NULL) {
-
-            // Compute the label for the key
-            char buff[64];
-            buff[0] = '\0';
-
-            if (!is_unassigned (curr_key)) {
-                switch (kv->label_mode) {
-                    case KV_KEYSYM_LABELS:
-                        if (curr_key->kc == KEY_FN) {
-                            strcpy (buff, "Fn");
-                        }
-
-                        xkb_keysym_t keysym = XKB_KEY_NoSymbol;
-                        if (buff[0] == '\0') {
-                            int buff_len = 0;
-                            // @keycode_offset
-                            keysym = xkb_state_key_get_one_sym(kv->xkb_state, curr_key->kc + 8);
-                            buff_len = xkb_keysym_to_utf8(keysym, buff, sizeof(buff) - 1);
-                            buff[buff_len] = '\0';
-                        }
-
-                        if (buff[0] == '\0' || // Keysym is non printable
-                            buff[0] == ' ' ||
-                            buff[0] == '\x1b' || // Escape
-                            buff[0] == '\x7f' || // Del
-                            buff[0] == '\n' ||
-                            buff[0] == '\r' ||
-                            buff[0] == '\b' ||
-                            buff[0] == '\t' )
-                        {
-                            xkb_keysym_get_name(keysym, buff, ARRAY_SIZE(buff)-1);
-                            if (strcmp (buff, "NoSymbol") == 0) {
-                                buff[0] = '\0';
-                            }
+    // When only some keys changed we get called with a clip region covering
+    // them, see kv_queue_draw_key(). Keys outside of it are skipped.
+    GdkRectangle clip;
+    bool has_clip = gdk_cairo_get_clip_rectangle (cr, &clip);
 
-                            int i;
-                            for (i=0; i < ARRAY_SIZE(keysym_representations); i++) {
-                                if (strcmp (buff, keysym_representations[i][0]) == 0) {
-                                    strcpy (buff, keysym_representations[i][1]);
-                                    break;
-                                }
-                            }
-                        }
-                        break;
+    struct kv_geometry_t *geo = kv_get_geometry (kv);
+    for (int r=0; r<geo->num_rows; r++) {
+        double y_pos = top_margin + geo->row_y[r];
+        if (has_clip && y_pos > clip.y + clip.height) {
+            break;
+        }
 
-                    case KV_KEYCODE_LABELS:
-                        snprintf (buff, ARRAY_SIZE(buff), "%i", curr_key->kc);
-                        break;
+        struct row_t *curr_row = geo->rows[r];
+        for (int i=geo->row_first[r]; i<geo->row_first[r+1]; i++) {
+            struct sgmt_t *curr_key = geo->sgmts[i];
+            double x_pos = left_margin + geo->x[i];
+            float key_width = geo->w[i], key_height = geo->h[i];
+
+            // Multirow keys are drawn when we find their multirow parent.
+            bool is_rectangular = geo->is_rectangular[i];
+            bool is_drawn;
+            if (is_rectangular) {
+                is_drawn = curr_key->type != KEY_MULTIROW_SEGMENT && curr_key->type != KEY_MULTIROW_SEGMENT_SIZED;
+            } else {
+                is_drawn = is_multirow_parent (curr_key);
+            }
 
-                    default: break; // Leave an empty label
-                }
+            // We don't compute the bounding box of non rectangular keys here,
+            // they are always drawn.
+            if (is_drawn && has_clip && is_rectangular) {
+                GdkRectangle key_rect;
+                key_rect.x = floor (x_pos);
+                key_rect.y = floor (y_pos);
+                key_rect.width = ceil (key_width) + 1;
+                key_rect.height = ceil (key_height) + 1;
+                is_drawn = gdk_rectangle_intersect (&clip, &key_rect, NULL);
             }
 
-            x_pos += (curr_key->internal_glue + get_sgmt_user_glue(curr_key))*kv->default_key_size;
+            if (is_drawn) {
+                double label_start = is_timed ? get_wall_time_ms () : 0;
+                char *label = kv_get_key_label (kv, curr_key);
+                double draw_start = is_timed ? get_wall_time_ms () : 0;
+                labels_ms += draw_start - label_start;
 
-            dvec4 key_color;
-            if (curr_key->type != KEY_MULTIROW_SEGMENT) {
+                dvec4 key_color;
                 if (kv->preview_mode == KV_PREVIEW_KEYS && curr_key == kv->preview_keys_selection) {
                     key_color = color_blue;
 
                 } else if (kv->selected_key != NULL && curr_key == kv->selected_key) {
-                    buff[0] = '\0';
+                    label = "";
                     key_color = color_red;
 
                 } else if (curr_key->type == KEY_PRESSED ||
@@ -1026,26 +1646,19 @@ gboolean keyboard_view_render (GtkWidget *widget, cairo_t *cr, gpointer data)
                 } else {
                     key_color = RGB(1,1,1);
                 }
-            }
 
-            float key_width, key_height;
-            if (compute_key_size (kv, curr_key, curr_row, &key_width, &key_height)) {
-                if (curr_key->type != KEY_MULTIROW_SEGMENT && curr_key->type != KEY_MULTIROW_SEGMENT_SIZED) {
-                    cr_render_key (cr, x_pos, y_pos, key_width, key_height, buff, key_color);
-                }
+                kv_render_key_cached (cr, kv, x_pos, y_pos, curr_row, curr_key, is_rectangular,
+                                      key_width, key_height, label, key_color);
 
-            } else {
-                if (is_multirow_parent(curr_key)) {
-                    cr_render_multirow_key (cr, x_pos, y_pos, kv, curr_row, curr_key, buff, key_color);
+                if (is_timed) {
+                    if (is_rectangular) {
+                        keys_ms += get_wall_time_ms () - draw_start;
+                    } else {
+                        multirow_ms += get_wall_time_ms () - draw_start;
+                    }
                 }
             }
-
-            x_pos += key_width;
-            curr_key = curr_key->next_sgmt;
         }
-
-        y_pos += curr_row->height*kv->default_key_size;
-        curr_row = curr_row->next_row;
     }
 
     if (kv->active_tool == KV_TOOL_ADD_KEY && !kv->to_add_rect_hidden) {
@@ -1060,6 +1673,29 @@ gboolean keyboard_view_render (GtkWidget *widget, cairo_t *cr, gpointer data)
     cairo_fill (cr);
 #endif
 
+    // The overlay shows the percentiles up to the previous frame.
+    if (kv->timing.show_overlay) {
+        kv_render_timing_overlay (cr, kv);
+    }
+
+    if (is_timed) {
+        struct kv_timing_t *timing = &kv->timing;
+        double frame_end = get_wall_time_ms ();
+        kv_timing_push (&timing->frame, frame_end - frame_start);
+        kv_timing_push (&timing->labels, labels_ms);
+        kv_timing_push (&timing->keys, keys_ms);
+        kv_timing_push (&timing->multirow, multirow_ms);
+        if (timing->pending_input_start != 0) {
+            kv_timing_push (&timing->input_latency, frame_end - timing->pending_input_start);
+            timing->pending_input_start = 0;
+        }
+
+        timing->num_frames++;
+        if (timing->log && timing->num_frames%KV_TIMING_WINDOW == 0) {
+            kv_timing_log (kv);
+        }
+    }
+
     mem_pool_destroy (&pool);
     return FALSE;
 }
@@ -1081,17 +1717,81 @@ struct sgmt_t** kv_get_sgmt_ptr (struct row_t *row, struct sgmt_t *sgmt)
     return key_ptr;
 }
 
+// Point query in keyboard coordinates (margins not included). Sets row_idx to
+// the row containing y and sgmt_idx to the first segment in it whose right
+// edge is to the right of x. The segment is hit if its left edge is to the left
+// of x, otherwise x is in the glue before it. If x is past the last segment of
+// the row, sgmt_idx is set to the end of the row's range.
+//
+// For LOCATE_OUTSIDE_BOTTOM row_idx is set to num_rows. This is O(1) except
+// for cells containing more than one row or segment, which requires keys
+// narrower than a quarter of the default key size.
 enum locate_sgmt_status_t
-kv_locate_sgmt (struct keyboard_view_t *kv, double x, double y,
-                struct sgmt_t **sgmt, struct row_t **row,
-                struct sgmt_t ***sgmt_ptr,
-                double *x_pos, double *y_pos,
-                double *left_margin, double *top_margin)
+kv_geometry_locate (struct kv_geometry_t *geo, double x, double y, int *row_idx, int *sgmt_idx)
+{
+    *row_idx = 0;
+    *sgmt_idx = 0;
+    if (y < 0) {
+        return LOCATE_OUTSIDE_TOP;
+    }
+
+    int c = (int)(y/geo->cell_size);
+    if (c >= geo->num_row_cells) {
+        *row_idx = geo->num_rows;
+        return LOCATE_OUTSIDE_BOTTOM;
+    }
+
+    int r = geo->row_cells[c];
+    while (r < geo->num_rows && geo->row_y[r] + geo->row_h[r] <= y) {
+        r++;
+    }
+    *row_idx = r;
+
+    if (r == geo->num_rows) {
+        return LOCATE_OUTSIDE_BOTTOM;
+    }
+
+    int end = geo->row_first[r+1];
+    int i = geo->row_first[r];
+    if (x > 0) {
+        c = (int)(x/geo->cell_size);
+        if (c < geo->col_cells_first[r+1] - geo->col_cells_first[r]) {
+            i = geo->col_cells[geo->col_cells_first[r] + c];
+        } else {
+            i = end;
+        }
+    }
+
+    while (i < end && geo->x[i] + geo->w[i] <= x) {
+        i++;
+    }
+    *sgmt_idx = i;
+
+    if (i < end && geo->x[i] <= x) {
+        return LOCATE_HIT_KEY;
+    } else {
+        return LOCATE_HIT_GLUE;
+    }
+}
+
+// Same as kv_locate_sgmt() but also returns the index of the segment in the
+// geometry table when a key is hit, otherwise sgmt_idx is set to -1.
+enum locate_sgmt_status_t
+kv_locate_sgmt_full (struct keyboard_view_t *kv, double x, double y,
+                     struct sgmt_t **sgmt, struct row_t **row,
+                     struct sgmt_t ***sgmt_ptr,
+                     double *x_pos, double *y_pos,
+                     double *left_margin, double *top_margin,
+                     int *sgmt_idx)
 {
     enum locate_sgmt_status_t status;
     double kbd_x, kbd_y;
     keyboard_view_get_margins (kv, &kbd_x, &kbd_y);
 
+    if (sgmt_idx != NULL) {
+        *sgmt_idx = -1;
+    }
+
     if (left_margin != NULL) {
         *left_margin = kbd_x;
     }
@@ -1107,59 +1807,37 @@ kv_locate_sgmt (struct keyboard_view_t *kv, double x, double y,
         return LOCATE_OUTSIDE_TOP;
     }
 
-    struct row_t *curr_row = kv->first_row;
-    while (curr_row != NULL) {
-        float next_y = kbd_y + curr_row->height*kv->default_key_size;
-        if (next_y > y) {
-            // In this case x_kbd now contains the x coordinate of the
-            // rectangle (top left corner).
-            break;
-        }
-        // We only commit to the updated kbd_y after we check we don't want to
-        // break.
-        kbd_y = next_y;
-
-        curr_row = curr_row->next_row;
+    struct kv_geometry_t *geo = kv_get_geometry (kv);
+    int r, i;
+    status = kv_geometry_locate (geo, x - kbd_x, y - kbd_y, &r, &i);
+    if (sgmt_idx != NULL && status == LOCATE_HIT_KEY) {
+        *sgmt_idx = i;
     }
 
-    if (curr_row == NULL) {
+    if (status == LOCATE_OUTSIDE_BOTTOM) {
         if (y_pos != NULL) {
+            if (geo->num_rows > 0) {
+                kbd_y += geo->row_y[r-1] + geo->row_h[r-1];
+            }
             *y_pos = kbd_y;
         }
         return LOCATE_OUTSIDE_BOTTOM;
     }
+    kbd_y += geo->row_y[r];
+    struct row_t *curr_row = geo->rows[r];
 
+    // NOTE: If x is inside a glue we return the segment after it.
+    int first = geo->row_first[r], end = geo->row_first[r+1];
     struct sgmt_t *curr_key = NULL, *prev_key = NULL;
-    if (curr_row != NULL) {
-        curr_key = curr_row->first_key;
-        while (curr_key != NULL) {
-            // Check if x is inside a glue, if the point is here we return NULL.
-            kbd_x += (curr_key->internal_glue + get_sgmt_user_glue(curr_key))*kv->default_key_size;
-            if (kbd_x > x) {
-                status = LOCATE_HIT_GLUE;
-                break;
-            }
-
-            float next_x;
-            next_x = kbd_x + get_sgmt_width (curr_key)*kv->default_key_size;
-
-            if (next_x > x) {
-                // In this case x_kbd now contains the x coordinate of the
-                // rectangle (top left corner).
-                status = LOCATE_HIT_KEY;
-                break;
-            }
-            // We only commit to the updated kbd_x after we check we don't want
-            // to break.
-            kbd_x = next_x;
-
-            prev_key = curr_key;
-            curr_key = curr_key->next_sgmt;
-        }
+    if (i < end) {
+        curr_key = geo->sgmts[i];
+        kbd_x += geo->x[i];
+    } else if (end > first) {
+        kbd_x += geo->x[end-1] + geo->w[end-1];
+    }
 
-        if (curr_key == NULL) {
-            status = LOCATE_HIT_GLUE;
-        }
+    if (i > first) {
+        prev_key = geo->sgmts[i-1];
     }
 
     if (x_pos != NULL) {
@@ -1192,15 +1870,26 @@ kv_locate_sgmt (struct keyboard_view_t *kv, double x, double y,
     return status;
 }
 
+enum locate_sgmt_status_t
+kv_locate_sgmt (struct keyboard_view_t *kv, double x, double y,
+                struct sgmt_t **sgmt, struct row_t **row,
+                struct sgmt_t ***sgmt_ptr,
+                double *x_pos, double *y_pos,
+                double *left_margin, double *top_margin)
+{
+    return kv_locate_sgmt_full (kv, x, y, sgmt, row, sgmt_ptr, x_pos, y_pos,
+                                left_margin, top_margin, NULL);
+}
+
 struct sgmt_t* keyboard_view_get_key (struct keyboard_view_t *kv, double x, double y,
                                      GdkRectangle *rect, bool *is_rectangular,
                                      struct sgmt_t **clicked_sgmt, struct sgmt_t ***parent_ptr)
 {
     double kbd_x, kbd_y;
     struct sgmt_t *curr_key, **curr_key_ptr;
-    struct row_t *curr_row;
+    int i;
     enum locate_sgmt_status_t status =
-        kv_locate_sgmt (kv, x, y, &curr_key, &curr_row, &curr_key_ptr, &kbd_x, &kbd_y, NULL, NULL);
+        kv_locate_sgmt_full (kv, x, y, &curr_key, NULL, &curr_key_ptr, &kbd_x, &kbd_y, NULL, NULL, &i);
 
     if (status == LOCATE_OUTSIDE_TOP || status == LOCATE_OUTSIDE_BOTTOM) {
         return NULL;
@@ -1211,19 +1900,22 @@ struct sgmt_t* keyboard_view_get_key (struct keyboard_view_t *kv, double x, doub
             *clicked_sgmt = curr_key;
         }
 
+        struct kv_geometry_t *geo = kv_get_geometry (kv);
+
+        bool l_is_rectangular = geo->is_rectangular[i];
+        if (is_rectangular != NULL) {
+            *is_rectangular = l_is_rectangular;
+        }
+
         if (rect != NULL) {
-            float key_width, key_height;
-            float multirow_y_offset;
-            // For non rectangular multirow keys this returns the rectangle
-            // of the segment where x and y are.
-            bool l_is_rectangular = compute_key_size_full (kv, curr_key, curr_row, &key_width, &key_height, &multirow_y_offset);
-            if (is_rectangular != NULL) {
-                *is_rectangular = l_is_rectangular;
+            // For non rectangular multirow keys this is the rectangle of the
+            // segment where x and y are.
+            rect->width = (int)geo->w[i];
+            rect->height = (int)geo->h[i];
+            rect->y = kbd_y;
+            if (l_is_rectangular) {
+                rect->y -= geo->y[i] - geo->y[geo->parent_idx[i]];
             }
-
-            rect->width = (int)key_width;
-            rect->height = (int)key_height;
-            rect->y = kbd_y - multirow_y_offset;
             rect->x = kbd_x;
 
             kv->debug_rect = *rect;
@@ -1232,17 +1924,14 @@ struct sgmt_t* keyboard_view_get_key (struct keyboard_view_t *kv, double x, doub
         // In a multirow key data is stored in the multirow parent. Make the
         // return value the multirow parent of the key.
         if (is_multirow_key(curr_key) && !is_multirow_parent(curr_key)) {
-            curr_key = kv_get_multirow_parent (curr_key);
+            int parent_idx = geo->parent_idx[i];
+            curr_key = geo->sgmts[parent_idx];
 
             // Because we changed the curr_key that will be returned and is
             // expected to be the multirow parent. If th caller also wants it's
             // parent_ptr, then we need to look it up.
             if (parent_ptr != NULL) {
-                *parent_ptr = NULL;
-
-                if (curr_key != NULL) {
-                    *parent_ptr = kv_get_sgmt_ptr (kv_get_row (kv, curr_key), curr_key);
-                }
+                *parent_ptr = kv_get_sgmt_ptr (geo->rows[geo->row_idx[parent_idx]], curr_key);
             }
 
         } else {
@@ -1263,33 +1952,83 @@ float kv_get_sgmt_x_pos (struct keyboard_view_t *kv, struct sgmt_t *sgmt)
     double kbd_x, kbd_y;
     keyboard_view_get_margins (kv, &kbd_x, &kbd_y);
 
-    float x = 0;
-    struct row_t *curr_row = kv->first_row;
-    while (curr_row != NULL) {
-        struct sgmt_t *curr_key = curr_row->first_key;
-        x = kbd_x;
-        while (curr_key != NULL) {
-            x += (curr_key->internal_glue + get_sgmt_user_glue(curr_key))*kv->default_key_size;
+    struct kv_geometry_t *geo = kv_get_geometry (kv);
+    int i = kv_geometry_find (geo, -1, sgmt);
+    assert (i != -1);
 
-            if (curr_key == sgmt) {
-                break;
-            }
+    return kbd_x + geo->x[i];
+}
 
-            x += get_sgmt_width (curr_key)*kv->default_key_size;
+// Computes the bounding box of key in widget coordinates. For multirow keys this
+// is the bounding box of all their segments.
+void kv_get_key_bounding_rect (struct keyboard_view_t *kv, struct sgmt_t *key, GdkRectangle *rect)
+{
+    *rect = ZERO_INIT (GdkRectangle);
 
-            curr_key = curr_key->next_sgmt;
-        }
+    struct kv_geometry_t *geo = kv_get_geometry (kv);
+    int key_idx = kv_geometry_find (geo, -1, key);
+    if (key_idx == -1) {
+        return;
+    }
+    key_idx = geo->parent_idx[key_idx];
 
-        if (curr_key != NULL) {
-            break;
+    double left_margin, top_margin;
+    keyboard_view_get_margins (kv, &left_margin, &top_margin);
+
+    double min_x = INFINITY, min_y = INFINITY;
+    double max_x = -INFINITY, max_y = -INFINITY;
+    for (int i=key_idx; i<geo->num_sgmts; i++) {
+        if (geo->parent_idx[i] == key_idx) {
+            min_x = MIN (min_x, geo->x[i]);
+            min_y = MIN (min_y, geo->y[i]);
+            max_x = MAX (max_x, geo->x[i] + geo->w[i]);
+            max_y = MAX (max_y, geo->y[i] + geo->row_h[geo->row_idx[i]]);
         }
-        curr_row = curr_row->next_row;
     }
 
-    return x;
+    rect->x = floor (left_margin + min_x);
+    rect->y = floor (top_margin + min_y);
+    rect->width = ceil (left_margin + max_x) - rect->x + 1;
+    rect->height = ceil (top_margin + max_y) - rect->y + 1;
+}
+
+// Returns false if there was no key to draw.
+bool kv_queue_draw_key (struct keyboard_view_t *kv, struct sgmt_t *key)
+{
+    if (key == NULL) return false;
+
+    GdkRectangle rect;
+    kv_get_key_bounding_rect (kv, key, &rect);
+    gtk_widget_queue_draw_area (kv->widget, rect.x, rect.y, rect.width, rect.height);
+    return true;
+}
+
+// Makes labels come from _cb_ instead of the keymap, or from the keymap again
+// if it's NULL. Callers that change what _cb_ returns for a key must call
+// keyboard_view_invalidate_key().
+void keyboard_view_set_keysym_source (struct keyboard_view_t *kv, kv_keysym_source_cb_t *cb)
+{
+    kv->keysym_source_cb = cb;
+    kv_invalidate_labels (kv);
+
+    if (kv->widget != NULL) {
+        gtk_widget_queue_draw (kv->widget);
+    }
+}
+
+// Recomputes the label of the key with keycode _kc_ and redraws only that key.
+void keyboard_view_invalidate_key (struct keyboard_view_t *kv, int kc)
+{
+    // Entries with generation 0 are always stale, label_generation is
+    // incremented before any label is cached.
+    kv->label_cache[kc].generation = 0;
+
+    if (kv->widget != NULL) {
+        kv_queue_draw_key (kv, kv_get_key_by_kc (kv, kc));
+    }
 }
 
-void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, GdkEvent *e);
+bool kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, GdkEvent *e);
 
 void start_edit_handler (GtkButton *button, gpointer user_data)
 {
@@ -1394,7 +2133,7 @@ void kv_keycode_reassign_selected_key (struct keyboard_view_t *kv, uint16_t new_
 {
     // If the keycode was already assigned, unassign it from that
     // key.
-    struct sgmt_t *new_kc_key = kv->keys_by_kc[new_kc];
+    struct sgmt_t *new_kc_key = kv_get_key_by_kc (kv, new_kc);
     if (new_kc_key != NULL) {
         // NOTE: Because key_event_key won't be accessible again
         // through keys_by_kc (the selected key wil take it's place
@@ -1409,7 +2148,7 @@ void kv_keycode_reassign_selected_key (struct keyboard_view_t *kv, uint16_t new_
     // If selected_key has a keycode assigned, remove it's pointer
     // from keys_by_kc because it will change position.
     if (!is_unassigned(kv->selected_key)) {
-        kv->keys_by_kc[kv->selected_key->kc] = NULL;
+        kv_set_key_by_kc (kv, kv->selected_key->kc, NULL);
     }
 
     // Update selected_key info
@@ -1418,7 +2157,7 @@ void kv_keycode_reassign_selected_key (struct keyboard_view_t *kv, uint16_t new_
 
     // Put a pointer to selected_key in the correct position in
     // keys_by_kc.
-    kv->keys_by_kc[new_kc] = kv->selected_key;
+    kv_set_key_by_kc (kv, new_kc, kv->selected_key);
 }
 
 void keycode_lookup_on_popup_close (GtkWidget *object, gpointer user_data)
@@ -1494,17 +2233,240 @@ bool maybe_get_overwrite_confirmation (struct keyboard_view_t *kv, char *path)
         }
         gtk_widget_destroy (dialog);
 
-        free (fname);
+        free (fname);
+    }
+
+    return write;
+}
+
+// Autosaves happen after every edit, and writing them on slow or network home
+// directories may take long enough to stall the UI. Instead they are posted to
+// a writer thread. Requests for the same file are coalesced, only the newest
+// one is written, and writing waits until no request has been posted for
+// KV_AUTOSAVE_DEBOUNCE_MS so a burst of edits results in a single write.
+//
+// Files are written to a temporary file that is fsync()ed and then renamed
+// over the autosave, so a crash never leaves a truncated autosave.
+//
+// Code that reads autosaves from disk must call kv_autosave_writer_flush()
+// first.
+#define KV_AUTOSAVE_DEBOUNCE_MS 300
+
+bool kv_autosave_write_file (char *path, char *data, size_t len)
+{
+    bool success = true;
+
+    string_t tmp_path = str_new (path);
+    str_cat_c (&tmp_path, ".tmp");
+
+    int fd = open (str_data(&tmp_path), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        printf ("Error opening %s: %s\n", str_data(&tmp_path), strerror(errno));
+        success = false;
+    }
+
+    size_t written = 0;
+    while (success && written < len) {
+        ssize_t status = write (fd, data + written, len - written);
+        if (status == -1) {
+            if (errno != EINTR) {
+                printf ("Error writing %s: %s\n", str_data(&tmp_path), strerror(errno));
+                success = false;
+            }
+        } else {
+            written += status;
+        }
+    }
+
+    if (success && fsync (fd) == -1) {
+        printf ("Error syncing %s: %s\n", str_data(&tmp_path), strerror(errno));
+        success = false;
+    }
+
+    if (fd != -1) {
+        close (fd);
+    }
+
+    if (success && rename (str_data(&tmp_path), path) == -1) {
+        printf ("Error renaming %s: %s\n", str_data(&tmp_path), strerror(errno));
+        success = false;
+    }
+
+    if (!success && fd != -1) {
+        unlink (str_data(&tmp_path));
+    }
+
+    str_free (&tmp_path);
+    return success;
+}
+
+void kv_autosave_request_free (struct kv_autosave_request_t *request)
+{
+    free (request->path);
+    free (request->data);
+    free (request);
+}
+
+void kv_autosave_writer_process (struct kv_autosave_writer_t *writer,
+                                 struct kv_autosave_request_t *requests)
+{
+    while (requests != NULL) {
+        struct kv_autosave_request_t *request = requests;
+        requests = requests->next;
+
+        double start = get_wall_time_ms ();
+        if (request->data != NULL) {
+            kv_autosave_write_file (request->path, request->data, request->len);
+
+        } else if (unlink (request->path) != 0 && errno != ENOENT) {
+            printf ("Error deleting autosave: %s\n", strerror(errno));
+        }
+        double end = get_wall_time_ms ();
+
+        pthread_mutex_lock (&writer->mutex);
+        kv_timing_push (&writer->write_time, end - start);
+        kv_timing_push (&writer->latency, end - request->post_time);
+        writer->num_writes++;
+        pthread_mutex_unlock (&writer->mutex);
+
+        kv_autosave_request_free (request);
+    }
+}
+
+void* kv_autosave_writer_thread (void *data)
+{
+    struct kv_autosave_writer_t *writer = (struct kv_autosave_writer_t*)data;
+
+    pthread_mutex_lock (&writer->mutex);
+    while (!writer->stop || writer->pending != NULL) {
+        if (writer->pending == NULL) {
+            pthread_cond_wait (&writer->cond, &writer->mutex);
+            continue;
+        }
+
+        double deadline = writer->last_post_time + KV_AUTOSAVE_DEBOUNCE_MS;
+        if (!writer->stop && !writer->flush && get_wall_time_ms () < deadline) {
+            struct timespec ts;
+            ts.tv_sec = deadline/1000;
+            ts.tv_nsec = (deadline - ts.tv_sec*1000.0)*1000000;
+            pthread_cond_timedwait (&writer->cond, &writer->mutex, &ts);
+            continue;
+        }
+
+        struct kv_autosave_request_t *requests = writer->pending;
+        writer->pending = NULL;
+        writer->busy = true;
+        pthread_mutex_unlock (&writer->mutex);
+
+        kv_autosave_writer_process (writer, requests);
+
+        pthread_mutex_lock (&writer->mutex);
+        writer->busy = false;
+        pthread_cond_broadcast (&writer->cond);
+    }
+    pthread_mutex_unlock (&writer->mutex);
+
+    return NULL;
+}
+
+// Queues a write of _len_ bytes of _data_ into _path_, replacing any pending
+// write to the same path. If _data_ is NULL or empty the file is removed
+// instead, an empty file has nothing to read back. Both arguments are copied.
+void kv_autosave_writer_post (struct kv_autosave_writer_t *writer, char *path,
+                              char *data, uint32_t len)
+{
+    if (!writer->started) {
+        // Deadlines are computed with get_wall_time_ms() so the condition
+        // variable must use the monotonic clock too.
+        pthread_condattr_t attr;
+        pthread_condattr_init (&attr);
+        pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+        pthread_cond_init (&writer->cond, &attr);
+        pthread_condattr_destroy (&attr);
+
+        pthread_mutex_init (&writer->mutex, NULL);
+        pthread_create (&writer->thread, NULL, kv_autosave_writer_thread, writer);
+        writer->started = true;
+    }
+
+    struct kv_autosave_request_t *request = malloc (sizeof(struct kv_autosave_request_t));
+    *request = ZERO_INIT(struct kv_autosave_request_t);
+    request->path = strdup (path);
+    if (data != NULL && len > 0) {
+        request->len = len;
+        request->data = malloc (request->len);
+        memcpy (request->data, data, request->len);
+    }
+
+    pthread_mutex_lock (&writer->mutex);
+    {
+        struct kv_autosave_request_t **pos = &writer->pending;
+        while (*pos != NULL && strcmp ((*pos)->path, path) != 0) {
+            pos = &(*pos)->next;
+        }
+
+        // The latency of a coalesced request is measured from the first
+        // request that wasn't written.
+        if (*pos != NULL) {
+            struct kv_autosave_request_t *replaced = *pos;
+            request->post_time = replaced->post_time;
+            request->next = replaced->next;
+            kv_autosave_request_free (replaced);
+        } else {
+            request->post_time = get_wall_time_ms ();
+        }
+        *pos = request;
+
+        writer->last_post_time = get_wall_time_ms ();
+        writer->num_requests++;
+    }
+    pthread_cond_broadcast (&writer->cond);
+    pthread_mutex_unlock (&writer->mutex);
+}
+
+// Blocks until all posted requests are on disk.
+void kv_autosave_writer_flush (struct kv_autosave_writer_t *writer)
+{
+    if (!writer->started) {
+        return;
+    }
+
+    pthread_mutex_lock (&writer->mutex);
+    writer->flush = true;
+    pthread_cond_broadcast (&writer->cond);
+    while (writer->pending != NULL || writer->busy) {
+        pthread_cond_wait (&writer->cond, &writer->mutex);
+    }
+    writer->flush = false;
+    pthread_mutex_unlock (&writer->mutex);
+}
+
+void kv_autosave_writer_destroy (struct kv_autosave_writer_t *writer)
+{
+    if (!writer->started) {
+        return;
     }
 
-    return write;
+    pthread_mutex_lock (&writer->mutex);
+    writer->stop = true;
+    pthread_cond_broadcast (&writer->cond);
+    pthread_mutex_unlock (&writer->mutex);
+    pthread_join (writer->thread, NULL);
+
+    pthread_cond_destroy (&writer->cond);
+    pthread_mutex_destroy (&writer->mutex);
+    writer->started = false;
 }
 
 void kv_set_current_repr (struct keyboard_view_t *kv, struct kv_repr_t *repr);
 void kv_reload_representations (struct keyboard_view_t *kv, const char *name, bool saved)
 {
+    // Autosaves are read from disk.
+    kv_autosave_writer_flush (&kv->autosave_writer);
+
     // Reload representations into a new repr_store
     struct kv_repr_store_t *repr_store = kv_repr_store_new (str_data(&kv->repr_path));
+    kv_repr_store_set_history_max_size (repr_store, kv->repr_store->history_max_size);
 
     // Lookup the representation mathching name and saved arguments.
     struct kv_repr_t *curr_repr = kv_repr_get_by_name (repr_store, name);
@@ -1519,9 +2481,23 @@ void kv_reload_representations (struct keyboard_view_t *kv, const char *name, bo
     kv_rebuild_repr_combobox (kv, repr_store->curr_repr, saved);
 }
 
-#define kv_curr_repr_is_saved(kv) ((kv)->repr_store->curr_repr->states==(kv)->repr_store->curr_repr->last_state)
-#define repr_is_saved(repr) ((repr)->states==(repr)->last_state)
-#define kv_curr_repr(kv) ((kv)->repr_store->curr_repr->last_state->repr)
+#define kv_curr_repr_is_saved(kv) repr_is_saved((kv)->repr_store->curr_repr)
+#define kv_curr_repr(kv,len) kv_repr_get_current((kv)->repr_store->curr_repr,len)
+
+// Autosaves and history states can be blobs but representations saved by the
+// user are always text.
+char* kv_repr_data_to_string (mem_pool_t *pool, char *data, uint32_t len)
+{
+    if (!kv_is_blob (data, len)) {
+        return pom_strndup (pool, data, len);
+    }
+
+    struct keyboard_view_t *tmp_kv = kv_new ();
+    kv_set_from_blob (tmp_kv, data, len);
+    char *str = kv_to_string (pool, tmp_kv);
+    keyboard_view_destroy (tmp_kv);
+    return str;
+}
 
 void kv_repr_save_current (struct keyboard_view_t *kv, const char *name, bool confirm_overwrite)
 {
@@ -1556,7 +2532,16 @@ void kv_repr_save_current (struct keyboard_view_t *kv, const char *name, bool co
         !exist_internal_repr_with_same_name &&
         (!confirm_overwrite || maybe_get_overwrite_confirmation (kv, str_data (&repr_path)))) {
 
-        full_file_write (kv_curr_repr(kv), strlen(kv_curr_repr(kv)), str_data (&repr_path));
+        // A pending autosave could be written after we remove it.
+        kv_autosave_writer_flush (&kv->autosave_writer);
+
+        mem_pool_t pool = {0};
+        uint32_t len;
+        char *data = kv_curr_repr(kv, &len);
+        char *str = kv_repr_data_to_string (&pool, data, len);
+        full_file_write (str, strlen(str), str_data (&repr_path));
+        mem_pool_destroy (&pool);
+
         str_put_c (&repr_path, repr_path_len, kv->repr_store->curr_repr->name);
         str_cat_c (&repr_path, ".autosave.lrep");
         if (unlink (str_data (&repr_path)) != 0) {
@@ -1657,11 +2642,15 @@ void save_view_handler (GtkButton *button, gpointer user_data)
 void kv_load_current_repr (struct keyboard_view_t *kv, bool saved)
 {
     kv_clear (kv);
+
+    uint32_t len;
+    char *data;
     if (saved) {
-        kv_set_from_string (kv, kv->repr_store->curr_repr->states->repr);
+        data = kv_repr_get_saved (kv->repr_store->curr_repr, &len);
     } else {
-        kv_set_from_string (kv, kv->repr_store->curr_repr->last_state->repr);
+        data = kv_repr_get_current (kv->repr_store->curr_repr, &len);
     }
+    kv_set_from_repr_data (kv, data, len);
 }
 
 void kv_set_current_repr (struct keyboard_view_t *kv, struct kv_repr_t *repr)
@@ -1690,7 +2679,8 @@ void kv_set_current_repr (struct keyboard_view_t *kv, struct kv_repr_t *repr)
 
     // Update settings so the active representation becomes the one just set
     // :implement_better_persistent_settings
-    full_file_write (repr->name, strlen(repr->name), str_data(&kv->settings_file_path));
+    kv_autosave_writer_post (&kv->autosave_writer, str_data(&kv->settings_file_path),
+                             repr->name, strlen (repr->name));
 }
 
 void change_repr_handler (GtkComboBox *themes_combobox, gpointer user_data)
@@ -2420,7 +3410,8 @@ void kv_change_edge_width (struct keyboard_view_t *kv,
                     glue_info[undo_i].key->user_glue = 0;
                     undo_i++;
                 }
-                kv_compute_glue (kv);
+                kv_mark_glue_dirty (kv, edge_start);
+                kv_compute_glue_dirty (kv);
             }
             i++;
         }
@@ -2440,7 +3431,8 @@ void kv_change_edge_width (struct keyboard_view_t *kv,
                 glue_info[i].key->user_glue = 0;
                 i++;
             }
-            kv_compute_glue (kv);
+            kv_mark_glue_dirty (kv, edge_start);
+            kv_compute_glue_dirty (kv);
         }
 
         // delta_w may have changed, update glue_adjust
@@ -2471,6 +3463,7 @@ void kv_change_edge_width (struct keyboard_view_t *kv,
 void kv_resize_sgmt (struct keyboard_view_t *kv, struct sgmt_t *prev_multirow,
                      struct sgmt_t *sgmt, float delta_w, bool edit_right_edge)
 {
+    kv_mark_glue_dirty (kv, sgmt);
     sgmt->width += delta_w;
 
     if (prev_multirow != NULL) {
@@ -2590,7 +3583,7 @@ void kv_change_sgmt_width (struct keyboard_view_t *kv,
     float step_dw = bnd_delta_update_inv (sgmt->width, sgmt->width + delta_w, original_glue_plus_w);
     if (!did_left_edge_adjust && do_glue_adjust && delta_w < 0 && step_dw != 0) {
         kv_resize_sgmt (kv, prev_multirow, sgmt, step_dw, is_right_edge);
-        kv_compute_glue (kv);
+        kv_compute_glue_dirty (kv);
         delta_w -= step_dw;
 
         // delta_w may have changed, update glue_adjust
@@ -2847,6 +3840,7 @@ struct sgmt_t* kv_insert_new_sgmt (struct keyboard_view_t *kv,
     // Insert the new key
     new_key->next_sgmt = *sgmt_ptr;
     *(sgmt_ptr) = new_key;
+    kv_mark_glue_dirty (kv, new_key);
 
     return new_key;
 }
@@ -2855,18 +3849,27 @@ bool kv_push_state_to_curr_repr (struct keyboard_view_t *kv)
 {
     bool retval = false;
 
-    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (&kv->repr_store->pool);
-
-    char *str = kv_to_string (&kv->repr_store->pool, kv);
+    mem_pool_t pool = {0};
+    uint32_t blob_len;
+    char *blob = kv_to_blob (&pool, kv, &blob_len);
+
+    // The current state is text if nothing has been pushed since it was
+    // loaded, compare it as text so unchanged views don't create a state.
+    uint32_t curr_len;
+    char *curr = kv_curr_repr(kv, &curr_len);
+    bool changed;
+    if (kv_is_blob (curr, curr_len)) {
+        changed = blob_len != curr_len || memcmp (blob, curr, blob_len) != 0;
+    } else {
+        changed = strcmp (kv_to_string (&pool, kv), curr) != 0;
+    }
 
-    if (strcmp (str, kv_curr_repr(kv)) != 0) {
+    if (changed) {
         retval = true;
-        kv_repr_push_state_no_dup (kv->repr_store, kv->repr_store->curr_repr, str);
-
-    } else {
-        mem_pool_end_temporary_memory (mrkr);
+        kv_repr_push_state (kv->repr_store, kv->repr_store->curr_repr, blob, blob_len);
     }
 
+    mem_pool_destroy (&pool);
     return retval;
 }
 
@@ -2880,11 +3883,17 @@ void kv_autosave (struct keyboard_view_t *kv)
         string_t path = str_dup(&kv->repr_path);
         str_cat_c (&path, kv->repr_store->curr_repr->name);
         str_cat_c (&path, ".autosave.lrep");
-        full_file_write (kv_curr_repr(kv), strlen(kv_curr_repr(kv)), str_data(&path));
+        uint32_t len;
+        char *data = kv_curr_repr(kv, &len);
+        kv_autosave_writer_post (&kv->autosave_writer, str_data(&path), data, len);
         str_free (&path);
 
+        // The new state is already in the representation store, we only need
+        // to show it as unsaved.
         if (was_saved) {
-            kv_reload_representations (kv, kv->repr_store->curr_repr->name, false);
+            struct kv_repr_t *repr = kv->repr_store->curr_repr;
+            kv_set_current_repr (kv, repr);
+            kv_rebuild_repr_combobox (kv, repr, false);
         }
 
         assert (!kv_curr_repr_is_saved (kv));
@@ -2892,13 +3901,39 @@ void kv_autosave (struct keyboard_view_t *kv)
 
 }
 
+// Moves the current representation one state back or forward in its history
+// and loads it. The autosave is updated to the new state, or removed if we got
+// back to the saved state.
+void kv_history_move (struct keyboard_view_t *kv, bool redo)
+{
+    struct kv_repr_t *repr = kv->repr_store->curr_repr;
+    bool moved = redo ? kv_repr_redo (repr) : kv_repr_undo (repr);
+    if (!moved) {
+        return;
+    }
+
+    kv_load_current_repr (kv, false);
+
+    string_t path = str_dup(&kv->repr_path);
+    str_cat_c (&path, repr->name);
+    str_cat_c (&path, ".autosave.lrep");
+    uint32_t len = 0;
+    char *data = repr_is_saved (repr) ? NULL : kv_curr_repr(kv, &len);
+    kv_autosave_writer_post (&kv->autosave_writer, str_data(&path), data, len);
+    str_free (&path);
+
+    kv_set_current_repr (kv, repr);
+    kv_rebuild_repr_combobox (kv, repr, false);
+}
+
 // FIXME: I was unable to easily find the height of the toolbar to ignore clicks
 // when setting the tool. The grid widget kv->toolbar is the size of the full
 // keyboard view, the size of the tool buttons in kv_set_full_toolbar() is 1px
 // who knows why. I just hardcoded an approximate value.
 #define KV_TOOLBAR_HEIGHT 25 //px
 
-void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, GdkEvent *e)
+// Returns true if a redraw was queued.
+bool kv_update_handle (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, GdkEvent *e)
 {
     // To avoid segfaults when e==NULL without having to check if e==NULL every
     // time, create a dmmy event that has a type that will fail all checks.
@@ -2908,6 +3943,14 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
         e = &null_event;
     }
 
+    // State used to decide what needs to be redrawn after handling the event,
+    // see the end of this function.
+    enum keyboard_view_state_t prev_state = kv->state;
+    int prev_clicked_kc = kv->clicked_kc;
+    struct sgmt_t *prev_preview_keys_selection = kv->preview_keys_selection;
+    GdkRectangle prev_to_add_rect = kv->to_add_rect;
+    bool prev_to_add_rect_hidden = kv->to_add_rect_hidden;
+
     struct sgmt_t *button_event_key = NULL, *button_event_key_clicked_sgmt = NULL,
                  **button_event_key_ptr = NULL;
     bool button_event_key_is_rectangular = false;
@@ -2915,7 +3958,7 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
     if (e->type == GDK_BUTTON_PRESS || e->type == GDK_BUTTON_RELEASE) {
         GdkEventButton *btn_e = (GdkEventButton*)e;
         if (btn_e->y < KV_TOOLBAR_HEIGHT) {
-            return;
+            return false;
         }
 
         button_event_key = keyboard_view_get_key (kv, btn_e->x, btn_e->y,
@@ -2945,7 +3988,7 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
     struct sgmt_t *key_event_key = NULL;
     if (e->type == GDK_KEY_PRESS || e->type == GDK_KEY_RELEASE) {
         key_event_kc = ((GdkEventKey*)e)->hardware_keycode - 8;
-        key_event_key = kv->keys_by_kc[key_event_kc];
+        key_event_key = kv_get_key_by_kc (kv, key_event_kc);
     }
 
     if (kv->preview_mode == KV_PREVIEW_TEST) {
@@ -3016,6 +4059,12 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
 
                     } else if (event->hardware_keycode - 8 == KEY_P) {
                         kv_print (kv);
+
+                    } else if (event->hardware_keycode - 8 == KEY_Z) {
+                        kv_history_move (kv, event->state & GDK_SHIFT_MASK);
+
+                    } else if (event->hardware_keycode - 8 == KEY_Y) {
+                        kv_history_move (kv, true);
                     }
                 }
             }
@@ -3177,7 +4226,7 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                        e->type == GDK_BUTTON_RELEASE && button_event_key != NULL) {
                 kv_remove_key (kv, button_event_key_ptr);
                 kv_remove_empty_rows (kv);
-                kv_compute_glue (kv);
+                kv_compute_glue_dirty (kv);
                 kv_equalize_left_edge (kv);
                 kv_autosave (kv);
 
@@ -3368,7 +4417,7 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                 struct sgmt_t *new_sgmt = kv_insert_new_sgmt (kv, new_sgmt_pos, new_sgmt_ptr);
                 struct sgmt_t *new_sgmt_prev;
                 if (top) {
-                    kv->keys_by_kc[sgmt->kc] = new_sgmt;
+                    kv_set_key_by_kc (kv, sgmt->kc, new_sgmt);
                     new_sgmt_prev = prev_multirow;
                     new_sgmt->width = sgmt->width;
                     new_sgmt->kc = sgmt->kc;
@@ -3394,14 +4443,16 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                     parent->user_glue = 0;
 
                     // Compute the internal glue when user_glue = 0.
-                    kv_compute_glue (kv);
+                    kv_mark_glue_dirty (kv, new_sgmt);
+                    kv_compute_glue_dirty (kv);
 
                     // Set clicked key's user glue to the difference between the
                     // new total glue for sgmt and the one it had before.
                     parent->user_glue = MAX (0, sgmt_old_glue - get_sgmt_total_glue(sgmt));
                 }
 
-                kv_compute_glue (kv);
+                kv_mark_glue_dirty (kv, new_sgmt);
+                kv_compute_glue_dirty (kv);
 
                 kv_autosave (kv);
 
@@ -3435,7 +4486,7 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                 }
 
                 if (top) {
-                    kv->keys_by_kc[sgmt->kc] = sgmt->next_multirow;
+                    kv_set_key_by_kc (kv, sgmt->kc, sgmt->next_multirow);
                     if (sgmt->next_multirow->type != KEY_MULTIROW_SEGMENT_SIZED) {
                         sgmt->next_multirow->width = sgmt->width;
                     }
@@ -3460,12 +4511,15 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                     }
 
                 } else {
-                    kv->keys_by_kc[sgmt->kc] = NULL;
+                    kv_set_key_by_kc (kv, sgmt->kc, NULL);
                 }
 
+                if (is_multirow_key (prev_multirow)) {
+                    kv_mark_glue_dirty (kv, prev_multirow);
+                }
                 kv_remove_key_sgmt (kv, kv_get_sgmt_ptr (row, sgmt), row, NULL);
                 kv_remove_empty_rows (kv);
-                kv_compute_glue (kv);
+                kv_compute_glue_dirty (kv);
                 kv_equalize_left_edge (kv);
 
                 kv_autosave (kv);
@@ -3484,7 +4538,7 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                 float glue_adj, new_glue;
                 if (kv->added_key_user_glue < 0) {
                     kv_adjust_left_edge (kv, NULL, -kv->added_key_user_glue);
-                    kv_compute_glue (kv);
+                    kv_compute_glue_dirty (kv);
                     glue_adj = -1;
                     new_glue = 0;
                 } else {
@@ -3497,7 +4551,7 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                 new_key->user_glue = new_glue;
                 kv_adjust_sgmt_glue (kv, new_key->next_sgmt, glue_adj);
 
-                kv_compute_glue (kv);
+                kv_compute_glue_dirty (kv);
 
                 GdkEventButton *event = (GdkEventButton*)e;
                 kv_set_add_key_state (kv, event->x, event->y);
@@ -3659,7 +4713,8 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                                           kv->edit_right_edge, kv->do_glue_adjust,
                                           kv->edge_glue, kv->edge_glue_len,
                                           kv->original_size, new_width);
-                    kv_compute_glue (kv);
+                    kv_mark_glue_dirty (kv, kv->edge_start);
+                    kv_compute_glue_dirty (kv);
                 }
 
             } else if (e->type == GDK_BUTTON_RELEASE) {
@@ -3674,7 +4729,8 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                                           kv->edge_glue, kv->edge_glue_len,
                                           kv->original_size, kv->original_size);
 
-                    kv_compute_glue (kv);
+                    kv_mark_glue_dirty (kv, kv->edge_start);
+                    kv_compute_glue_dirty (kv);
                     kv_resize_cleanup (kv);
                     kv->state = KV_EDIT;
                 }
@@ -3696,7 +4752,8 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                                           kv->edit_right_edge, kv->do_glue_adjust,
                                           kv->resized_segment_row, kv->resized_segment_glue_plus_w,
                                           kv->resized_segment_original_glue, new_width);
-                    kv_compute_glue (kv);
+                    kv_mark_glue_dirty (kv, kv->resized_segment);
+                    kv_compute_glue_dirty (kv);
                 }
 
             } else if (e->type == GDK_BUTTON_RELEASE) {
@@ -3710,7 +4767,8 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                                           kv->resized_segment_row, kv->resized_segment_glue_plus_w,
                                           kv->resized_segment_original_glue, kv->original_size);
 
-                    kv_compute_glue (kv);
+                    kv_mark_glue_dirty (kv, kv->resized_segment);
+                    kv_compute_glue_dirty (kv);
                     kv->state = KV_EDIT;
                 }
             }
@@ -3749,7 +4807,8 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
 
                 if (kv->push_right_key->user_glue != new_glue) {
                     kv->push_right_key->user_glue = new_glue;
-                    kv_compute_glue (kv);
+                    kv_mark_glue_dirty (kv, kv->push_right_key);
+                    kv_compute_glue_dirty (kv);
                     kv_equalize_left_edge (kv);
                 }
 
@@ -3761,13 +4820,90 @@ void kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, G
                 if (key_event_kc == KEY_ESC) {
                     kv->push_right_key->user_glue = kv->original_size;
                     kv->state = KV_EDIT;
-                    kv_compute_glue (kv);
+                    kv_mark_glue_dirty (kv, kv->push_right_key);
+                    kv_compute_glue_dirty (kv);
                 }
             }
             break;
     }
 
-    gtk_widget_queue_draw (kv->widget);
+    // Most events while previewing only change the color of a few keys, and
+    // hovering in edit mode only moves the add key rectangle. In these cases
+    // we redraw only what changed instead of the whole view. Everything else,
+    // including changes to labels, redraws everything.
+    bool partial_redraw = cmd == KV_CMD_NONE && kv->state == prev_state &&
+        (kv->state == KV_PREVIEW || (kv->state == KV_EDIT && e->type == GDK_MOTION_NOTIFY)) &&
+        !kv_labels_changed (kv, NULL, NULL);
+
+    bool draw_queued = true;
+    if (partial_redraw) {
+        draw_queued = kv_queue_draw_key (kv, key_event_key);
+
+        if (kv->clicked_kc != prev_clicked_kc) {
+            if (prev_clicked_kc != 0) {
+                draw_queued |= kv_queue_draw_key (kv, kv_get_key_by_kc (kv, prev_clicked_kc));
+            }
+
+            if (kv->clicked_kc != 0) {
+                draw_queued |= kv_queue_draw_key (kv, kv_get_key_by_kc (kv, kv->clicked_kc));
+            }
+        }
+
+        if (kv->preview_keys_selection != prev_preview_keys_selection) {
+            draw_queued |= kv_queue_draw_key (kv, prev_preview_keys_selection);
+            draw_queued |= kv_queue_draw_key (kv, kv->preview_keys_selection);
+        }
+
+        if (kv->timing.show_overlay) {
+            GdkRectangle *rect = &kv->timing.overlay_rect;
+            gtk_widget_queue_draw_area (kv->widget, rect->x, rect->y, rect->width, rect->height);
+            draw_queued = true;
+        }
+
+        if (kv->active_tool == KV_TOOL_ADD_KEY &&
+            (kv->to_add_rect_hidden != prev_to_add_rect_hidden ||
+             !gdk_rectangle_equal (&kv->to_add_rect, &prev_to_add_rect))) {
+            GdkRectangle *rects[] = {&prev_to_add_rect, &kv->to_add_rect};
+            for (int i=0; i<ARRAY_SIZE(rects); i++) {
+                gtk_widget_queue_draw_area (kv->widget, rects[i]->x, rects[i]->y,
+                                            rects[i]->width + 1, rects[i]->height + 1);
+            }
+            draw_queued = true;
+        }
+
+    } else {
+        // Not all geometry edits go through kv_compute_glue(), resizing rows
+        // or keys only changes sizes.
+        kv_invalidate_geometry (kv);
+        gtk_widget_queue_draw (kv->widget);
+    }
+
+    return draw_queued;
+}
+
+// Returns true if a redraw was queued.
+bool kv_update (struct keyboard_view_t *kv, enum keyboard_view_commands_t cmd, GdkEvent *e)
+{
+    if (!kv_timing_enabled (kv)) {
+        return kv_update_handle (kv, cmd, e);
+    }
+
+    double start = get_wall_time_ms ();
+    bool draw_queued = kv_update_handle (kv, cmd, e);
+    kv_timing_push (&kv->timing.update, get_wall_time_ms () - start);
+    return draw_queued;
+}
+
+// Starts measuring the time until the effect of a key event received at
+// _event_time_ is painted. Only call it if handling the event queued a redraw,
+// otherwise the next frame, whenever it happens, would be attributed to it. If
+// several events arrive before the next frame we measure from the first one.
+static inline
+void kv_input_latency_start (struct keyboard_view_t *kv, double event_time)
+{
+    if (kv_timing_enabled (kv) && kv->timing.pending_input_start == 0) {
+        kv->timing.pending_input_start = event_time;
+    }
 }
 
 // The default behavior is to let key events fall through, but sometimes we
@@ -3778,29 +4914,75 @@ gboolean kv_will_consume_key_event (struct keyboard_view_t *kv)
     return kv->state == KV_EDIT_KEYCODE_KEYPRESS ? TRUE : FALSE;
 }
 
+// Sends the pending motion event, if any, to kv_update(). This must be called
+// before processing any other event so they are seen in the order they
+// happened.
+void kv_flush_motion (struct keyboard_view_t *kv)
+{
+    if (kv->pending_motion != NULL) {
+        GdkEvent *event = kv->pending_motion;
+        kv->pending_motion = NULL;
+
+        kv_update (kv, KV_CMD_NONE, event);
+        kv->motion_events_processed++;
+
+        gdk_event_free (event);
+    }
+}
+
+gboolean kv_motion_tick (GtkWidget *widget, GdkFrameClock *frame_clock, gpointer user_data)
+{
+    struct keyboard_view_t *kv = (struct keyboard_view_t*)user_data;
+
+    kv->motion_tick_id = 0;
+    kv_flush_motion (kv);
+    return G_SOURCE_REMOVE;
+}
+
 gboolean key_press_handler (GtkWidget *widget, GdkEvent *event, gpointer user_data)
 {
     struct keyboard_view_t *kv = (struct keyboard_view_t*)user_data;
+    double event_time = kv_timing_enabled (kv) ? get_wall_time_ms () : 0;
+    kv_flush_motion (kv);
 
     gboolean consumed = kv_will_consume_key_event (kv);
-    kv_update (kv, KV_CMD_NONE, event);
+    if (kv_update (kv, KV_CMD_NONE, event)) {
+        kv_input_latency_start (kv, event_time);
+    }
     return consumed;
 }
 
 gboolean key_release_handler (GtkWidget *widget, GdkEvent *event, gpointer user_data)
 {
     struct keyboard_view_t *kv = (struct keyboard_view_t*)user_data;
+    double event_time = kv_timing_enabled (kv) ? get_wall_time_ms () : 0;
+    kv_flush_motion (kv);
 
     gboolean consumed = kv_will_consume_key_event (kv);
-    kv_update (kv, KV_CMD_NONE, event);
+    if (kv_update (kv, KV_CMD_NONE, event)) {
+        kv_input_latency_start (kv, event_time);
+    }
     return consumed;
 }
 
+// High rate mice can send hundreds of motion events per second. While a
+// resize, split or add key tool is active each one recomputes glue and
+// redraws the view, so instead of updating on every event we keep the latest
+// one and process it in the next frame clock tick.
 gboolean kv_motion_notify (GtkWidget *widget, GdkEvent *event, gpointer user_data)
 {
     struct keyboard_view_t *kv = (struct keyboard_view_t*)user_data;
 
-    kv_update (kv, KV_CMD_NONE, event);
+    if (kv->pending_motion != NULL) {
+        gdk_event_free (kv->pending_motion);
+        kv->motion_events_dropped++;
+    }
+    kv->pending_motion = gdk_event_copy (event);
+
+    if (kv->motion_tick_id == 0) {
+        kv->motion_tick_id = gtk_widget_add_tick_callback (kv->widget, kv_motion_tick, kv, NULL);
+    }
+
     return TRUE;
 }
 
@@ -3814,6 +4996,7 @@ gboolean kv_button_press (GtkWidget *widget, GdkEvent *event, gpointer user_data
         return FALSE;
     }
 
+    kv_flush_motion (kv);
     kv_update (kv, KV_CMD_NONE, event);
     return TRUE;
 }
@@ -3822,6 +5005,7 @@ gboolean kv_button_release (GtkWidget *widget, GdkEvent *event, gpointer user_da
 {
     struct keyboard_view_t *kv = (struct keyboard_view_t*)user_data;
 
+    kv_flush_motion (kv);
     kv_update (kv, KV_CMD_NONE, event);
     return TRUE;
 }
@@ -3853,8 +5037,7 @@ gboolean kv_tooltip_handler (GtkWidget *widget, gint x, gint y,
 
         } else { // KV_KEYSYM_LABELS
             char buff[64];
-            // @keycode_offset
-            xkb_keysym_t keysym = xkb_state_key_get_one_sym(kv->xkb_state, key->kc + 8);
+            xkb_keysym_t keysym = kv_get_keysym (kv, key->kc);
             xkb_keysym_get_name(keysym, buff, ARRAY_SIZE(buff)-1);
             gtk_tooltip_set_text (tooltip, buff);
         }
@@ -3878,13 +5061,24 @@ gboolean kv_tooltip_handler (GtkWidget *widget, gint x, gint y,
     return show_tooltip;
 }
 
-// TODO: Report errors to the caller
-bool keyboard_view_set_keymap (struct keyboard_view_t *kv, const char *xkb_str)
+// The POSIX locale used while compiling keymaps, see keyboard_view_set_keymap().
+// It's created once and set per thread with uselocale(), unlike setlocale()
+// this doesn't affect other threads.
+pthread_once_t kv_posix_locale_once = PTHREAD_ONCE_INIT;
+locale_t kv_posix_locale;
+
+void kv_posix_locale_init ()
+{
+    kv_posix_locale = newlocale (LC_ALL_MASK, "POSIX", (locale_t)0);
+}
+
+// Compiles _xkb_str_ with _xkb_ctx_, returns NULL on failure.
+struct xkb_keymap* kv_keymap_new_from_string (struct xkb_context *xkb_ctx, const char *xkb_str)
 {
     // TODO: I noticed libxkbcommon's scanner breaks when parsing floating point
     // numbers in locales that use ',' as decimal separator. For now I fixed it
-    // by setting the posix locale and restoring it after we are done. We need
-    // this because GTK will change the locale.
+    // by setting the posix locale for this thread and restoring it after we
+    // are done. We need this because GTK will change the locale.
     //
     // I don't know if this should be fixed upstream. Several considerations to
     // make are:
@@ -3895,62 +5089,488 @@ bool keyboard_view_set_keymap (struct keyboard_view_t *kv, const char *xkb_str)
     //
     //   - It can be fixed by making libxkbcommon's scanner skip the geometry
     //     section and never expect floating point numbers.
-    char *old_locale = begin_posix_locale ();
+    pthread_once (&kv_posix_locale_once, kv_posix_locale_init);
+    locale_t old_locale = uselocale (kv_posix_locale);
+
+    struct xkb_keymap *xkb_keymap =
+        xkb_keymap_new_from_string (xkb_ctx, xkb_str,
+                                    XKB_KEYMAP_FORMAT_TEXT_V1,
+                                    XKB_KEYMAP_COMPILE_NO_FLAGS);
+    if (!xkb_keymap) {
+        printf ("Error creating xkb_keymap.\n");
+    }
 
-    bool success = true;
-    struct xkb_state *new_xkb_state = NULL;
-    struct xkb_keymap *new_xkb_keymap = NULL;
-    struct xkb_context *new_xkb_ctx =  NULL;
+    uselocale (old_locale);
+    return xkb_keymap;
+}
 
-    new_xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-    if (!new_xkb_ctx) {
-        printf ("Error creating xkb_context.\n");
-        success = false;
+pthread_once_t kv_keymap_cache_once = PTHREAD_ONCE_INIT;
+pthread_key_t kv_keymap_cache_key;
+
+void kv_keymap_cache_destroy (void *data)
+{
+    struct kv_keymap_cache_t *cache = (struct kv_keymap_cache_t*)data;
+    for (int i=0; i<cache->num_entries; i++) {
+        xkb_keymap_unref (cache->entries[i].xkb_keymap);
+        free (cache->entries[i].xkb_str);
     }
 
-    if (success) {
-        new_xkb_keymap = xkb_keymap_new_from_string (new_xkb_ctx, xkb_str,
-                                                     XKB_KEYMAP_FORMAT_TEXT_V1,
-                                                     XKB_KEYMAP_COMPILE_NO_FLAGS);
+    if (cache->xkb_ctx != NULL) {
+        xkb_context_unref (cache->xkb_ctx);
+    }
+    free (cache);
+}
 
-        if (!new_xkb_keymap) {
-            printf ("Error creating xkb_keymap.\n");
-            success = false;
+void kv_keymap_cache_key_init ()
+{
+    pthread_key_create (&kv_keymap_cache_key, kv_keymap_cache_destroy);
+}
+
+// Returns the keymap cache of the calling thread, it's destroyed when the
+// thread exits. If the context can't be created xkb_ctx is NULL.
+struct kv_keymap_cache_t* kv_keymap_cache_get ()
+{
+    pthread_once (&kv_keymap_cache_once, kv_keymap_cache_key_init);
+
+    struct kv_keymap_cache_t *cache = pthread_getspecific (kv_keymap_cache_key);
+    if (cache == NULL) {
+        cache = malloc (sizeof(struct kv_keymap_cache_t));
+        *cache = ZERO_INIT(struct kv_keymap_cache_t);
+
+        cache->xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+        if (!cache->xkb_ctx) {
+            printf ("Error creating xkb_context.\n");
         }
+
+        pthread_setspecific (kv_keymap_cache_key, cache);
     }
 
-    if (success) {
+    return cache;
+}
+
+struct kv_keymap_cache_entry_t* kv_keymap_cache_find (struct kv_keymap_cache_t *cache,
+                                                      const char *xkb_str, size_t len, uint32_t hash)
+{
+    for (int i=0; i<cache->num_entries; i++) {
+        struct kv_keymap_cache_entry_t *entry = &cache->entries[i];
+        if (entry->hash == hash && entry->len == len &&
+            memcmp (entry->xkb_str, xkb_str, len) == 0) {
+            entry->last_used = ++cache->clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Returns a new reference to the cached keymap compiled from _xkb_str_, or
+// NULL if it isn't in the cache.
+struct xkb_keymap* kv_keymap_cache_lookup (struct kv_keymap_cache_t *cache,
+                                           const char *xkb_str, size_t len, uint32_t hash)
+{
+    struct kv_keymap_cache_entry_t *entry = kv_keymap_cache_find (cache, xkb_str, len, hash);
+    return entry != NULL ? xkb_keymap_ref (entry->xkb_keymap) : NULL;
+}
+
+// Adds a reference to _xkb_keymap_ as the result of compiling _xkb_str_,
+// evicting the least recently used keymap if the cache is full.
+void kv_keymap_cache_insert (struct kv_keymap_cache_t *cache,
+                             const char *xkb_str, size_t len, uint32_t hash,
+                             struct xkb_keymap *xkb_keymap)
+{
+    if (kv_keymap_cache_find (cache, xkb_str, len, hash) != NULL) {
+        return;
+    }
+
+    struct kv_keymap_cache_entry_t *entry;
+    if (cache->num_entries < KV_KEYMAP_CACHE_SIZE) {
+        entry = &cache->entries[cache->num_entries++];
+
+    } else {
+        entry = &cache->entries[0];
+        for (int i=1; i<cache->num_entries; i++) {
+            if (cache->entries[i].last_used < entry->last_used) {
+                entry = &cache->entries[i];
+            }
+        }
+
+        xkb_keymap_unref (entry->xkb_keymap);
+        free (entry->xkb_str);
+    }
+
+    entry->xkb_str = malloc (len + 1);
+    memcpy (entry->xkb_str, xkb_str, len + 1);
+    entry->len = len;
+    entry->hash = hash;
+    entry->last_used = ++cache->clock;
+    entry->xkb_keymap = xkb_keymap_ref (xkb_keymap);
+}
+
+// Creates a state for _new_xkb_keymap_ and returns both, takes ownership of
+// the keymap reference, it's dropped on failure.
+bool kv_keymap_state_new (struct xkb_keymap *new_xkb_keymap,
+                          struct xkb_keymap **xkb_keymap, struct xkb_state **xkb_state)
+{
+    struct xkb_state *new_xkb_state = NULL;
+    if (new_xkb_keymap != NULL) {
         new_xkb_state = xkb_state_new(new_xkb_keymap);
         if (!new_xkb_state) {
             printf ("Error creating xkb_state.\n");
-            success = false;
+            xkb_keymap_unref (new_xkb_keymap);
+            new_xkb_keymap = NULL;
         }
     }
 
-    if (new_xkb_ctx != NULL) {
-        xkb_context_unref (new_xkb_ctx);
+    *xkb_keymap = new_xkb_keymap;
+    *xkb_state = new_xkb_state;
+    return new_xkb_state != NULL;
+}
+
+// Compiles _xkb_str_ into a new keymap and state. It doesn't touch any
+// keyboard view so it can be called from any thread. Keymaps are looked up in
+// the calling thread's cache first, so switching between layouts or setting
+// unchanged text again doesn't compile anything.
+//
+// The result must be released by the calling thread, keyboard views set by
+// keyboard_view_set_keymap() should be destroyed by the thread that created
+// them.
+bool kv_compile_keymap (const char *xkb_str,
+                        struct xkb_keymap **xkb_keymap, struct xkb_state **xkb_state)
+{
+    struct kv_keymap_cache_t *cache = kv_keymap_cache_get ();
+    size_t len = strlen (xkb_str);
+    uint32_t hash = kv_str_hash (xkb_str);
+
+    struct xkb_keymap *new_xkb_keymap = kv_keymap_cache_lookup (cache, xkb_str, len, hash);
+    if (new_xkb_keymap == NULL && cache->xkb_ctx != NULL) {
+        new_xkb_keymap = kv_keymap_new_from_string (cache->xkb_ctx, xkb_str);
+        if (new_xkb_keymap != NULL) {
+            kv_keymap_cache_insert (cache, xkb_str, len, hash, new_xkb_keymap);
+        }
     }
 
-    if (success) {
-        if (kv->xkb_keymap != NULL) {
-            xkb_keymap_unref(kv->xkb_keymap);
+    return kv_keymap_state_new (new_xkb_keymap, xkb_keymap, xkb_state);
+}
+
+void kv_xkb_log_to_string (struct xkb_context *xkb_ctx, enum xkb_log_level level,
+                           const char *format, va_list args)
+{
+    string_t *log = (string_t*)xkb_context_get_user_data (xkb_ctx);
+
+    va_list args_copy;
+    va_copy (args_copy, args);
+    size_t size = vsnprintf (NULL, 0, format, args_copy) + 1;
+    va_end (args_copy);
+
+    char *msg = malloc (size);
+    vsnprintf (msg, size, format, args);
+    strn_cat_c (log, msg, size - 1);
+    free (msg);
+}
+
+// Like kv_compile_keymap() but compiles with a context of its own and without
+// the cache, so the result can be released by any thread. If _log_ isn't NULL
+// libxkbcommon's messages are appended to it instead of printed to stderr.
+bool kv_compile_keymap_unshared (const char *xkb_str,
+                                 struct xkb_keymap **xkb_keymap, struct xkb_state **xkb_state,
+                                 string_t *log)
+{
+    struct xkb_keymap *new_xkb_keymap = NULL;
+    struct xkb_context *xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    if (!xkb_ctx) {
+        printf ("Error creating xkb_context.\n");
+
+    } else {
+        if (log != NULL) {
+            xkb_context_set_user_data (xkb_ctx, log);
+            xkb_context_set_log_fn (xkb_ctx, kv_xkb_log_to_string);
         }
 
-        if (kv->xkb_state != NULL) {
-            xkb_state_unref(kv->xkb_state);
+        new_xkb_keymap = kv_keymap_new_from_string (xkb_ctx, xkb_str);
+
+        // The keymap keeps a reference to the context but _log_ may be freed
+        // before it, don't leave it pointing there.
+        if (log != NULL) {
+            xkb_context_set_log_fn (xkb_ctx, NULL);
+            xkb_context_set_user_data (xkb_ctx, NULL);
         }
+        xkb_context_unref (xkb_ctx);
+    }
+
+    return kv_keymap_state_new (new_xkb_keymap, xkb_keymap, xkb_state);
+}
+
+// Replaces the keymap of _kv_, it takes ownership of both arguments.
+void kv_install_keymap (struct keyboard_view_t *kv,
+                        struct xkb_keymap *xkb_keymap, struct xkb_state *xkb_state)
+{
+    if (kv->xkb_keymap != NULL) {
+        xkb_keymap_unref(kv->xkb_keymap);
+    }
+
+    if (kv->xkb_state != NULL) {
+        xkb_state_unref(kv->xkb_state);
+    }
 
-        kv->xkb_keymap = new_xkb_keymap;
-        kv->xkb_state = new_xkb_state;
+    kv->xkb_keymap = xkb_keymap;
+    kv->xkb_state = xkb_state;
+    kv_invalidate_labels (kv);
 
+    if (kv->widget != NULL) {
         gtk_widget_queue_draw (kv->widget);
     }
+}
+
+// Returns the generation of a new keymap, results of older asynchronous
+// requests won't be installed.
+uint64_t kv_keymap_compiler_next_generation (struct kv_keymap_compiler_t *compiler)
+{
+    uint64_t generation;
+    if (compiler->started) {
+        pthread_mutex_lock (&compiler->mutex);
+        generation = ++compiler->generation;
+        pthread_mutex_unlock (&compiler->mutex);
+
+    } else {
+        generation = ++compiler->generation;
+    }
+    return generation;
+}
+
+// TODO: Report errors to the caller
+bool keyboard_view_set_keymap (struct keyboard_view_t *kv, const char *xkb_str)
+{
+    kv_keymap_compiler_next_generation (&kv->keymap_compiler);
 
-    restore_locale (old_locale);
+    struct xkb_keymap *xkb_keymap;
+    struct xkb_state *xkb_state;
+    bool success = kv_compile_keymap (xkb_str, &xkb_keymap, &xkb_state);
+    if (success) {
+        kv_install_keymap (kv, xkb_keymap, xkb_state);
+    }
 
     return success;
 }
 
+// Installs a keymap compiled from _xkb_str_ by kv_compile_keymap_unshared(),
+// it takes ownership of _xkb_keymap_ and _xkb_state_. Like
+// keyboard_view_set_keymap(), pending asynchronous requests are cancelled.
+void keyboard_view_set_compiled_keymap (struct keyboard_view_t *kv, const char *xkb_str,
+                                        struct xkb_keymap *xkb_keymap, struct xkb_state *xkb_state)
+{
+    kv_keymap_compiler_next_generation (&kv->keymap_compiler);
+    kv_keymap_cache_insert (kv_keymap_cache_get (), xkb_str, strlen (xkb_str),
+                            kv_str_hash (xkb_str), xkb_keymap);
+    kv_install_keymap (kv, xkb_keymap, xkb_state);
+}
+
+void kv_keymap_request_free (struct kv_keymap_request_t *request)
+{
+    if (request->xkb_state != NULL) {
+        xkb_state_unref (request->xkb_state);
+    }
+
+    if (request->xkb_keymap != NULL) {
+        xkb_keymap_unref (request->xkb_keymap);
+    }
+
+    free (request->xkb_str);
+    free (request);
+}
+
+// Calls the callback of _request_ and frees it. Must be called from the GTK
+// thread.
+void kv_keymap_request_finish (struct keyboard_view_t *kv, struct kv_keymap_request_t *request,
+                               enum kv_keymap_status_t status)
+{
+    // Keymaps compiled by the compiler thread are cached even if they were
+    // cancelled, switching back to them won't compile them again.
+    if (request->xkb_keymap != NULL) {
+        kv_keymap_cache_insert (kv_keymap_cache_get (), request->xkb_str,
+                                strlen (request->xkb_str), request->hash, request->xkb_keymap);
+    }
+
+    if (status == KV_KEYMAP_INSTALLED) {
+        kv_install_keymap (kv, request->xkb_keymap, request->xkb_state);
+        request->xkb_keymap = NULL;
+        request->xkb_state = NULL;
+    }
+
+    if (request->cb != NULL) {
+        request->cb (kv, status, request->xkb_str, request->cb_data);
+    }
+    kv_keymap_request_free (request);
+}
+
+gboolean kv_keymap_compiler_idle (gpointer user_data)
+{
+    struct keyboard_view_t *kv = (struct keyboard_view_t*)user_data;
+    struct kv_keymap_compiler_t *compiler = &kv->keymap_compiler;
+
+    pthread_mutex_lock (&compiler->mutex);
+    struct kv_keymap_request_t *requests = compiler->done;
+    compiler->done = NULL;
+    compiler->idle_id = 0;
+    uint64_t generation = compiler->generation;
+    pthread_mutex_unlock (&compiler->mutex);
+
+    while (requests != NULL) {
+        struct kv_keymap_request_t *request = requests;
+        requests = requests->next;
+
+        enum kv_keymap_status_t status;
+        if (request->generation != generation) {
+            status = KV_KEYMAP_CANCELLED;
+        } else if (request->xkb_keymap != NULL) {
+            status = KV_KEYMAP_INSTALLED;
+        } else {
+            status = KV_KEYMAP_FAILED;
+        }
+        kv_keymap_request_finish (kv, request, status);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+void* kv_keymap_compiler_thread (void *data)
+{
+    struct keyboard_view_t *kv = (struct keyboard_view_t*)data;
+    struct kv_keymap_compiler_t *compiler = &kv->keymap_compiler;
+
+    pthread_mutex_lock (&compiler->mutex);
+    while (!compiler->stop) {
+        if (compiler->pending == NULL) {
+            pthread_cond_wait (&compiler->cond, &compiler->mutex);
+            continue;
+        }
+
+        struct kv_keymap_request_t *request = compiler->pending;
+        compiler->pending = NULL;
+        pthread_mutex_unlock (&compiler->mutex);
+
+        // The keymap will be released by the GTK thread.
+        kv_compile_keymap_unshared (request->xkb_str, &request->xkb_keymap, &request->xkb_state, NULL);
+
+        pthread_mutex_lock (&compiler->mutex);
+        struct kv_keymap_request_t **pos = &compiler->done;
+        while (*pos != NULL) {
+            pos = &(*pos)->next;
+        }
+        *pos = request;
+
+        if (compiler->idle_id == 0) {
+            compiler->idle_id = g_idle_add (kv_keymap_compiler_idle, kv);
+        }
+    }
+    pthread_mutex_unlock (&compiler->mutex);
+
+    return NULL;
+}
+
+// Compiles _xkb_str_ in a background thread and installs the result from an
+// idle callback, the current keymap stays active meanwhile. Then _cb_ is called
+// with the status and a copy of _xkb_str_. A request that hasn't started
+// compiling is dropped when a newer one arrives, one that did is discarded once
+// compiled. In both cases its callback gets KV_KEYMAP_CANCELLED.
+void keyboard_view_set_keymap_async (struct keyboard_view_t *kv, const char *xkb_str,
+                                     kv_keymap_ready_cb_t *cb, void *cb_data)
+{
+    struct kv_keymap_compiler_t *compiler = &kv->keymap_compiler;
+    if (!compiler->started) {
+        pthread_mutex_init (&compiler->mutex, NULL);
+        pthread_cond_init (&compiler->cond, NULL);
+        pthread_create (&compiler->thread, NULL, kv_keymap_compiler_thread, kv);
+        compiler->started = true;
+    }
+
+    struct kv_keymap_request_t *request = malloc (sizeof(struct kv_keymap_request_t));
+    *request = ZERO_INIT(struct kv_keymap_request_t);
+    request->xkb_str = strdup (xkb_str);
+    request->hash = kv_str_hash (xkb_str);
+    request->cb = cb;
+    request->cb_data = cb_data;
+
+    // Keymaps in the cache don't need the compiler thread, they still go
+    // through the idle callback so callbacks are called in request order.
+    struct xkb_keymap *cached = kv_keymap_cache_lookup (kv_keymap_cache_get (), xkb_str,
+                                                        strlen (xkb_str), request->hash);
+    if (cached != NULL) {
+        kv_keymap_state_new (cached, &request->xkb_keymap, &request->xkb_state);
+    }
+
+    pthread_mutex_lock (&compiler->mutex);
+    request->generation = ++compiler->generation;
+    struct kv_keymap_request_t *replaced = compiler->pending;
+    if (cached != NULL) {
+        compiler->pending = NULL;
+
+        struct kv_keymap_request_t **pos = &compiler->done;
+        while (*pos != NULL) {
+            pos = &(*pos)->next;
+        }
+        *pos = request;
+
+        if (compiler->idle_id == 0) {
+            compiler->idle_id = g_idle_add (kv_keymap_compiler_idle, kv);
+        }
+
+    } else {
+        compiler->pending = request;
+        pthread_cond_signal (&compiler->cond);
+    }
+    pthread_mutex_unlock (&compiler->mutex);
+
+    if (replaced != NULL) {
+        kv_keymap_request_finish (kv, replaced, KV_KEYMAP_CANCELLED);
+    }
+}
+
+// Stops the compiler thread, requests that weren't installed are cancelled.
+void kv_keymap_compiler_destroy (struct keyboard_view_t *kv)
+{
+    struct kv_keymap_compiler_t *compiler = &kv->keymap_compiler;
+    if (!compiler->started) {
+        return;
+    }
+
+    pthread_mutex_lock (&compiler->mutex);
+    compiler->stop = true;
+    pthread_cond_signal (&compiler->cond);
+    pthread_mutex_unlock (&compiler->mutex);
+    pthread_join (compiler->thread, NULL);
+
+    if (compiler->idle_id != 0) {
+        g_source_remove (compiler->idle_id);
+        compiler->idle_id = 0;
+    }
+
+    struct kv_keymap_request_t *requests = compiler->done;
+    if (compiler->pending != NULL) {
+        compiler->pending->next = requests;
+        requests = compiler->pending;
+    }
+    compiler->pending = NULL;
+    compiler->done = NULL;
+
+    while (requests != NULL) {
+        struct kv_keymap_request_t *request = requests;
+        requests = requests->next;
+        kv_keymap_request_finish (kv, request, KV_KEYMAP_CANCELLED);
+    }
+
+    pthread_cond_destroy (&compiler->cond);
+    pthread_mutex_destroy (&compiler->mutex);
+    compiler->started = false;
+}
+
+// Destroying the widget also removes its tick callbacks. Forget it so
+// keyboard_view_destroy() doesn't touch it.
+void kv_widget_destroy_handler (GtkWidget *widget, gpointer user_data)
+{
+    struct keyboard_view_t *kv = (struct keyboard_view_t*)user_data;
+    kv->motion_tick_id = 0;
+    kv->widget = NULL;
+}
+
 // NOTE: The caller of keyboard_view_new_with_gui() is responsible of calling
 // keyboard_view_destroy() when the view is no longer needed.
 struct keyboard_view_t* keyboard_view_new_with_gui (GtkWidget *window,
@@ -4006,6 +5626,7 @@ struct keyboard_view_t* keyboard_view_new_with_gui (GtkWidget *window,
         //
         // @broken_tooltips_in_overlay
         g_signal_connect (G_OBJECT (kv_widget), "query-tooltip", G_CALLBACK (kv_tooltip_handler), kv);
+        g_signal_connect (G_OBJECT (kv_widget), "destroy", G_CALLBACK (kv_widget_destroy_handler), kv);
         gtk_widget_show (kv_widget);
 
         GtkWidget *draw_area = gtk_drawing_area_new ();
@@ -109,6 +109,12 @@ typedef KV_GRAB_NOTIFY_CB(kv_grab_change_notify_cb_t);
 #define KV_SELECT_KEY_CHANGE_NOTIFY_CB(name) void name (int kc)
 typedef KV_SELECT_KEY_CHANGE_NOTIFY_CB(kv_select_key_change_notify_cb_t);
 
+// Returns the keysym labeled on the key with keycode _kc_ for the current
+// state of the view, see keyboard_view_set_keysym_source().
+struct keyboard_view_t;
+#define KV_KEYSYM_SOURCE_CB(name) xkb_keysym_t name (struct keyboard_view_t *kv, int kc)
+typedef KV_KEYSYM_SOURCE_CB(kv_keysym_source_cb_t);
+
 enum keyboard_view_state_t {
     KV_PREVIEW,
 
@@ -198,16 +204,23 @@ enum multirow_key_align_t {
     MULTIROW_ALIGN_RIGHT
 };
 
+// NOTE: Fields are ordered and narrowed so a segment takes 32 bytes instead of
+// 48, a keyboard view is traversed many times per frame.
 struct sgmt_t {
-    int kc; //keycode
+    uint16_t kc; //keycode
+    enum key_render_type_t type : 8;
+    // Fields specific to KEY_MULTIROW_SEGMENT_SIZED
+    enum multirow_key_align_t align : 8;
+
     float width, user_glue; // normalized to default_key_size
     float internal_glue;
-    enum key_render_type_t type;
     struct sgmt_t *next_sgmt;
     struct sgmt_t *next_multirow;
+};
 
-    // Fields specific to KEY_MULTIROW_SEGMENT_SIZED
-    enum multirow_key_align_t align;
+struct kv_kc_map_entry_t {
+    uint16_t kc; // 0 marks an empty entry
+    struct sgmt_t *sgmt;
 };
 
 struct row_t {
@@ -242,6 +255,226 @@ enum locate_sgmt_status_t {
 // be careful about that!.
 #define KV_STEP_PRECISION 3
 
+// Label of a key as shown by keyboard_view_render(). The entry is only valid if
+// generation is equal to kv->label_generation.
+#define KV_MAX_LABEL_LEN 64
+struct kv_label_t {
+    uint32_t generation;
+    char str[KV_MAX_LABEL_LEN];
+};
+
+// Absolute position and size of all segments, derived from the row and segment
+// linked lists so consumers don't need to walk them and accumulate glue and
+// widths. Segments are stored in row order, segments of row r are in the range
+// [row_first[r], row_first[r+1]). Coordinates are in pixels relative to the top
+// left corner of the keyboard, margins are not included.
+//
+// It's rebuilt lazily by kv_get_geometry() after being invalidated with
+// kv_invalidate_geometry(), which must happen after any change to the
+// geometry.
+struct kv_geometry_t {
+    mem_pool_t pool;
+    bool valid;
+    float default_key_size;
+
+    int num_sgmts;
+    struct sgmt_t **sgmts;
+    float *x, *y;
+    // Size of the key as computed by compute_key_size(). For rectangular
+    // multirow keys h is the height of the full key.
+    float *w, *h;
+    bool *is_rectangular;
+    int *row_idx;
+    // Index of the multirow parent, it's the segment's own index for keys
+    // that aren't multirow.
+    int *parent_idx;
+
+    int num_rows;
+    struct row_t **rows;
+    float *row_y, *row_h;
+    int *row_first;
+
+    // Uniform grid used for point queries by kv_geometry_locate(). Cells are
+    // squares of side cell_size. row_cells[c] is the first row whose bottom
+    // edge is below the top of vertical cell c. For row r, the horizontal
+    // cells are in the range [col_cells_first[r], col_cells_first[r+1]) of
+    // col_cells, each one is the first segment whose right edge is to the
+    // right of the cell's left edge.
+    float cell_size;
+    int num_row_cells;
+    int *row_cells;
+    int *col_cells_first;
+    int *col_cells;
+};
+
+// Cache of keys rendered into image surfaces, see kv_render_key_cached().
+#define KV_KEY_SURFACE_CACHE_SIZE 512
+#define KV_KEY_SURFACE_CACHE_BUCKETS 256
+struct kv_key_surface_t {
+    // String with everything that affects how the key looks.
+    string_t id;
+    uint32_t hash;
+
+    cairo_surface_t *surface;
+    // Position of the surface relative to the integer part of the coordinates
+    // where the key is rendered.
+    int offset_x, offset_y;
+
+    struct kv_key_surface_t *bucket_next;
+    struct kv_key_surface_t *lru_prev, *lru_next;
+};
+
+struct kv_key_surface_cache_t {
+    // Surfaces are rendered for these values, when they change the cache is
+    // cleared.
+    float default_key_size;
+    double scale;
+
+    int num_entries;
+    struct kv_key_surface_t entries[KV_KEY_SURFACE_CACHE_SIZE];
+    struct kv_key_surface_t *buckets[KV_KEY_SURFACE_CACHE_BUCKETS];
+
+    // Most recently used entry is lru_first, lru_last is the next to be
+    // evicted.
+    struct kv_key_surface_t *lru_first, *lru_last;
+
+    string_t scratch_id;
+};
+
+// Rolling window with the last KV_TIMING_WINDOW samples of a measurement, in
+// milliseconds.
+#define KV_TIMING_WINDOW 128
+struct kv_timing_series_t {
+    float samples[KV_TIMING_WINDOW];
+    int num_samples;
+    int next;
+};
+
+// Render timing instrumentation. Setting the KV_RENDER_TIMING environment
+// variable to "overlay" draws the percentiles of each measurement on top of the
+// keyboard view, "log" prints them every KV_TIMING_WINDOW frames and when the
+// view is destroyed, both can be combined as "overlay,log". The log also
+// includes motion event coalescing and autosave writer statistics.
+struct kv_timing_t {
+    bool show_overlay;
+    bool log;
+
+    struct kv_timing_series_t frame; // Whole keyboard_view_render() call
+    struct kv_timing_series_t labels; // Label computation in a frame
+    struct kv_timing_series_t keys; // Drawing of rectangular keys in a frame
+    struct kv_timing_series_t multirow; // Drawing of non rectangular keys in a frame
+    struct kv_timing_series_t update; // Single kv_update() call
+    struct kv_timing_series_t input_latency; // Key event to the end of the next frame
+
+    // Time of the oldest key event that hasn't been painted yet, 0 if there is
+    // none.
+    double pending_input_start;
+    uint64_t num_frames;
+
+    // Area where the overlay was last drawn, partial redraws include it.
+    GdkRectangle overlay_rect;
+};
+
+// Autosaves are written to disk by a background thread so the UI never blocks
+// on it, see kv_autosave_writer_post().
+#include <pthread.h>
+
+struct kv_autosave_request_t {
+    char *path;
+    char *data; // NULL removes the file
+    size_t len;
+    double post_time;
+
+    struct kv_autosave_request_t *next;
+};
+
+struct kv_autosave_writer_t {
+    bool started;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    // Requests waiting to be written, at most one per path.
+    struct kv_autosave_request_t *pending;
+    double last_post_time;
+
+    bool busy;
+    bool flush;
+    bool stop;
+
+    uint64_t num_requests;
+    uint64_t num_writes;
+    struct kv_timing_series_t write_time; // Time spent writing one file
+    struct kv_timing_series_t latency; // From the request until its file is written
+};
+
+// Keymaps can be compiled by a background thread, the previous keymap stays
+// active until the new one is installed from an idle callback in the GTK
+// thread, see keyboard_view_set_keymap_async().
+enum kv_keymap_status_t {
+    KV_KEYMAP_INSTALLED,
+    KV_KEYMAP_FAILED,
+    KV_KEYMAP_CANCELLED // A newer keymap was set before this one was installed
+};
+
+#define KV_KEYMAP_READY_CB(name) \
+    void name (struct keyboard_view_t *kv, enum kv_keymap_status_t status, char *xkb_str, void *data)
+typedef KV_KEYMAP_READY_CB(kv_keymap_ready_cb_t);
+
+struct kv_keymap_request_t {
+    uint64_t generation;
+    char *xkb_str;
+    uint32_t hash;
+    kv_keymap_ready_cb_t *cb;
+    void *cb_data;
+
+    // Set by the compiler thread, or from the cache
+    struct xkb_keymap *xkb_keymap;
+    struct xkb_state *xkb_state;
+
+    struct kv_keymap_request_t *next;
+};
+
+struct kv_keymap_compiler_t {
+    bool started;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool stop;
+
+    // Generation of the last keymap that was set, synchronously or not. Results
+    // of older requests are discarded.
+    uint64_t generation;
+
+    // At most one request waits to be compiled, newer ones replace it.
+    struct kv_keymap_request_t *pending;
+
+    // Compiled requests waiting for the idle callback, idle_id is 0 if it's
+    // not scheduled.
+    struct kv_keymap_request_t *done;
+    guint idle_id;
+};
+
+// Each thread compiles keymaps with its own long lived xkb_context and keeps
+// the last KV_KEYMAP_CACHE_SIZE compiled keymaps, identified by the hash of
+// their text, see kv_compile_keymap(). Contexts and keymaps are reference
+// counted without atomics, so neither can be shared between threads.
+#define KV_KEYMAP_CACHE_SIZE 8
+struct kv_keymap_cache_entry_t {
+    char *xkb_str;
+    size_t len;
+    uint32_t hash;
+    uint64_t last_used;
+    struct xkb_keymap *xkb_keymap;
+};
+
+struct kv_keymap_cache_t {
+    struct xkb_context *xkb_ctx;
+    uint64_t clock;
+    int num_entries;
+    struct kv_keymap_cache_entry_t entries[KV_KEYMAP_CACHE_SIZE];
+};
+
 // Color palette
 dvec4 color_blue = RGB_HEX(0x7f7fff);
 dvec4 color_red = RGB_HEX(0xe34442);
@@ -260,9 +493,12 @@ struct keyboard_view_t {
     string_t settings_file_path;
     struct kv_repr_store_t *repr_store;
 
-    // Array of sgmt_t pointers indexed by keycode. Provides fast access to keys
-    // from a keycode. It's about 6KB in memory, maybe too much?
-    struct sgmt_t *keys_by_kc[KEY_MAX];
+    // Sparse map from keycodes to keys, use kv_get_key_by_kc() and
+    // kv_set_key_by_kc() to access it. Keyboards use around a hundred of the
+    // KEY_MAX keycodes, a full array of pointers indexed by keycode was 6KB.
+    struct kv_kc_map_entry_t *keys_by_kc;
+    int keys_by_kc_size; // Always a power of 2
+    int keys_by_kc_len; // Number of used entries, including the ones set to NULL
     struct sgmt_t *spare_keys;
     struct row_t *spare_rows;
 
@@ -274,6 +510,42 @@ struct keyboard_view_t {
     struct xkb_keymap *xkb_keymap;
     struct xkb_state *xkb_state;
 
+    // Cache of key labels indexed by keycode. Labels only depend on the
+    // effective modifiers and layout of xkb_state and on label_mode, when
+    // they change we increment label_generation to invalidate all entries.
+    // See kv_get_key_label().
+    struct kv_label_t label_cache[KEY_CNT];
+    uint32_t label_generation;
+    xkb_mod_mask_t label_mods;
+    xkb_layout_index_t label_layout;
+    enum keyboard_view_label_mode_t label_cache_mode;
+
+    struct kv_key_surface_cache_t key_surfaces;
+    struct kv_geometry_t geometry;
+
+    // Segments and rows touched by edits since the last glue computation, see
+    // kv_compute_glue_dirty(). If there are too many to track, or the edit
+    // affected all rows, glue_dirty_all is set instead.
+#define KV_MAX_GLUE_DIRTY 16
+    struct sgmt_t *glue_dirty_sgmts[KV_MAX_GLUE_DIRTY];
+    int num_glue_dirty_sgmts;
+    struct row_t *glue_dirty_rows[KV_MAX_GLUE_DIRTY];
+    int num_glue_dirty_rows;
+    bool glue_dirty_all;
+
+    // Motion events are coalesced so that kv_update() runs at most once per
+    // frame clock tick, with the latest pointer position. See
+    // kv_motion_notify().
+    GdkEvent *pending_motion;
+    guint motion_tick_id;
+    uint64_t motion_events_processed;
+    uint64_t motion_events_dropped;
+
+    struct kv_timing_t timing;
+
+    struct kv_autosave_writer_t autosave_writer;
+    struct kv_keymap_compiler_t keymap_compiler;
+
     // KEYCODE_LOOKUP state
     struct fk_popover_t keycode_lookup_popover;
     struct fk_searchable_list_t keycode_lookup_ui;
@@ -408,5 +680,9 @@ struct keyboard_view_t {
     // information in each segment, and confusing the caller about the concept
     // of segments.
     kv_select_key_change_notify_cb_t *selected_key_change_cb;
+
+    // If set, keysym labels come from this callback instead of xkb_state. The
+    // state is still used for modifiers.
+    kv_keysym_source_cb_t *keysym_source_cb;
 };
 
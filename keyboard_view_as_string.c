@@ -8,6 +8,272 @@
 // information that will be computed by the layout algorithms. I think this
 // format could replace the geometry section in xkb files.
 
+// Distances in the text format are formatted and parsed without printf() and
+// strtof() because these depend on the locale's decimal separator. The locale
+// is process global, GTK changes it, and setting it isn't thread safe.
+//
+// Distances are multiples of 1/2^KV_STEP_PRECISION so they have a short and
+// exact decimal expansion. For these the output is the same as "%g", except
+// when "%g" would need more than 6 significant digits, then we keep all of
+// them. Values off the step grid are rounded to KV_DISTANCE_SIGNIFICANT_DIGITS
+// significant digits, enough to parse back the same float. Values too big or
+// too small to be written this way, only possible in hand written files, use
+// an exponent like "%g" does.
+#define KV_DISTANCE_SIGNIFICANT_DIGITS 9
+#define KV_DISTANCE_MAX_DECIMALS 19 // 10^19 still fits in a uint64_t
+#define KV_DISTANCE_MAX_DIGITS 15 // Digits that can be converted exactly to a double
+#define KV_DISTANCE_MAX_EXPONENT 1000 // Way past what fits in a float
+
+// Range of absolute values written without an exponent. Below the minimum
+// KV_DISTANCE_MAX_DECIMALS decimals aren't enough for all significant digits,
+// above the maximum the integer part would need more of them.
+#define KV_DISTANCE_FIXED_MIN 1e-10
+#define KV_DISTANCE_FIXED_MAX 1e9
+
+// Writes the absolute value of _val_ with _num_digits_ significant digits and
+// an exponent, like "%g" does with at least 2 exponent digits. Returns the
+// length written into _buff_.
+int kv_distance_format_exponent (char *buff, float val, int num_digits)
+{
+    int len = 0;
+    double abs_val = fabs ((double)val);
+    int exponent = floor (log10 (abs_val));
+
+    // Rounding, of log10() or of the mantissa, may leave us one digit off.
+    uint64_t min_mantissa = 1;
+    for (int i=1; i<num_digits; i++) {
+        min_mantissa *= 10;
+    }
+
+    uint64_t mantissa;
+    while (true) {
+        int shift = num_digits - 1 - exponent;
+        mantissa = (uint64_t)round (shift < 0 ? abs_val/pow (10, -shift) : abs_val*pow (10, shift));
+
+        if (mantissa >= min_mantissa*10) {
+            exponent++;
+        } else if (mantissa < min_mantissa) {
+            exponent--;
+        } else {
+            break;
+        }
+    }
+
+    while (num_digits > 1 && mantissa%10 == 0) {
+        mantissa /= 10;
+        num_digits--;
+    }
+
+    char digits[20];
+    for (int i=num_digits-1; i>=0; i--) {
+        digits[i] = '0' + mantissa%10;
+        mantissa /= 10;
+    }
+
+    buff[len++] = digits[0];
+    if (num_digits > 1) {
+        buff[len++] = '.';
+        for (int i=1; i<num_digits; i++) {
+            buff[len++] = digits[i];
+        }
+    }
+
+    buff[len++] = 'e';
+    buff[len++] = exponent < 0 ? '-' : '+';
+    int abs_exponent = abs (exponent);
+    if (abs_exponent >= 100) {
+        buff[len++] = '0' + abs_exponent/100;
+    }
+    buff[len++] = '0' + (abs_exponent/10)%10;
+    buff[len++] = '0' + abs_exponent%10;
+    buff[len] = '\0';
+
+    return len;
+}
+
+bool kv_scanner_distance (struct scanner_t *scnr, float *value);
+
+// Only used for values outside of [KV_DISTANCE_FIXED_MIN,
+// KV_DISTANCE_FIXED_MAX). These are rare, so we look for the shortest number
+// of significant digits that parses back to _val_.
+void str_cat_kv_distance_exponent (string_t *str, float val)
+{
+    char buff[48];
+    int len = 0;
+    if (val < 0) {
+        buff[len++] = '-';
+    }
+
+    int num_digits_len;
+    for (int num_digits=1; num_digits<=KV_DISTANCE_SIGNIFICANT_DIGITS; num_digits++) {
+        num_digits_len = kv_distance_format_exponent (buff + len, val, num_digits);
+
+        struct scanner_t scnr = {0};
+        scnr.pos = buff + len;
+        float parsed;
+        if (kv_scanner_distance (&scnr, &parsed) && parsed == fabsf (val)) {
+            break;
+        }
+    }
+
+    strn_cat_c (str, buff, len + num_digits_len);
+}
+
+void str_cat_kv_distance (string_t *str, float val)
+{
+    assert (isfinite (val) && "kv_scanner_distance() doesn't return these");
+
+    double abs_val = fabs ((double)val);
+    if (val != 0 && (abs_val < KV_DISTANCE_FIXED_MIN || abs_val >= KV_DISTANCE_FIXED_MAX)) {
+        str_cat_kv_distance_exponent (str, val);
+        return;
+    }
+
+    char buff[48];
+    int len = 0;
+
+    // Find the number of decimals that gives us all significant digits, the
+    // value is then an integer scaled by 10^num_decimals.
+    int num_decimals = 0;
+    uint64_t scale = 1;
+    while (abs_val*scale < 1e8 && num_decimals < KV_DISTANCE_MAX_DECIMALS) {
+        scale *= 10;
+        num_decimals++;
+    }
+
+    uint64_t scaled = (uint64_t)round (abs_val*scale);
+    if (val < 0 && scaled != 0) {
+        buff[len++] = '-';
+    }
+
+    uint64_t int_part = scaled/scale;
+    uint64_t frac_part = scaled%scale;
+
+    char digits[20];
+    int num_digits = 0;
+    do {
+        digits[num_digits++] = '0' + int_part%10;
+        int_part /= 10;
+    } while (int_part != 0);
+
+    while (num_digits > 0) {
+        buff[len++] = digits[--num_digits];
+    }
+
+    if (frac_part != 0) {
+        buff[len++] = '.';
+
+        while (frac_part%10 == 0) {
+            frac_part /= 10;
+            num_decimals--;
+        }
+
+        for (int i=num_decimals-1; i>=0; i--) {
+            buff[len + i] = '0' + frac_part%10;
+            frac_part /= 10;
+        }
+        len += num_decimals;
+    }
+
+    strn_cat_c (str, buff, len);
+}
+
+// Parses the number grammar of the text format, digits optionally followed by
+// '.' and more digits. Like scanner_float() leading spaces are not accepted.
+// Files written before we stopped using "%g" may also have an exponent like
+// in 1e-05, we accept it too. Values that don't fit in a float fail to parse.
+bool kv_scanner_distance (struct scanner_t *scnr, float *value)
+{
+    assert (value != NULL);
+    if (scnr->error) {
+        return false;
+    }
+
+    if (!isdigit (*scnr->pos)) {
+        return false;
+    }
+
+    // The value is mantissa*10^exponent. Digits beyond KV_DISTANCE_MAX_DIGITS
+    // are dropped so the mantissa fits in a double without rounding.
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int num_digits = 0;
+    char *pos = scnr->pos;
+    while (isdigit (*pos)) {
+        if (num_digits < KV_DISTANCE_MAX_DIGITS) {
+            mantissa = mantissa*10 + (*pos - '0');
+            if (mantissa != 0) {
+                num_digits++;
+            }
+        } else {
+            exponent++;
+        }
+        pos++;
+    }
+
+    if (*pos == '.') {
+        pos++;
+        while (isdigit (*pos)) {
+            if (num_digits < KV_DISTANCE_MAX_DIGITS) {
+                mantissa = mantissa*10 + (*pos - '0');
+                if (mantissa != 0) {
+                    num_digits++;
+                }
+                exponent--;
+            }
+            pos++;
+        }
+    }
+
+    if (*pos == 'e' || *pos == 'E') {
+        // Like strtof() if no digits follow, the 'e' isn't part of the number.
+        char *exponent_pos = pos + 1;
+        bool is_negative = false;
+        if (*exponent_pos == '+' || *exponent_pos == '-') {
+            is_negative = *exponent_pos == '-';
+            exponent_pos++;
+        }
+
+        if (isdigit (*exponent_pos)) {
+            int explicit_exponent = 0;
+            while (isdigit (*exponent_pos)) {
+                if (explicit_exponent < KV_DISTANCE_MAX_EXPONENT) {
+                    explicit_exponent = explicit_exponent*10 + (*exponent_pos - '0');
+                }
+                exponent_pos++;
+            }
+
+            exponent += is_negative ? -explicit_exponent : explicit_exponent;
+            pos = exponent_pos;
+        }
+    }
+
+    double power = 1;
+    for (int i=0; i<abs(exponent); i++) {
+        power *= 10;
+    }
+
+    float result;
+    if (mantissa == 0) {
+        // Avoid 0*inf when the exponent is too big.
+        result = 0;
+    } else {
+        result = exponent < 0 ? mantissa/power : mantissa*power;
+    }
+
+    if (isinf (result)) {
+        return false;
+    }
+
+    *value = result;
+    scnr->pos = pos;
+
+    if (*scnr->pos == '\0') {
+        scanner_eof_set (scnr);
+    }
+    return true;
+}
+
 // There are 2 versions of the string representations the ones created by
 // kv_to_string() contain the minimum information necessary to be stored and
 // parsed back using kv_set_from_string(). On the other hand strings generated
@@ -19,61 +285,28 @@
 #define kv_to_string_debug(pool,kv) kv_to_string_full(pool,kv,true)
 char* kv_to_string_full (mem_pool_t *pool, struct keyboard_view_t *kv, bool full)
 {
-    // Set posix locale so the decimal separator is always .
-    char *old_locale = begin_posix_locale ();
-
     string_t str = {0};
 
-    // Compute the number of digits in the real part of the biggest float so we
-    // can create a buffer big enough and never read invalid memory.
-    int buff_size = 0;
-    {
-        struct row_t *row = kv->first_row;
-        while (row != NULL) {
-            buff_size = MAX (buff_size, snprintf (NULL, 0, "%g", row->height));
-
-            struct sgmt_t *sgmt = row->first_key;
-            while (sgmt != NULL) {
-                buff_size = MAX (buff_size, snprintf (NULL, 0, "%g", sgmt->width));
-                buff_size = MAX (buff_size, snprintf (NULL, 0, "%g", sgmt->user_glue));
-                buff_size = MAX (buff_size, snprintf (NULL, 0, "%g", sgmt->internal_glue));
-
-                sgmt = sgmt->next_sgmt;
-            }
-            row = row->next_row;
-        }
-    }
-
-    // Keycodes require at 3 bytes.
-    buff_size = MAX(buff_size, 3);
-
-    char buff[buff_size + 1];
-
     struct row_t *row = kv->first_row;
     while (row != NULL) {
         if (row->height != 1) {
-            sprintf (buff, "%g", row->height);
-            str_cat_c (&str, buff);
+            str_cat_kv_distance (&str, row->height);
             str_cat_c (&str, " ");
         }
 
         struct sgmt_t *sgmt = row->first_key;
         while (sgmt != NULL) {
             if (!is_multirow_key (sgmt)) {
-                str_cat_c (&str, "K(");
-                snprintf (buff, ARRAY_SIZE(buff), "%i", sgmt->kc);
-                str_cat_c (&str, buff);
+                str_cat_printf (&str, "K(%i", sgmt->kc);
 
                 if (sgmt->width != 1) {
                     str_cat_c (&str, ", W: ");
-                    snprintf (buff, ARRAY_SIZE(buff), "%g", sgmt->width);
-                    str_cat_c (&str, buff);
+                    str_cat_kv_distance (&str, sgmt->width);
                 }
 
                 if (sgmt->user_glue != 0) {
                     str_cat_c (&str, ", UG: ");
-                    snprintf (buff, ARRAY_SIZE(buff), "%g", sgmt->user_glue);
-                    str_cat_c (&str, buff);
+                    str_cat_kv_distance (&str, sgmt->user_glue);
                 }
 
                 if (full) {
@@ -102,27 +335,22 @@ char* kv_to_string_full (mem_pool_t *pool, struct keyboard_view_t *kv, bool full
                 str_cat_c (&str, ")");
 
             } else if (is_multirow_parent (sgmt)) {
-                str_cat_c (&str, "P(");
-                snprintf (buff, ARRAY_SIZE(buff), "%i", sgmt->kc);
-                str_cat_c (&str, buff);
+                str_cat_printf (&str, "P(%i", sgmt->kc);
 
                 if (sgmt->width != 1) {
                     str_cat_c (&str, ", W: ");
-                    snprintf (buff, ARRAY_SIZE(buff), "%g", sgmt->width);
-                    str_cat_c (&str, buff);
+                    str_cat_kv_distance (&str, sgmt->width);
                 }
 
                 if (sgmt->user_glue != 0) {
                     str_cat_c (&str, ", UG: ");
-                    snprintf (buff, ARRAY_SIZE(buff), "%g", sgmt->user_glue);
-                    str_cat_c (&str, buff);
+                    str_cat_kv_distance (&str, sgmt->user_glue);
                 }
 
                 if (full) {
                     if (sgmt->internal_glue != 0) {
                         str_cat_c (&str, ", IG: ");
-                        snprintf (buff, ARRAY_SIZE(buff), "%g", sgmt->internal_glue);
-                        str_cat_c (&str, buff);
+                        str_cat_kv_distance (&str, sgmt->internal_glue);
                     }
 
                     switch (sgmt->type) {
@@ -158,8 +386,7 @@ char* kv_to_string_full (mem_pool_t *pool, struct keyboard_view_t *kv, bool full
 
                 if (sgmt->type == KEY_MULTIROW_SEGMENT_SIZED) {
                     str_cat_c (&str, "W: ");
-                    snprintf (buff, ARRAY_SIZE(buff), "%g", sgmt->width);
-                    str_cat_c (&str, buff);
+                    str_cat_kv_distance (&str, sgmt->width);
 
                     if (sgmt->align == MULTIROW_ALIGN_LEFT) {
                         str_cat_c (&str, ", L");
@@ -174,8 +401,7 @@ char* kv_to_string_full (mem_pool_t *pool, struct keyboard_view_t *kv, bool full
                     }
 
                     str_cat_c (&str, "IG: ");
-                    snprintf (buff, ARRAY_SIZE(buff), "%g", sgmt->internal_glue);
-                    str_cat_c (&str, buff);
+                    str_cat_kv_distance (&str, sgmt->internal_glue);
                 }
 
                 str_cat_c (&str, ")");
@@ -193,10 +419,9 @@ char* kv_to_string_full (mem_pool_t *pool, struct keyboard_view_t *kv, bool full
         row = row->next_row;
     }
 
-    // Restore the original locale
-    restore_locale (old_locale);
-
-    return pom_strdup (pool, str_data(&str));
+    char *res = pom_strdup (pool, str_data(&str));
+    str_free (&str);
+    return res;
 }
 
 void kv_print (struct keyboard_view_t *kv)
@@ -221,7 +446,7 @@ void parse_full_key_arguments (struct scanner_t *scnr, int *kc, float *width, fl
     scanner_consume_spaces (scnr);
     if (scanner_str (scnr, ", W:")) {
         scanner_consume_spaces (scnr);
-        if (!scanner_float (scnr, width)) {
+        if (!kv_scanner_distance (scnr, width)) {
             scanner_set_error (scnr, "Expected width.\n");
         }
     }
@@ -229,7 +454,7 @@ void parse_full_key_arguments (struct scanner_t *scnr, int *kc, float *width, fl
     scanner_consume_spaces (scnr);
     if (scanner_str (scnr, ", UG:")) {
         scanner_consume_spaces (scnr);
-        if (!scanner_float (scnr, user_glue)) {
+        if (!kv_scanner_distance (scnr, user_glue)) {
             scanner_set_error (scnr, "Expected user glue.\n");
         }
     }
@@ -253,7 +478,7 @@ void parse_key_sgmt_arguments (struct scanner_t *scnr, float *width, enum multir
     scanner_consume_spaces (scnr);
     if (scanner_str (scnr, "W:")) {
         scanner_consume_spaces (scnr);
-        if (!scanner_float (scnr, width)) {
+        if (!kv_scanner_distance (scnr, width)) {
             scanner_set_error (scnr, "Expected width.\n");
         }
 
@@ -288,9 +513,6 @@ void kv_set_from_string (struct keyboard_view_t *kv, char *str)
     struct geometry_edit_ctx_t ctx;
     kv_geometry_ctx_init_append (kv, &ctx);
 
-    // Set posix locale so the decimal separator is always .
-    char *old_locale = begin_posix_locale ();
-
     struct scanner_t scnr = ZERO_INIT(struct scanner_t);
     scnr.pos = str;
 
@@ -299,7 +521,7 @@ void kv_set_from_string (struct keyboard_view_t *kv, char *str)
     while (!scnr.is_eof && !scnr.error) {
         float row_height = 1;
         scanner_consume_spaces (&scnr);
-        scanner_float (&scnr, &row_height);
+        kv_scanner_distance (&scnr, &row_height);
 
         kv_new_row_h (&ctx, row_height);
 
@@ -384,9 +606,6 @@ void kv_set_from_string (struct keyboard_view_t *kv, char *str)
     } else {
         kv_compute_glue (kv);
     }
-
-    // Restore the original locale
-    restore_locale (old_locale);
 }
 
 bool kv_test_parser (struct keyboard_view_t *kv)
@@ -406,3 +625,486 @@ bool kv_test_parser (struct keyboard_view_t *kv)
     }
 }
 
+// Checks str_cat_kv_distance() and kv_scanner_distance() against "%g" and
+// strtof() in the POSIX locale. All distances on the step grid in
+// [-KV_TEST_DISTANCE_MAX, KV_TEST_DISTANCE_MAX] must be formatted like "%g"
+// and parsed like strtof(), random values off the grid must round trip.
+#define KV_TEST_DISTANCE_MAX 1000
+#define KV_TEST_DISTANCE_RANDOM_SAMPLES 100000
+bool kv_test_distance_format ()
+{
+    bool success = true;
+    char *old_locale = begin_posix_locale ();
+
+    string_t str = {0};
+    char buff[64];
+    struct scanner_t scnr;
+    float parsed;
+
+    int steps_per_unit = 1<<KV_STEP_PRECISION;
+    for (int i=-KV_TEST_DISTANCE_MAX*steps_per_unit; i<=KV_TEST_DISTANCE_MAX*steps_per_unit; i++) {
+        float val = (float)i/steps_per_unit;
+
+        str_set (&str, "");
+        str_cat_kv_distance (&str, val);
+        snprintf (buff, ARRAY_SIZE(buff), "%g", val);
+        if (strcmp (str_data(&str), buff) != 0) {
+            printf ("Formatting %g: expected '%s' got '%s'.\n", val, buff, str_data(&str));
+            success = false;
+        }
+
+        // The grammar has no sign.
+        if (val >= 0) {
+            scnr = ZERO_INIT(struct scanner_t);
+            scnr.pos = buff;
+            if (!kv_scanner_distance (&scnr, &parsed) || parsed != strtof (buff, NULL)) {
+                printf ("Parsing '%s': expected %g got %g.\n", buff, strtof (buff, NULL), parsed);
+                success = false;
+            }
+        }
+    }
+
+    srand (0);
+    for (int i=0; i<KV_TEST_DISTANCE_RANDOM_SAMPLES; i++) {
+        float val = (float)rand()/RAND_MAX*KV_TEST_DISTANCE_MAX;
+
+        str_set (&str, "");
+        str_cat_kv_distance (&str, val);
+        scnr = ZERO_INIT(struct scanner_t);
+        scnr.pos = str_data(&str);
+        if (!kv_scanner_distance (&scnr, &parsed) || parsed != val) {
+            printf ("Round trip of %.9g: formatted as '%s', parsed as %.9g.\n", val, str_data(&str), parsed);
+            success = false;
+        }
+
+        snprintf (buff, ARRAY_SIZE(buff), "%g", val);
+        scnr = ZERO_INIT(struct scanner_t);
+        scnr.pos = buff;
+        if (!kv_scanner_distance (&scnr, &parsed) || parsed != strtof (buff, NULL)) {
+            printf ("Parsing '%s': expected %.9g got %.9g.\n", buff, strtof (buff, NULL), parsed);
+            success = false;
+        }
+    }
+
+    // Small and big values off the grid, "%g" writes them with an exponent and
+    // so do we outside of the range we write in fixed point.
+    char *formats[] = {"%g", "%.9g", "%E"};
+    for (int i=0; i<KV_TEST_DISTANCE_RANDOM_SAMPLES; i++) {
+        float val = (float)rand()/RAND_MAX*powf (10, rand()%84 - 45);
+
+        snprintf (buff, ARRAY_SIZE(buff), formats[i%ARRAY_SIZE(formats)], val);
+        scnr = ZERO_INIT(struct scanner_t);
+        scnr.pos = buff;
+        if (!kv_scanner_distance (&scnr, &parsed) || parsed != strtof (buff, NULL) || *scnr.pos != '\0') {
+            printf ("Parsing '%s': expected %.9g got %.9g.\n", buff, strtof (buff, NULL), parsed);
+            success = false;
+        }
+
+        str_set (&str, "");
+        str_cat_kv_distance (&str, val);
+        scnr = ZERO_INIT(struct scanner_t);
+        scnr.pos = str_data(&str);
+        if (!kv_scanner_distance (&scnr, &parsed) || parsed != val || *scnr.pos != '\0') {
+            printf ("Round trip of %.9g: formatted as '%s', parsed as %.9g.\n", val, str_data(&str), parsed);
+            success = false;
+        }
+    }
+
+    // Short values with an exponent are formatted like "%g".
+    float exponent_values[] = {1e10f, -1e10f, 1e20f, 1024e20f};
+    for (int i=0; i<ARRAY_SIZE(exponent_values); i++) {
+        str_set (&str, "");
+        str_cat_kv_distance (&str, exponent_values[i]);
+        snprintf (buff, ARRAY_SIZE(buff), "%g", exponent_values[i]);
+        if (strcmp (str_data(&str), buff) != 0) {
+            printf ("Formatting %g: expected '%s' got '%s'.\n", exponent_values[i], buff, str_data(&str));
+            success = false;
+        }
+    }
+
+    // Values that don't fit in a float aren't distances.
+    scnr = ZERO_INIT(struct scanner_t);
+    scnr.pos = "1e39";
+    if (kv_scanner_distance (&scnr, &parsed)) {
+        printf ("Parsing '1e39' should fail, got %g.\n", parsed);
+        success = false;
+    }
+
+    str_free (&str);
+    restore_locale (old_locale);
+    return success;
+}
+
+// Binary representation of a keyboard view. It's used for states we only read
+// back ourselves, like the undo history and autosaves, so we don't spend time
+// formatting and parsing floats. Representations saved by the user are always
+// text.
+//
+// Blobs start with KV_BLOB_MAGIC and a version byte. Each row is KV_BLOB_OP_ROW
+// followed by its height, then one opcode per segment followed by its
+// arguments, in the same order as the text format:
+//
+//   KV_BLOB_OP_K, KV_BLOB_OP_P: keycode, width, user glue
+//   KV_BLOB_OP_S, KV_BLOB_OP_E: width (0 keeps the previous one), align
+//
+// The blob ends with KV_BLOB_OP_END. Keycodes and align are varints. Distances
+// are multiples of 1/2^KV_STEP_PRECISION so they are stored as a varint with
+// the zigzag encoded number of steps shifted left by one. Distances outside of
+// this grid (only possible in hand written .lrep files) have the low bit set
+// and are followed by the bytes of the float in native byte order.
+// @keyboard_string_formats
+#define KV_BLOB_MAGIC "\x7f" "KVB"
+#define KV_BLOB_MAGIC_LEN 4
+#define KV_BLOB_VERSION 1
+#define KV_BLOB_MAX_STEPS (1<<29)
+
+enum kv_blob_op_t {
+    KV_BLOB_OP_END,
+    KV_BLOB_OP_ROW,
+    KV_BLOB_OP_K,
+    KV_BLOB_OP_P,
+    KV_BLOB_OP_S,
+    KV_BLOB_OP_E
+};
+
+// The magic starts with a byte that's never part of a text representation.
+bool kv_is_blob (const char *data, uint32_t len)
+{
+    return len > KV_BLOB_MAGIC_LEN && memcmp (data, KV_BLOB_MAGIC, KV_BLOB_MAGIC_LEN) == 0;
+}
+
+static inline
+void kv_blob_put_varint (string_t *blob, uint32_t val)
+{
+    char buff[5];
+    int len = 0;
+    while (val >= 0x80) {
+        buff[len++] = (val & 0x7F) | 0x80;
+        val >>= 7;
+    }
+    buff[len++] = val;
+    strn_cat_c (blob, buff, len);
+}
+
+void kv_blob_put_distance (string_t *blob, float val)
+{
+    float steps = val*(1<<KV_STEP_PRECISION);
+    if (fabsf (steps) < KV_BLOB_MAX_STEPS && steps == (int32_t)steps) {
+        int32_t steps_i = (int32_t)steps;
+        uint32_t zigzag = ((uint32_t)steps_i << 1) ^ (uint32_t)(steps_i >> 31);
+        kv_blob_put_varint (blob, zigzag << 1);
+
+    } else {
+        kv_blob_put_varint (blob, 1);
+        strn_cat_c (blob, (char*)&val, sizeof(float));
+    }
+}
+
+// Returns a blob allocated in _pool_ and sets _len_ to its size. The blob
+// contains null bytes, it must always be used together with its length.
+char* kv_to_blob (mem_pool_t *pool, struct keyboard_view_t *kv, uint32_t *len)
+{
+    string_t blob = {0};
+    strn_set (&blob, KV_BLOB_MAGIC, KV_BLOB_MAGIC_LEN);
+    kv_blob_put_varint (&blob, KV_BLOB_VERSION);
+
+    for (struct row_t *row = kv->first_row; row != NULL; row = row->next_row) {
+        kv_blob_put_varint (&blob, KV_BLOB_OP_ROW);
+        kv_blob_put_distance (&blob, row->height);
+
+        for (struct sgmt_t *sgmt = row->first_key; sgmt != NULL; sgmt = sgmt->next_sgmt) {
+            if (!is_multirow_key (sgmt) || is_multirow_parent (sgmt)) {
+                kv_blob_put_varint (&blob, is_multirow_key (sgmt) ? KV_BLOB_OP_P : KV_BLOB_OP_K);
+                kv_blob_put_varint (&blob, sgmt->kc);
+                kv_blob_put_distance (&blob, sgmt->width);
+                kv_blob_put_distance (&blob, sgmt->user_glue);
+
+            } else {
+                kv_blob_put_varint (&blob,
+                                    is_multirow_parent (sgmt->next_multirow) ? KV_BLOB_OP_E : KV_BLOB_OP_S);
+                if (sgmt->type == KEY_MULTIROW_SEGMENT_SIZED) {
+                    kv_blob_put_distance (&blob, sgmt->width);
+                    kv_blob_put_varint (&blob, sgmt->align);
+                } else {
+                    kv_blob_put_distance (&blob, 0);
+                    kv_blob_put_varint (&blob, MULTIROW_ALIGN_LEFT);
+                }
+            }
+        }
+    }
+    kv_blob_put_varint (&blob, KV_BLOB_OP_END);
+
+    *len = str_len (&blob);
+    char *res = pom_dup (pool, str_data(&blob), str_len(&blob));
+    str_free (&blob);
+    return res;
+}
+
+struct kv_blob_reader_t {
+    uint8_t *pos;
+    uint8_t *end;
+    bool error;
+};
+
+static inline
+uint32_t kv_blob_get_varint (struct kv_blob_reader_t *rdr)
+{
+    uint32_t val = 0;
+    for (int shift = 0; !rdr->error; shift += 7) {
+        if (rdr->pos >= rdr->end || shift > 28) {
+            rdr->error = true;
+            break;
+        }
+
+        uint8_t byte = *rdr->pos++;
+        val |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return val;
+}
+
+float kv_blob_get_distance (struct kv_blob_reader_t *rdr)
+{
+    float val = 0;
+    uint32_t encoded = kv_blob_get_varint (rdr);
+    if (encoded & 1) {
+        if (rdr->end - rdr->pos >= sizeof(float)) {
+            memcpy (&val, rdr->pos, sizeof(float));
+            rdr->pos += sizeof(float);
+        } else {
+            rdr->error = true;
+        }
+
+    } else {
+        uint32_t zigzag = encoded >> 1;
+        int32_t steps = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+        val = (float)steps/(1<<KV_STEP_PRECISION);
+    }
+    return val;
+}
+
+// NOTE: This only parses blobs created by calling kv_to_blob().
+// @keyboard_string_formats
+void kv_set_from_blob (struct keyboard_view_t *kv, char *data, uint32_t len)
+{
+    kv_clear (kv);
+    struct geometry_edit_ctx_t ctx;
+    kv_geometry_ctx_init_append (kv, &ctx);
+
+    struct kv_blob_reader_t rdr = {0};
+    rdr.pos = (uint8_t*)data;
+    rdr.end = (uint8_t*)data + len;
+
+    if (!kv_is_blob (data, len)) {
+        rdr.error = true;
+    } else {
+        rdr.pos += KV_BLOB_MAGIC_LEN;
+        if (kv_blob_get_varint (&rdr) != KV_BLOB_VERSION) {
+            rdr.error = true;
+        }
+    }
+
+    // Multirow parents whose keys continue in the current row, in the order
+    // their segments appear. Segments in this row that continue in the next
+    // one are collected into next_open.
+    struct sgmt_t **open = NULL;
+    int open_len = 0, open_size = 0, open_pos = 0;
+    struct sgmt_t **next_open = NULL;
+    int next_open_len = 0, next_open_size = 0;
+
+    bool has_row = false;
+    while (!rdr.error) {
+        enum kv_blob_op_t op = kv_blob_get_varint (&rdr);
+
+        if (op == KV_BLOB_OP_ROW || op == KV_BLOB_OP_END) {
+            if (has_row) {
+                if (open_pos != open_len) {
+                    rdr.error = true;
+                    break;
+                }
+
+                struct sgmt_t **tmp = open;
+                int tmp_size = open_size;
+                open = next_open;
+                open_len = next_open_len;
+                open_size = next_open_size;
+                next_open = tmp;
+                next_open_len = 0;
+                next_open_size = tmp_size;
+                open_pos = 0;
+            }
+
+            if (op == KV_BLOB_OP_END) {
+                if (open_len != 0) {
+                    rdr.error = true;
+                }
+                break;
+            }
+
+            float height = kv_blob_get_distance (&rdr);
+            kv_new_row_h (&ctx, height);
+            has_row = true;
+
+        } else if (!has_row) {
+            rdr.error = true;
+
+        } else if (op == KV_BLOB_OP_K || op == KV_BLOB_OP_P) {
+            int kc = kv_blob_get_varint (&rdr);
+            float width = kv_blob_get_distance (&rdr);
+            float user_glue = kv_blob_get_distance (&rdr);
+
+            if (!rdr.error) {
+                struct sgmt_t *new_key = kv_add_key_full (&ctx, kc, width, user_glue);
+                if (op == KV_BLOB_OP_P) {
+                    DYNAMIC_ARRAY_APPEND (next_open, new_key);
+                }
+            }
+
+        } else if (op == KV_BLOB_OP_S || op == KV_BLOB_OP_E) {
+            float width = kv_blob_get_distance (&rdr);
+            enum multirow_key_align_t align = kv_blob_get_varint (&rdr);
+
+            if (!rdr.error && open_pos < open_len) {
+                struct sgmt_t *parent = open[open_pos++];
+                kv_add_multirow_sized_sgmt (&ctx, parent, width, align);
+                if (op == KV_BLOB_OP_S) {
+                    DYNAMIC_ARRAY_APPEND (next_open, parent);
+                }
+
+            } else {
+                rdr.error = true;
+            }
+
+        } else {
+            rdr.error = true;
+        }
+    }
+
+    free (open);
+    free (next_open);
+
+    if (rdr.error) {
+        printf ("Error: invalid keyboard view blob\n");
+
+    } else {
+        kv_compute_glue (kv);
+    }
+}
+
+// Representations can be stored as text or as blobs.
+void kv_set_from_repr_data (struct keyboard_view_t *kv, char *data, uint32_t len)
+{
+    if (kv_is_blob (data, len)) {
+        kv_set_from_blob (kv, data, len);
+    } else {
+        kv_set_from_string (kv, data);
+    }
+}
+
+// Compares the geometries of _kv1_ and _kv2_ field by field, distances must be
+// exactly the same float. Prints the first difference found.
+bool kv_test_geometries_equal (struct keyboard_view_t *kv1, struct keyboard_view_t *kv2)
+{
+    int row_idx = 0;
+    struct row_t *row1 = kv1->first_row, *row2 = kv2->first_row;
+    while (row1 != NULL && row2 != NULL) {
+        if (row1->height != row2->height) {
+            printf ("Row %d: height %.9g != %.9g\n", row_idx, row1->height, row2->height);
+            return false;
+        }
+
+        int sgmt_idx = 0;
+        struct sgmt_t *sgmt1 = row1->first_key, *sgmt2 = row2->first_key;
+        while (sgmt1 != NULL && sgmt2 != NULL) {
+            if (sgmt1->kc != sgmt2->kc || sgmt1->type != sgmt2->type || sgmt1->align != sgmt2->align ||
+                is_multirow_parent (sgmt1) != is_multirow_parent (sgmt2) ||
+                sgmt1->width != sgmt2->width || sgmt1->user_glue != sgmt2->user_glue ||
+                sgmt1->internal_glue != sgmt2->internal_glue) {
+                printf ("Row %d, segment %d: kc %d != %d, type %d != %d, align %d != %d, "
+                        "width %.9g != %.9g, user glue %.9g != %.9g, internal glue %.9g != %.9g\n",
+                        row_idx, sgmt_idx, sgmt1->kc, sgmt2->kc, sgmt1->type, sgmt2->type,
+                        sgmt1->align, sgmt2->align, sgmt1->width, sgmt2->width,
+                        sgmt1->user_glue, sgmt2->user_glue, sgmt1->internal_glue, sgmt2->internal_glue);
+                return false;
+            }
+
+            sgmt1 = sgmt1->next_sgmt;
+            sgmt2 = sgmt2->next_sgmt;
+            sgmt_idx++;
+        }
+
+        if (sgmt1 != NULL || sgmt2 != NULL) {
+            printf ("Row %d: different number of segments\n", row_idx);
+            return false;
+        }
+
+        row1 = row1->next_row;
+        row2 = row2->next_row;
+        row_idx++;
+    }
+
+    if (row1 != NULL || row2 != NULL) {
+        printf ("Different number of rows\n");
+        return false;
+    }
+    return true;
+}
+
+// Parses the blob of _kv_ into a new view and compares both, then checks the
+// new view encodes into the same blob.
+bool kv_test_blob_round_trip (struct keyboard_view_t *kv, mem_pool_t *pool)
+{
+    uint32_t len;
+    char *blob = kv_to_blob (pool, kv, &len);
+
+    struct keyboard_view_t *parsed = kv_new ();
+    kv_set_from_blob (parsed, blob, len);
+
+    bool success = kv_test_geometries_equal (kv, parsed);
+    if (success) {
+        uint32_t parsed_len;
+        char *parsed_blob = kv_to_blob (pool, parsed, &parsed_len);
+        if (parsed_len != len || memcmp (blob, parsed_blob, len) != 0) {
+            printf ("Blob of the parsed geometry is different\n");
+            success = false;
+        }
+    }
+
+    keyboard_view_destroy (parsed);
+    return success;
+}
+
+// Checks that _kv_ is the same after going through kv_to_blob() and
+// kv_set_from_blob(). Then does the same after moving row heights, glue and the
+// width of single row keys off the step grid, including values too big to be
+// stored as steps.
+bool kv_test_blob (struct keyboard_view_t *kv)
+{
+    mem_pool_t pool = ZERO_INIT(mem_pool_t);
+    bool success = kv_test_blob_round_trip (kv, &pool);
+
+    float off_grid[] = {1e-05f, 0.1f, 1.0f/3, 12345.678f, 3e8f};
+    int i = 0;
+    for (struct row_t *row = kv->first_row; row != NULL; row = row->next_row) {
+        row->height += off_grid[i++%ARRAY_SIZE(off_grid)];
+
+        for (struct sgmt_t *sgmt = row->first_key; sgmt != NULL; sgmt = sgmt->next_sgmt) {
+            if (!is_multirow_key (sgmt)) {
+                sgmt->width += off_grid[i++%ARRAY_SIZE(off_grid)];
+            }
+
+            if (!is_multirow_key (sgmt) || is_multirow_parent (sgmt)) {
+                sgmt->user_glue += off_grid[i++%ARRAY_SIZE(off_grid)];
+            }
+        }
+    }
+    kv_compute_glue (kv);
+
+    success = kv_test_blob_round_trip (kv, &pool) && success;
+
+    mem_pool_destroy (&pool);
+    return success;
+}
+
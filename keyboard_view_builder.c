@@ -122,22 +122,167 @@ struct keyboard_view_t* kv_new ()
     *kv = ZERO_INIT(struct keyboard_view_t);
     kv->pool = pool;
 
+    // Views without a widget also need it, distances are multiples of it and
+    // the point query grid is built from it.
+    kv->default_key_size = KV_DEFAULT_KEY_SIZE;
+
+    // See struct kv_timing_t.
+    char *render_timing = getenv ("KV_RENDER_TIMING");
+    if (render_timing != NULL) {
+        kv->timing.show_overlay = strstr (render_timing, "overlay") != NULL;
+        kv->timing.log = strstr (render_timing, "log") != NULL;
+    }
+
     return kv;
 }
 
+// The keycode to key map uses open addressing with linear probing. Keycodes are
+// small and dense so they are their own hash. Entries are never removed,
+// unassigning a keycode sets its key to NULL, this keeps probe sequences intact
+// and the number of entries is bounded by the number of distinct keycodes.
+#define KV_KC_MAP_INITIAL_SIZE 256
+
+struct sgmt_t* kv_get_key_by_kc (struct keyboard_view_t *kv, int kc)
+{
+    if (kv->keys_by_kc_size == 0 || kc <= 0 || kc >= KEY_CNT) {
+        return NULL;
+    }
+
+    int mask = kv->keys_by_kc_size - 1;
+    int i = kc & mask;
+    while (kv->keys_by_kc[i].kc != 0) {
+        if (kv->keys_by_kc[i].kc == kc) {
+            return kv->keys_by_kc[i].sgmt;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
+static
+struct kv_kc_map_entry_t* kv_kc_map_lookup (struct kv_kc_map_entry_t *map, int size, int kc)
+{
+    int mask = size - 1;
+    int i = kc & mask;
+    while (map[i].kc != 0 && map[i].kc != kc) {
+        i = (i + 1) & mask;
+    }
+
+    return &map[i];
+}
+
+void kv_set_key_by_kc (struct keyboard_view_t *kv, int kc, struct sgmt_t *sgmt)
+{
+    if (kc <= 0 || kc >= KEY_CNT) {
+        return;
+    }
+
+    if (kv->keys_by_kc_size > 0) {
+        struct kv_kc_map_entry_t *entry =
+            kv_kc_map_lookup (kv->keys_by_kc, kv->keys_by_kc_size, kc);
+        if (entry->kc != 0 || sgmt == NULL) {
+            entry->sgmt = sgmt;
+            return;
+        }
+    }
+
+    // Keep the load factor under 1/2. When growing, entries set to NULL are
+    // dropped.
+    if (2*(kv->keys_by_kc_len + 1) > kv->keys_by_kc_size) {
+        int new_size = MAX (KV_KC_MAP_INITIAL_SIZE, 2*kv->keys_by_kc_size);
+        struct kv_kc_map_entry_t *new_map = calloc (new_size, sizeof(struct kv_kc_map_entry_t));
+
+        int new_len = 0;
+        for (int i=0; i<kv->keys_by_kc_size; i++) {
+            if (kv->keys_by_kc[i].sgmt != NULL) {
+                *kv_kc_map_lookup (new_map, new_size, kv->keys_by_kc[i].kc) = kv->keys_by_kc[i];
+                new_len++;
+            }
+        }
+
+        free (kv->keys_by_kc);
+        kv->keys_by_kc = new_map;
+        kv->keys_by_kc_size = new_size;
+        kv->keys_by_kc_len = new_len;
+    }
+
+    struct kv_kc_map_entry_t *entry = kv_kc_map_lookup (kv->keys_by_kc, kv->keys_by_kc_size, kc);
+    entry->kc = kc;
+    entry->sgmt = sgmt;
+    kv->keys_by_kc_len++;
+}
+
+void kv_invalidate_geometry (struct keyboard_view_t *kv)
+{
+    kv->geometry.valid = false;
+}
+
 void kv_clear (struct keyboard_view_t *kv)
 {
     mem_pool_destroy (&kv->keyboard_pool);
     kv->keyboard_pool = ZERO_INIT(mem_pool_t);
 
-    memset(kv->keys_by_kc, 0, sizeof(kv->keys_by_kc));
+    if (kv->keys_by_kc != NULL) {
+        memset(kv->keys_by_kc, 0, kv->keys_by_kc_size*sizeof(struct kv_kc_map_entry_t));
+        kv->keys_by_kc_len = 0;
+    }
     kv->spare_keys = NULL;
     kv->spare_rows = NULL;
     kv->first_row = NULL;
+    kv_invalidate_geometry (kv);
+
+    kv->num_glue_dirty_sgmts = 0;
+    kv->num_glue_dirty_rows = 0;
+    kv->glue_dirty_all = false;
 }
 
+void kv_key_surface_cache_clear (struct kv_key_surface_cache_t *cache);
+void kv_timing_log (struct keyboard_view_t *kv);
+void kv_autosave_writer_destroy (struct kv_autosave_writer_t *writer);
+void kv_keymap_compiler_destroy (struct keyboard_view_t *kv);
+void kv_widget_destroy_handler (GtkWidget *widget, gpointer user_data);
 void keyboard_view_destroy (struct keyboard_view_t *kv)
 {
+    // The widget may outlive the view, don't let its callbacks see it after
+    // this. If the widget was destroyed first kv->widget is NULL, see
+    // kv_widget_destroy_handler().
+    if (kv->widget != NULL) {
+        if (kv->motion_tick_id != 0) {
+            gtk_widget_remove_tick_callback (kv->widget, kv->motion_tick_id);
+            kv->motion_tick_id = 0;
+        }
+        g_signal_handlers_disconnect_by_func (kv->widget, kv_widget_destroy_handler, kv);
+    }
+
+    // Write pending autosaves before anything else is freed.
+    kv_autosave_writer_destroy (&kv->autosave_writer);
+
+    // Callbacks of pending keymaps are called with the view still intact.
+    kv_keymap_compiler_destroy (kv);
+
+    // The keymap may still be referenced by the keymap cache of this thread.
+    if (kv->xkb_state != NULL) {
+        xkb_state_unref (kv->xkb_state);
+    }
+
+    if (kv->xkb_keymap != NULL) {
+        xkb_keymap_unref (kv->xkb_keymap);
+    }
+
+    kv_key_surface_cache_clear (&kv->key_surfaces);
+    str_free (&kv->key_surfaces.scratch_id);
+    mem_pool_destroy (&kv->geometry.pool);
+    free (kv->keys_by_kc);
+
+    if (kv->timing.log) {
+        kv_timing_log (kv);
+    }
+
+    if (kv->pending_motion != NULL) {
+        gdk_event_free (kv->pending_motion);
+    }
+
     mem_pool_destroy (&kv->keyboard_pool);
     mem_pool_destroy (&kv->tooltips_pool);
     mem_pool_destroy (&kv->resize_pool);
@@ -157,11 +302,10 @@ struct row_state_t {
     float width;
 };
 
-// NOTE: This function only modifies the internal glue for multirow keys, it's
-// expected that all other keys will have internal_glue == 0.
-void kv_compute_glue (struct keyboard_view_t *kv)
+// Computes the internal glue of the multirow keys in the num_rows rows starting
+// at first_row. Multirow keys must not cross the boundaries of the range.
+void kv_compute_glue_rows (struct keyboard_view_t *kv, struct row_t *first_row, int num_rows)
 {
-    int num_rows = kv_get_num_rows (kv);
 
     struct key_state_t keys_state[num_rows];
     {
@@ -174,8 +318,8 @@ void kv_compute_glue (struct keyboard_view_t *kv)
     struct row_state_t rows_state[num_rows];
     int row_idx = 0;
     {
-        struct row_t *curr_row = kv->first_row;
-        while (curr_row != NULL) {
+        struct row_t *curr_row = first_row;
+        while (row_idx < num_rows) {
             rows_state[row_idx].curr_key = curr_row->first_key;
             rows_state[row_idx].width = 0;
             curr_row = curr_row->next_row;
@@ -321,6 +465,155 @@ void kv_compute_glue (struct keyboard_view_t *kv)
     }
 }
 
+void kv_clear_glue_dirty (struct keyboard_view_t *kv)
+{
+    kv->num_glue_dirty_sgmts = 0;
+    kv->num_glue_dirty_rows = 0;
+    kv->glue_dirty_all = false;
+}
+
+// NOTE: This function only modifies the internal glue for multirow keys, it's
+// expected that all other keys will have internal_glue == 0.
+void kv_compute_glue (struct keyboard_view_t *kv)
+{
+    kv_invalidate_geometry (kv);
+    kv_compute_glue_rows (kv, kv->first_row, kv_get_num_rows (kv));
+    kv_clear_glue_dirty (kv);
+}
+
+// Edits that change the width or glue of a segment, add segments or remove them
+// must mark them with one of these so kv_compute_glue_dirty() recomputes the
+// internal glue around them. For removed segments mark their row, or a segment
+// that was next to them.
+void kv_mark_glue_dirty (struct keyboard_view_t *kv, struct sgmt_t *sgmt)
+{
+    if (kv->num_glue_dirty_sgmts < KV_MAX_GLUE_DIRTY) {
+        kv->glue_dirty_sgmts[kv->num_glue_dirty_sgmts++] = sgmt;
+    } else {
+        kv->glue_dirty_all = true;
+    }
+}
+
+void kv_mark_glue_dirty_row (struct keyboard_view_t *kv, struct row_t *row)
+{
+    if (kv->num_glue_dirty_rows < KV_MAX_GLUE_DIRTY) {
+        kv->glue_dirty_rows[kv->num_glue_dirty_rows++] = row;
+    } else {
+        kv->glue_dirty_all = true;
+    }
+}
+
+void kv_mark_glue_dirty_all (struct keyboard_view_t *kv)
+{
+    kv->glue_dirty_all = true;
+}
+
+#define DEBUG_INCREMENTAL_GLUE 0
+
+// Same as kv_compute_glue() but only recomputes the internal glue of the rows
+// that can be affected by the segments and rows marked as dirty.
+//
+// Internal glue only propagates across rows through multirow keys. We split
+// the keyboard into bands of consecutive rows connected by multirow keys, and
+// recompute only the bands that contain something marked as dirty. No multirow
+// key crosses the boundary of a band, so computing the glue of a band is
+// independent of the rest of the keyboard.
+void kv_compute_glue_dirty (struct keyboard_view_t *kv)
+{
+    kv_invalidate_geometry (kv);
+
+    if (kv->glue_dirty_all) {
+        kv_compute_glue (kv);
+        return;
+    }
+
+    struct row_t *band_first_row = NULL;
+    int band_start = 0, band_end = 0;
+    bool band_dirty = false;
+
+    int row_idx = 0;
+    for (struct row_t *curr_row = kv->first_row; curr_row; curr_row = curr_row->next_row) {
+        if (band_first_row == NULL) {
+            band_first_row = curr_row;
+            band_start = row_idx;
+            band_end = row_idx;
+            band_dirty = false;
+        }
+
+        for (int i=0; !band_dirty && i<kv->num_glue_dirty_rows; i++) {
+            band_dirty = kv->glue_dirty_rows[i] == curr_row;
+        }
+
+        for (struct sgmt_t *curr_sgmt = curr_row->first_key; curr_sgmt; curr_sgmt = curr_sgmt->next_sgmt) {
+            if (is_multirow_parent (curr_sgmt)) {
+                int len = 0;
+                struct sgmt_t *tmp_sgmt = curr_sgmt;
+                do {
+                    len++;
+                    tmp_sgmt = tmp_sgmt->next_multirow;
+                } while (tmp_sgmt != curr_sgmt);
+
+                band_end = MAX (band_end, row_idx + len - 1);
+            }
+
+            for (int i=0; !band_dirty && i<kv->num_glue_dirty_sgmts; i++) {
+                band_dirty = kv->glue_dirty_sgmts[i] == curr_sgmt;
+            }
+        }
+
+        if (row_idx == band_end) {
+            if (band_dirty) {
+                kv_compute_glue_rows (kv, band_first_row, band_end - band_start + 1);
+            }
+            band_first_row = NULL;
+        }
+
+        row_idx++;
+    }
+
+    kv_clear_glue_dirty (kv);
+
+#if DEBUG_INCREMENTAL_GLUE
+    {
+        mem_pool_t pool = {0};
+        int num_sgmts = 0;
+        for (struct row_t *curr_row = kv->first_row; curr_row; curr_row = curr_row->next_row) {
+            for (struct sgmt_t *curr_sgmt = curr_row->first_key; curr_sgmt; curr_sgmt = curr_sgmt->next_sgmt) {
+                num_sgmts++;
+            }
+        }
+
+        float *incremental_glue = mem_pool_push_array (&pool, num_sgmts, float);
+        int i = 0;
+        for (struct row_t *curr_row = kv->first_row; curr_row; curr_row = curr_row->next_row) {
+            for (struct sgmt_t *curr_sgmt = curr_row->first_key; curr_sgmt; curr_sgmt = curr_sgmt->next_sgmt) {
+                incremental_glue[i++] = curr_sgmt->internal_glue;
+            }
+        }
+
+        kv_compute_glue (kv);
+
+        bool success = true;
+        i = 0;
+        row_idx = 0;
+        for (struct row_t *curr_row = kv->first_row; curr_row; curr_row = curr_row->next_row) {
+            for (struct sgmt_t *curr_sgmt = curr_row->first_key; curr_sgmt; curr_sgmt = curr_sgmt->next_sgmt) {
+                if (incremental_glue[i] != curr_sgmt->internal_glue) {
+                    printf ("Incremental glue mismatch at row %d: %f != %f (full)\n",
+                            row_idx, incremental_glue[i], curr_sgmt->internal_glue);
+                    success = false;
+                }
+                i++;
+            }
+            row_idx++;
+        }
+        assert (success);
+
+        mem_pool_destroy (&pool);
+    }
+#endif
+}
+
 struct geometry_edit_ctx_t {
     struct sgmt_t *last_key;
     struct row_t *last_row;
@@ -387,7 +680,7 @@ struct sgmt_t* kv_add_key_full (struct geometry_edit_ctx_t *ctx,
     new_key->user_glue = glue;
 
     if (0 < keycode && keycode < KEY_CNT) {
-        kv->keys_by_kc[keycode] = new_key;
+        kv_set_key_by_kc (kv, keycode, new_key);
     } else {
         keycode = 0;
     }
@@ -0,0 +1,433 @@
+/*
+ * Copiright (C) 2019 Santiago León O.
+ */
+
+// Headless renderer for keyboard views. It renders every combination of
+// geometry, layout and modifier state into PNG or SVG files, without needing a
+// display. It's used to generate reference images of layouts.
+//
+//   ./bin/keyboard-view-renderer --geometries data/repr --layouts tests/XKeyboardConfig
+//                                --mods none,Shift,Mod5,Shift+Mod5 --format png
+//                                --output renders/
+//
+// Geometries are all .lrep files in the geometries directory plus the built in
+// "Simple" one. Layouts are all .xkb files in the layouts directory. Modifier
+// states are comma separated, modifiers in a state are joined with '+' and
+// "none" is the empty state. Files are written to the output directory as
+// <geometry>-<layout>-<modifiers>.<format>.
+//
+// Work is split in jobs, one per (geometry, layout) pair, so the keymap is
+// compiled once for all modifier states. Jobs are distributed over a pool of
+// threads, each one has its own keyboard view, which contains the xkb_state and
+// the render caches, and its own cairo surface.
+
+#include "common.h"
+#include "bit_operations.c"
+#include "status.c"
+#include "scanner.c"
+#include "cli_parser.c"
+#include "binary_tree.c"
+
+#include <xkbcommon/xkbcommon.h>
+#include <linux/input-event-codes.h>
+#include "xkb_keycode_names.h"
+#include "kernel_keycode_names.h"
+#include "keysym_names.h"
+
+#include <gtk/gtk.h>
+#include <cairo-svg.h>
+#include "gresource.c"
+#include "gtk_utils.c"
+#include "fk_popover.c"
+#include "fk_searchable_list.c"
+
+#include "keyboard_view.h"
+#include "keyboard_view_builder.c"
+#include "keyboard_view_as_string.c"
+#include "keyboard_view_repr_store.c"
+#include "keyboard_view.c"
+
+#include <pthread.h>
+
+#define RENDERER_DEFAULT_GEOMETRIES "./data/repr"
+#define RENDERER_DEFAULT_LAYOUTS "./tests/XKeyboardConfig"
+#define RENDERER_DEFAULT_MODS "none,Shift"
+
+enum renderer_format_t {
+    RENDERER_FORMAT_PNG,
+    RENDERER_FORMAT_SVG
+};
+
+struct renderer_input_t {
+    char *name; // File name without directory or extension
+    char *data;
+    uint64_t len; // Geometries may be binary blobs, see kv_set_from_repr_data()
+
+    struct renderer_input_t *next;
+};
+
+struct renderer_t {
+    mem_pool_t pool;
+
+    enum renderer_format_t format;
+    char *output_dir;
+
+    int num_geometries;
+    struct renderer_input_t **geometries;
+
+    int num_layouts;
+    struct renderer_input_t **layouts;
+
+    int num_mod_states;
+    char **mod_states;
+
+    pthread_mutex_t jobs_mutex;
+    int next_job;
+    int num_rendered;
+    int num_failed;
+};
+
+struct renderer_thread_t {
+    pthread_t thread;
+    struct renderer_t *renderer;
+
+    struct keyboard_view_t *kv;
+    struct renderer_input_t *curr_geometry;
+    cairo_surface_t *surface;
+};
+
+struct collect_inputs_clsr_t {
+    mem_pool_t *pool;
+    char *extension;
+
+    int num_inputs;
+    struct renderer_input_t *inputs;
+};
+
+ITERATE_DIR_CB(collect_inputs)
+{
+    struct collect_inputs_clsr_t *clsr = (struct collect_inputs_clsr_t*)data;
+
+    // Autosaves are unsaved states of other geometries, don't render them.
+    char *extension = get_extension (fname);
+    if (!is_dir && extension != NULL && strcmp (extension, clsr->extension) == 0 &&
+        !g_str_has_suffix (fname, ".autosave.lrep")) {
+        struct renderer_input_t *new_input = mem_pool_push_struct (clsr->pool, struct renderer_input_t);
+        *new_input = ZERO_INIT (struct renderer_input_t);
+
+        char *dirname, *basename;
+        path_split (clsr->pool, fname, &dirname, &basename);
+        new_input->name = remove_extension (clsr->pool, basename);
+        new_input->data = full_file_read (clsr->pool, fname, &new_input->len);
+
+        new_input->next = clsr->inputs;
+        clsr->inputs = new_input;
+        clsr->num_inputs++;
+    }
+}
+
+templ_sort_ll (renderer_input_sort, struct renderer_input_t, strcmp (a->name, b->name) < 0)
+
+// Returns an array with all files in path with the given extension, sorted by
+// name so the job order is stable between runs.
+struct renderer_input_t** renderer_load_inputs (mem_pool_t *pool, char *path, char *extension,
+                                                struct renderer_input_t *extra_input,
+                                                int *num_inputs)
+{
+    struct collect_inputs_clsr_t clsr = {0};
+    clsr.pool = pool;
+    clsr.extension = extension;
+
+    if (path_exists (path)) {
+        iterate_dir (path, collect_inputs, &clsr);
+    } else {
+        printf ("Directory '%s' does not exist.\n", path);
+    }
+
+    if (extra_input != NULL) {
+        extra_input->next = clsr.inputs;
+        clsr.inputs = extra_input;
+        clsr.num_inputs++;
+    }
+
+    renderer_input_sort (&clsr.inputs, clsr.num_inputs);
+
+    struct renderer_input_t **res = mem_pool_push_array (pool, clsr.num_inputs, struct renderer_input_t*);
+    int i = 0;
+    for (struct renderer_input_t *curr_input = clsr.inputs; curr_input; curr_input = curr_input->next) {
+        res[i++] = curr_input;
+    }
+
+    *num_inputs = clsr.num_inputs;
+    return res;
+}
+
+// Computes the modifier mask for a state like "Shift+Mod5". Returns false if
+// some modifier doesn't exist in the keymap.
+bool renderer_mod_state_mask (struct xkb_keymap *keymap, char *mod_state, xkb_mod_mask_t *mask)
+{
+    *mask = 0;
+    if (strcmp (mod_state, "none") == 0) {
+        return true;
+    }
+
+    bool success = true;
+    string_t name = {0};
+    char *start = mod_state;
+    while (success && *start != '\0') {
+        char *end = start;
+        while (*end != '\0' && *end != '+') end++;
+
+        strn_set (&name, start, end - start);
+        xkb_mod_index_t idx = xkb_keymap_mod_get_index (keymap, str_data(&name));
+        if (idx != XKB_MOD_INVALID) {
+            *mask |= 1 << idx;
+        } else {
+            success = false;
+        }
+
+        start = *end == '+' ? end + 1 : end;
+    }
+    str_free (&name);
+
+    return success;
+}
+
+void renderer_render (struct renderer_thread_t *thread, char *path)
+{
+    struct renderer_t *renderer = thread->renderer;
+    struct keyboard_view_t *kv = thread->kv;
+
+    double width, height;
+    kv_get_size (kv, &width, &height);
+    int surface_width = ceil(width) + 1;
+    int surface_height = ceil(height) + 1;
+
+    if (renderer->format == RENDERER_FORMAT_PNG) {
+        if (thread->surface == NULL ||
+            cairo_image_surface_get_width (thread->surface) != surface_width ||
+            cairo_image_surface_get_height (thread->surface) != surface_height) {
+            if (thread->surface != NULL) {
+                cairo_surface_destroy (thread->surface);
+            }
+            thread->surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, surface_width, surface_height);
+        }
+
+        cairo_t *cr = cairo_create (thread->surface);
+        keyboard_view_render (NULL, cr, kv);
+        cairo_destroy (cr);
+
+        cairo_surface_flush (thread->surface);
+        if (cairo_surface_write_to_png (thread->surface, path) != CAIRO_STATUS_SUCCESS) {
+            printf ("Failed to write '%s'.\n", path);
+        }
+
+    } else { // renderer->format == RENDERER_FORMAT_SVG
+        cairo_surface_t *surface = cairo_svg_surface_create (path, surface_width, surface_height);
+        cairo_t *cr = cairo_create (surface);
+        keyboard_view_render (NULL, cr, kv);
+        cairo_destroy (cr);
+        cairo_surface_destroy (surface);
+    }
+}
+
+void renderer_run_job (struct renderer_thread_t *thread, int job)
+{
+    struct renderer_t *renderer = thread->renderer;
+    struct renderer_input_t *geometry = renderer->geometries[job / renderer->num_layouts];
+    struct renderer_input_t *layout = renderer->layouts[job % renderer->num_layouts];
+
+    if (thread->curr_geometry != geometry) {
+        kv_set_from_repr_data (thread->kv, geometry->data, geometry->len);
+        thread->curr_geometry = geometry;
+    }
+
+    bool success = keyboard_view_set_keymap (thread->kv, layout->data);
+
+    int num_rendered = 0, num_failed = 0;
+    if (success) {
+        string_t path = {0};
+        for (int i=0; i<renderer->num_mod_states; i++) {
+            xkb_mod_mask_t mask;
+            if (!renderer_mod_state_mask (thread->kv->xkb_keymap, renderer->mod_states[i], &mask)) {
+                printf ("Layout '%s' doesn't define all modifiers in '%s'.\n",
+                        layout->name, renderer->mod_states[i]);
+                num_failed++;
+                continue;
+            }
+            xkb_state_update_mask (thread->kv->xkb_state, mask, 0, 0, 0, 0, 0);
+
+            str_set_printf (&path, "%s/%s-%s-%s.%s", renderer->output_dir,
+                            geometry->name, layout->name, renderer->mod_states[i],
+                            renderer->format == RENDERER_FORMAT_PNG ? "png" : "svg");
+            renderer_render (thread, str_data(&path));
+            num_rendered++;
+        }
+        str_free (&path);
+
+    } else {
+        printf ("Failed to compile layout '%s'.\n", layout->name);
+        num_failed += renderer->num_mod_states;
+    }
+
+    pthread_mutex_lock (&renderer->jobs_mutex);
+    renderer->num_rendered += num_rendered;
+    renderer->num_failed += num_failed;
+    pthread_mutex_unlock (&renderer->jobs_mutex);
+}
+
+void* renderer_thread (void *data)
+{
+    struct renderer_thread_t *thread = (struct renderer_thread_t*)data;
+    struct renderer_t *renderer = thread->renderer;
+
+    thread->kv = kv_new ();
+
+    int num_jobs = renderer->num_geometries*renderer->num_layouts;
+    while (true) {
+        pthread_mutex_lock (&renderer->jobs_mutex);
+        int job = renderer->next_job++;
+        pthread_mutex_unlock (&renderer->jobs_mutex);
+
+        if (job >= num_jobs) {
+            break;
+        }
+
+        renderer_run_job (thread, job);
+    }
+
+    if (thread->surface != NULL) {
+        cairo_surface_destroy (thread->surface);
+    }
+    keyboard_view_destroy (thread->kv);
+
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    init_kernel_keycode_names ();
+    init_xkb_keycode_names ();
+
+    struct renderer_t renderer = {0};
+    pthread_mutex_init (&renderer.jobs_mutex, NULL);
+
+    char *format_str = get_cli_arg_opt ("--format", argv, argc);
+    if (format_str == NULL || strcmp (format_str, "png") == 0) {
+        renderer.format = RENDERER_FORMAT_PNG;
+    } else if (strcmp (format_str, "svg") == 0) {
+        renderer.format = RENDERER_FORMAT_SVG;
+    } else {
+        printf ("Invalid format '%s', expected png or svg.\n", format_str);
+        return 1;
+    }
+
+    int num_threads = sysconf (_SC_NPROCESSORS_ONLN);
+    char *num_threads_str = get_cli_arg_opt ("--threads", argv, argc);
+    if (num_threads_str != NULL) {
+        num_threads = atoi (num_threads_str);
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    renderer.output_dir = get_cli_arg_opt ("--output", argv, argc);
+    if (renderer.output_dir == NULL) {
+        renderer.output_dir = ".";
+    }
+
+    // ensure_path_exists() only creates directories followed by '/'.
+    string_t output_dir = str_new (renderer.output_dir);
+    if (str_last (&output_dir) != '/') {
+        str_cat_c (&output_dir, "/");
+    }
+    bool output_dir_exists = ensure_path_exists (str_data(&output_dir));
+    str_free (&output_dir);
+
+    if (!output_dir_exists) {
+        printf ("Can't create output directory '%s'.\n", renderer.output_dir);
+        return 1;
+    }
+
+    char *geometries_path = get_cli_arg_opt ("--geometries", argv, argc);
+    if (geometries_path == NULL) {
+        geometries_path = RENDERER_DEFAULT_GEOMETRIES;
+    }
+
+    char *layouts_path = get_cli_arg_opt ("--layouts", argv, argc);
+    if (layouts_path == NULL) {
+        layouts_path = RENDERER_DEFAULT_LAYOUTS;
+    }
+
+    char *mods_str = get_cli_arg_opt ("--mods", argv, argc);
+    if (mods_str == NULL) {
+        mods_str = RENDERER_DEFAULT_MODS;
+    }
+
+    // The built in default geometry isn't stored in a file, get its string
+    // representation.
+    struct renderer_input_t *default_geometry = mem_pool_push_struct (&renderer.pool, struct renderer_input_t);
+    {
+        *default_geometry = ZERO_INIT (struct renderer_input_t);
+        struct keyboard_view_t *kv = kv_new ();
+        kv_build_default_geometry (kv);
+        default_geometry->name = "Simple";
+        default_geometry->data = kv_to_string (&renderer.pool, kv);
+        default_geometry->len = strlen (default_geometry->data);
+        keyboard_view_destroy (kv);
+    }
+
+    renderer.geometries = renderer_load_inputs (&renderer.pool, geometries_path, "lrep",
+                                                default_geometry, &renderer.num_geometries);
+    renderer.layouts = renderer_load_inputs (&renderer.pool, layouts_path, "xkb",
+                                             NULL, &renderer.num_layouts);
+
+    {
+        char *mods = pom_strdup (&renderer.pool, mods_str);
+        renderer.num_mod_states = 1;
+        for (char *c = mods; *c; c++) {
+            if (*c == ',') renderer.num_mod_states++;
+        }
+
+        renderer.mod_states = mem_pool_push_array (&renderer.pool, renderer.num_mod_states, char*);
+        int i = 0;
+        char *start = mods;
+        for (char *c = mods; ; c++) {
+            if (*c == ',' || *c == '\0') {
+                bool is_end = *c == '\0';
+                *c = '\0';
+                renderer.mod_states[i++] = start;
+                start = c + 1;
+
+                if (is_end) break;
+            }
+        }
+    }
+
+    int num_jobs = renderer.num_geometries*renderer.num_layouts;
+    num_threads = MIN (num_threads, MAX (num_jobs, 1));
+    printf ("Rendering %d geometries x %d layouts x %d modifier states with %d threads.\n",
+            renderer.num_geometries, renderer.num_layouts, renderer.num_mod_states, num_threads);
+
+    double start = get_wall_time_ms ();
+
+    struct renderer_thread_t *threads =
+        mem_pool_push_array (&renderer.pool, num_threads, struct renderer_thread_t);
+    for (int i=0; i<num_threads; i++) {
+        threads[i] = ZERO_INIT (struct renderer_thread_t);
+        threads[i].renderer = &renderer;
+        pthread_create (&threads[i].thread, NULL, renderer_thread, &threads[i]);
+    }
+
+    for (int i=0; i<num_threads; i++) {
+        pthread_join (threads[i].thread, NULL);
+    }
+
+    printf ("Rendered %d images in %.3f s, %d failed.\n",
+            renderer.num_rendered, (get_wall_time_ms () - start)/1000, renderer.num_failed);
+
+    pthread_mutex_destroy (&renderer.jobs_mutex);
+    mem_pool_destroy (&renderer.pool);
+
+    return renderer.num_failed > 0 ? 1 : 0;
+}
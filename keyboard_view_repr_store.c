@@ -12,31 +12,94 @@
 // This is also where we create all programatic representations so there are
 // several examples of how the keyboard_view_builder.c module is used.
 
+// Each representation has a history of states. The first state is the
+// representation as it was loaded (from its file, the GResource or a builder
+// function), this is what we call the saved state. It's always kept in full and
+// is never evicted. Following states come from edits and autosaves.
+//
+// To avoid storing a full copy of the representation for each edit, states
+// after the first one store a delta against the previous state. Every
+// KV_REPR_KEYFRAME_INTERVAL states we store a full copy instead (a keyframe),
+// so materializing any state applies a bounded number of deltas.
+//
+// Undo and redo only move the curr_state cursor, the data for a state is
+// materialized when requested with kv_repr_get_current(). Pushing a state when
+// the cursor isn't at the end discards the states that could be redone.
+//
+// The saved state is text, states pushed by edits are usually blobs created by
+// kv_to_blob(). Data of states is handled together with its length because
+// blobs contain null bytes, see kv_set_from_repr_data().
+//
+// The memory used by states after the saved one is bounded by the store's
+// history_max_size. When it's exceeded the oldest states are evicted, undoing
+// past them goes back to the saved state.
+#define KV_REPR_KEYFRAME_INTERVAL 32
+#define KV_REPR_HISTORY_MAX_SIZE (1024*1024)
+
 struct kv_repr_state_t {
-    char *repr;
+    // Keyframes store the data followed by a null byte, other states store a
+    // delta against prev, see kv_repr_delta_compute().
+    bool is_keyframe;
+    uint8_t *data;
+    uint32_t data_len;
 
+    struct kv_repr_state_t *prev;
     struct kv_repr_state_t *next;
 };
 
+#define BUILD_GEOMETRY_FUNC(name) \
+    void name(struct keyboard_view_t *kv)
+typedef BUILD_GEOMETRY_FUNC(set_geometry_func_t);
+
+// Representations are indexed when the store is created but their contents,
+// and autosaves, are read the first time their states are accessed, see
+// kv_repr_load().
+enum kv_repr_source_t {
+    KV_REPR_SOURCE_STRING, // Pushed with its contents, always loaded
+    KV_REPR_SOURCE_GRESOURCE, // Built with func if the lookup fails
+    KV_REPR_SOURCE_FILE
+};
+
 struct kv_repr_t {
     bool is_internal;
     char *name;
+    struct kv_repr_store_t *store;
+
+    bool is_loaded;
+    enum kv_repr_source_t source;
+    set_geometry_func_t *func;
+    char *path; // GResource or file path
+    char *autosave_path;
+
     struct kv_repr_state_t *states;
     struct kv_repr_state_t *last_state;
+    struct kv_repr_state_t *curr_state;
+    size_t history_size;
+
+    // Last materialized state
+    struct kv_repr_state_t *materialized_state;
+    string_t materialized;
+    string_t scratch;
 
     struct kv_repr_t *next;
+    struct kv_repr_t *index_next;
 };
 
+#define KV_REPR_INDEX_INITIAL_SIZE 64
 struct kv_repr_store_t {
     mem_pool_t pool;
     struct kv_repr_t *reprs;
     struct kv_repr_t *last_repr;
     struct kv_repr_t *curr_repr;
-};
 
-#define BUILD_GEOMETRY_FUNC(name) \
-    void name(struct keyboard_view_t *kv)
-typedef BUILD_GEOMETRY_FUNC(set_geometry_func_t);
+    // Hash table from name to representation, collisions are chained with
+    // kv_repr_t.index_next. The size is a power of 2.
+    struct kv_repr_t **index;
+    uint32_t index_size;
+    uint32_t num_reprs;
+
+    size_t history_max_size;
+};
 
 // Simple default keyboard geometry.
 // NOTE: Keycodes are used as defined in the linux kernel. To translate them
@@ -391,66 +454,443 @@ BUILD_GEOMETRY_FUNC(vertical_extend_test_3)
     kv_end_geometry (&ctx);
 }
 
+// Geometries built from code. Parsing is much cheaper than building them, so
+// './pymk generate_builtin_geometries' serializes them into
+// data/repr/builtin/, which is bundled in the GResource. The functions are
+// only called if a serialized geometry is missing from the bundle.
+#define KV_BUILTIN_GEOMETRIES_RESOURCE_PATH "/com/github/santileortiz/iconoscope/data/repr/builtin/"
+struct kv_builtin_geometry_t {
+    char *name;
+    set_geometry_func_t *func;
+    bool is_debug;
+};
+
+struct kv_builtin_geometry_t kv_builtin_geometries[] = {
+    {"Simple", kv_build_default_geometry, false},
+
+    // Debug geometries, not shown in release builds.
+    {"multirow_test", multirow_test, true},
+    {"edge_resize_leave_original_pos_1", edge_resize_leave_original_pos_1, true},
+    {"edge_resize_leave_original_pos_2", edge_resize_leave_original_pos_2, true},
+    {"edge_resize_test_1", edge_resize_test_1, true},
+    {"edge_resize_test_2", edge_resize_test_2, true},
+    {"edge_resize_test_3", edge_resize_test_3, true},
+    {"adjust_left_edge_test", adjust_left_edge_test, true},
+    {"vertical_extend_test_1", vertical_extend_test_1, true},
+    {"vertical_extend_test_2", vertical_extend_test_2, true},
+    {"vertical_extend_test_3", vertical_extend_test_3, true}
+};
+
+void kv_repr_state_free (struct kv_repr_state_t *state)
+{
+    free (state->data);
+    free (state);
+}
+
 void kv_repr_store_destroy (struct kv_repr_store_t *store)
 {
+    // The saved state is allocated in the store's pool, the rest are in the
+    // heap.
+    for (struct kv_repr_t *curr_repr = store->reprs; curr_repr; curr_repr = curr_repr->next) {
+        struct kv_repr_state_t *curr_state = curr_repr->states != NULL ? curr_repr->states->next : NULL;
+        while (curr_state != NULL) {
+            struct kv_repr_state_t *next = curr_state->next;
+            kv_repr_state_free (curr_state);
+            curr_state = next;
+        }
+
+        str_free (&curr_repr->materialized);
+        str_free (&curr_repr->scratch);
+    }
+
+    free (store->index);
     mem_pool_destroy (&store->pool);
 }
 
-// NOTE: Only call this is _str_ is already allocated into _store_->pool
-void kv_repr_push_state_no_dup (struct kv_repr_store_t *store, struct kv_repr_t *repr, char *str)
+static inline
+uint8_t* kv_repr_delta_put_len (uint8_t *pos, uint32_t len)
+{
+    while (len >= 0x80) {
+        *pos++ = (len & 0x7F) | 0x80;
+        len >>= 7;
+    }
+    *pos++ = len;
+    return pos;
+}
+
+static inline
+uint8_t* kv_repr_delta_get_len (uint8_t *pos, uint32_t *len)
+{
+    *len = 0;
+    int shift = 0;
+    do {
+        *len |= (uint32_t)(*pos & 0x7F) << shift;
+        shift += 7;
+    } while (*pos++ & 0x80);
+    return pos;
+}
+
+// Edits to a representation are local, most of the time a few consecutive
+// lines change. A delta is the length of the prefix and suffix shared with the
+// previous state, encoded as varints, followed by the bytes that replace
+// what's between them.
+uint8_t* kv_repr_delta_compute (const char *prev, uint32_t prev_len,
+                                const char *str, uint32_t len, uint32_t *delta_len)
+{
+    uint32_t max_common = MIN (prev_len, len);
+
+    uint32_t prefix = 0;
+    while (prefix < max_common && prev[prefix] == str[prefix]) {
+        prefix++;
+    }
+
+    uint32_t suffix = 0;
+    while (suffix < max_common - prefix &&
+           prev[prev_len - suffix - 1] == str[len - suffix - 1]) {
+        suffix++;
+    }
+
+    uint32_t middle_len = len - prefix - suffix;
+    uint8_t *delta = malloc (2*5 + middle_len);
+    uint8_t *pos = kv_repr_delta_put_len (delta, prefix);
+    pos = kv_repr_delta_put_len (pos, suffix);
+    memcpy (pos, str + prefix, middle_len);
+
+    *delta_len = pos - delta + middle_len;
+    return delta;
+}
+
+// Applies _delta_ to the string in _src_ and stores the result in _dst_.
+void kv_repr_delta_apply (string_t *src, uint8_t *delta, uint32_t delta_len, string_t *dst)
+{
+    uint32_t prefix, suffix;
+    uint8_t *pos = kv_repr_delta_get_len (delta, &prefix);
+    pos = kv_repr_delta_get_len (pos, &suffix);
+    uint32_t middle_len = delta_len - (pos - delta);
+
+    uint32_t src_len = str_len (src);
+    strn_set (dst, str_data(src), prefix);
+    strn_cat_c (dst, (char*)pos, middle_len);
+    strn_cat_c (dst, str_data(src) + src_len - suffix, suffix);
+}
+
+// Returns the representation data for _state_, which must be part of _repr_'s
+// history, its length is str_len(&repr->materialized). The returned data is
+// valid until the next call.
+char* kv_repr_state_materialize (struct kv_repr_t *repr, struct kv_repr_state_t *state)
+{
+    if (repr->materialized_state == state) {
+        return str_data(&repr->materialized);
+    }
+
+    // Walk back until we find a keyframe, or a state that is already
+    // materialized.
+    struct kv_repr_state_t *start = state;
+    while (!start->is_keyframe && start != repr->materialized_state) {
+        start = start->prev;
+    }
+
+    if (start != repr->materialized_state) {
+        strn_set (&repr->materialized, (char*)start->data, start->data_len - 1);
+    }
+
+    for (struct kv_repr_state_t *curr_state = start; curr_state != state;) {
+        curr_state = curr_state->next;
+        if (curr_state->is_keyframe) {
+            strn_set (&repr->materialized, (char*)curr_state->data, curr_state->data_len - 1);
+
+        } else {
+            kv_repr_delta_apply (&repr->materialized, curr_state->data, curr_state->data_len,
+                                 &repr->scratch);
+            string_t tmp = repr->materialized;
+            repr->materialized = repr->scratch;
+            repr->scratch = tmp;
+        }
+    }
+
+    repr->materialized_state = state;
+    return str_data(&repr->materialized);
+}
+
+void kv_repr_load (struct kv_repr_t *repr);
+
+// If _len_ is not NULL it's set to the length of the returned data.
+char* kv_repr_get_saved (struct kv_repr_t *repr, uint32_t *len)
+{
+    kv_repr_load (repr);
+    if (len != NULL) {
+        *len = repr->states->data_len - 1;
+    }
+    return (char*)repr->states->data;
+}
+
+char* kv_repr_get_current (struct kv_repr_t *repr, uint32_t *len)
+{
+    kv_repr_load (repr);
+    char *data = kv_repr_state_materialize (repr, repr->curr_state);
+    if (len != NULL) {
+        *len = str_len (&repr->materialized);
+    }
+    return data;
+}
+
+// Representations that aren't loaded yet are unsaved if they have an autosave.
+#define repr_is_saved(repr) \
+    ((repr)->is_loaded ? (repr)->curr_state==(repr)->states : (repr)->autosave_path==NULL)
+
+bool kv_repr_undo (struct kv_repr_t *repr)
+{
+    kv_repr_load (repr);
+    if (repr->curr_state->prev == NULL) {
+        return false;
+    }
+
+    repr->curr_state = repr->curr_state->prev;
+    return true;
+}
+
+bool kv_repr_redo (struct kv_repr_t *repr)
+{
+    kv_repr_load (repr);
+    if (repr->curr_state->next == NULL) {
+        return false;
+    }
+
+    repr->curr_state = repr->curr_state->next;
+    return true;
+}
+
+void kv_repr_evict_states (struct kv_repr_t *repr, size_t max_size)
+{
+    // The saved state and the last one are never evicted.
+    while (repr->history_size > max_size &&
+           repr->states->next != NULL && repr->states->next != repr->last_state) {
+        struct kv_repr_state_t *evicted = repr->states->next;
+        struct kv_repr_state_t *next = evicted->next;
+
+        // The state after the evicted one may be a delta against it, replace
+        // it by a keyframe.
+        if (!next->is_keyframe) {
+            char *str = kv_repr_state_materialize (repr, next);
+            uint32_t len = str_len (&repr->materialized);
+            uint8_t *data = malloc (len + 1);
+            memcpy (data, str, len + 1);
+
+            repr->history_size += len + 1;
+            repr->history_size -= next->data_len;
+            free (next->data);
+            next->data = data;
+            next->data_len = len + 1;
+            next->is_keyframe = true;
+        }
+
+        repr->states->next = next;
+        next->prev = repr->states;
+        repr->history_size -= evicted->data_len;
+
+        if (repr->curr_state == evicted) {
+            repr->curr_state = repr->states;
+        }
+        if (repr->materialized_state == evicted) {
+            repr->materialized_state = NULL;
+        }
+        kv_repr_state_free (evicted);
+    }
+}
+
+void kv_repr_store_set_history_max_size (struct kv_repr_store_t *store, size_t max_size)
 {
-    struct kv_repr_state_t *state =
-        mem_pool_push_size (&store->pool, sizeof(struct kv_repr_state_t));
+    store->history_max_size = max_size;
+    for (struct kv_repr_t *curr_repr = store->reprs; curr_repr; curr_repr = curr_repr->next) {
+        kv_repr_evict_states (curr_repr, max_size);
+    }
+}
+
+// Pushes _str_, of length _len_, as a new state after the current one and
+// makes it current.
+void kv_repr_push_state (struct kv_repr_store_t *store, struct kv_repr_t *repr,
+                         const char *str, uint32_t len)
+{
+    kv_repr_load (repr);
+
+    if (repr->states == NULL) {
+        struct kv_repr_state_t *state = mem_pool_push_struct (&store->pool, struct kv_repr_state_t);
+        *state = ZERO_INIT(struct kv_repr_state_t);
+        state->is_keyframe = true;
+        state->data = (uint8_t*)pom_strndup (&store->pool, str, len);
+        state->data_len = len + 1;
+
+        repr->states = state;
+        repr->last_state = state;
+        repr->curr_state = state;
+        return;
+    }
+
+    // Discard states that could be redone.
+    while (repr->last_state != repr->curr_state) {
+        struct kv_repr_state_t *discarded = repr->last_state;
+        repr->last_state = discarded->prev;
+        repr->last_state->next = NULL;
+        repr->history_size -= discarded->data_len;
+
+        if (repr->materialized_state == discarded) {
+            repr->materialized_state = NULL;
+        }
+        kv_repr_state_free (discarded);
+    }
+
+    struct kv_repr_state_t *state = malloc (sizeof(struct kv_repr_state_t));
     *state = ZERO_INIT(struct kv_repr_state_t);
-    state->repr = str;
 
-    if (repr->last_state != NULL) {
-        repr->last_state->next = state;
+    int keyframe_distance = 0;
+    struct kv_repr_state_t *curr_state = repr->last_state;
+    while (!curr_state->is_keyframe) {
+        keyframe_distance++;
+        curr_state = curr_state->prev;
+    }
+
+    if (keyframe_distance + 1 >= KV_REPR_KEYFRAME_INTERVAL) {
+        state->is_keyframe = true;
+        state->data = malloc (len + 1);
+        memcpy (state->data, str, len);
+        state->data[len] = '\0';
+        state->data_len = len + 1;
+
     } else {
-        repr->states = state;
+        char *prev = kv_repr_state_materialize (repr, repr->last_state);
+        state->data = kv_repr_delta_compute (prev, str_len(&repr->materialized), str, len,
+                                             &state->data_len);
     }
+
+    state->prev = repr->last_state;
+    repr->last_state->next = state;
     repr->last_state = state;
+    repr->curr_state = state;
+    repr->history_size += state->data_len;
+
+    kv_repr_evict_states (repr, store->history_max_size);
 }
 
-void kv_repr_push_state (struct kv_repr_store_t *store, struct kv_repr_t *repr, const char *str)
+// Reads the saved state of _repr_ from its source, and its autosave if it has
+// one.
+void kv_repr_load (struct kv_repr_t *repr)
 {
-    char *dup_str = pom_strdup (&store->pool, str);
-    kv_repr_push_state_no_dup (store, repr, dup_str);
+    if (repr->is_loaded) {
+        return;
+    }
+    repr->is_loaded = true;
+
+    struct kv_repr_store_t *store = repr->store;
+    switch (repr->source) {
+        case KV_REPR_SOURCE_GRESOURCE:
+            {
+                GError *error = NULL;
+                GBytes *bytes = g_resources_lookup_data (repr->path, G_RESOURCE_LOOKUP_FLAGS_NONE, &error);
+                if (bytes != NULL) {
+                    gsize bytes_size;
+                    const char *data = g_bytes_get_data (bytes, &bytes_size);
+                    kv_repr_push_state (store, repr, data, bytes_size);
+                    g_bytes_unref (bytes);
+
+                } else if (repr->func != NULL) {
+                    g_error_free (error);
+
+                    struct keyboard_view_t *kv = kv_new ();
+                    repr->func (kv);
+
+                    mem_pool_t pool = {0};
+                    char *str = kv_to_string (&pool, kv);
+                    kv_repr_push_state (store, repr, str, strlen (str));
+                    mem_pool_destroy (&pool);
+                    keyboard_view_destroy (kv);
+
+                } else {
+                    printf ("Error loading representation %s: %s\n", repr->path, error->message);
+                    g_error_free (error);
+                }
+            } break;
+
+        case KV_REPR_SOURCE_FILE:
+            {
+                uint64_t len;
+                char *str = full_file_read (NULL, repr->path, &len);
+                if (str != NULL) {
+                    kv_repr_push_state (store, repr, str, len);
+                    free (str);
+                } else {
+                    printf ("File representation load failed: %s\n", repr->path);
+                }
+            } break;
+
+        case KV_REPR_SOURCE_STRING:
+            break;
+    }
+
+    // A representation that failed to load is empty.
+    if (repr->states == NULL) {
+        kv_repr_push_state (store, repr, "", 0);
+    }
+
+    if (repr->autosave_path != NULL) {
+        uint64_t len;
+        char *str = full_file_read (NULL, repr->autosave_path, &len);
+        if (str != NULL) {
+            kv_repr_push_state (store, repr, str, len);
+            free (str);
+        }
+    }
 }
 
-void kv_repr_store_push_func (struct kv_repr_store_t *store, char *name, set_geometry_func_t *func)
+// FNV-1a
+static inline
+uint32_t kv_str_hash (const char *str)
 {
-    struct kv_repr_t *new_repr = mem_pool_push_size (&store->pool, sizeof(struct kv_repr_t));
-    *new_repr = ZERO_INIT (struct kv_repr_t);
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash ^= (uint8_t)*str;
+        hash *= 16777619u;
+        str++;
+    }
+    return hash;
+}
 
-    new_repr->is_internal = true;
-    new_repr->name = pom_strdup (&store->pool, name);
+struct kv_repr_t* kv_repr_get_by_name (struct kv_repr_store_t *store, const char *name)
+{
+    if (store->index_size == 0) {
+        return NULL;
+    }
 
-    struct keyboard_view_t *kv = kv_new ();
+    struct kv_repr_t *curr_repr = store->index[kv_str_hash (name) & (store->index_size - 1)];
+    while (curr_repr != NULL) {
+        if (strcmp (name, curr_repr->name) == 0) {
+            break;
+        }
+        curr_repr = curr_repr->index_next;
+    }
+    return curr_repr;
+}
 
-    func (kv);
-    char *str = kv_to_string (&store->pool, kv);
-    kv_repr_push_state_no_dup (store, new_repr, str);
-    keyboard_view_destroy (kv);
+void kv_repr_index_insert (struct kv_repr_t **index, uint32_t index_size, struct kv_repr_t *repr)
+{
+    struct kv_repr_t **pos = &index[kv_str_hash (repr->name) & (index_size - 1)];
+    repr->index_next = NULL;
 
-    if (store->last_repr != NULL) {
-        store->last_repr->next = new_repr;
-    } else {
-        store->reprs = new_repr;
+    // If names are repeated the first representation is the one found by
+    // name, keep it first in the chain.
+    while (*pos != NULL) {
+        pos = &(*pos)->index_next;
     }
-    store->last_repr = new_repr;
+    *pos = repr;
 }
 
-void kv_push_representation_str (struct kv_repr_store_t *store,
-                                 const char *name, const char *str, bool is_internal)
+struct kv_repr_t* kv_repr_store_push_new (struct kv_repr_store_t *store, const char *name,
+                                          bool is_internal)
 {
-    struct kv_repr_t *new_repr = mem_pool_push_size (&store->pool, sizeof(struct kv_repr_t));
+    struct kv_repr_t *new_repr = mem_pool_push_struct (&store->pool, struct kv_repr_t);
     *new_repr = ZERO_INIT (struct kv_repr_t);
     new_repr->is_internal = is_internal;
-
-    // TODO: Check that parsing of _repr_ will succeed.
-    kv_repr_push_state (store, new_repr, str);
     new_repr->name = pom_strdup (&store->pool, name);
+    new_repr->store = store;
 
     if (store->last_repr != NULL) {
         store->last_repr->next = new_repr;
@@ -458,6 +898,48 @@ void kv_push_representation_str (struct kv_repr_store_t *store,
         store->reprs = new_repr;
     }
     store->last_repr = new_repr;
+
+    // Keep the load factor at most 1.
+    if (store->num_reprs + 1 > store->index_size) {
+        uint32_t new_size = MAX (store->index_size*2, KV_REPR_INDEX_INITIAL_SIZE);
+        struct kv_repr_t **new_index = calloc (new_size, sizeof(struct kv_repr_t*));
+
+        for (struct kv_repr_t *curr_repr = store->reprs; curr_repr != new_repr; curr_repr = curr_repr->next) {
+            kv_repr_index_insert (new_index, new_size, curr_repr);
+        }
+
+        free (store->index);
+        store->index = new_index;
+        store->index_size = new_size;
+    }
+    kv_repr_index_insert (store->index, store->index_size, new_repr);
+    store->num_reprs++;
+
+    return new_repr;
+}
+
+void kv_repr_store_push_builtin (struct kv_repr_store_t *store, struct kv_builtin_geometry_t *builtin)
+{
+    struct kv_repr_t *new_repr = kv_repr_store_push_new (store, builtin->name, true);
+    new_repr->source = KV_REPR_SOURCE_GRESOURCE;
+    new_repr->func = builtin->func;
+
+    string_t path = str_new (KV_BUILTIN_GEOMETRIES_RESOURCE_PATH);
+    str_cat_c (&path, builtin->name);
+    str_cat_c (&path, ".lrep");
+    new_repr->path = pom_strdup (&store->pool, str_data(&path));
+    str_free (&path);
+}
+
+void kv_push_representation_str (struct kv_repr_store_t *store,
+                                 const char *name, const char *str, bool is_internal)
+{
+    struct kv_repr_t *new_repr = kv_repr_store_push_new (store, name, is_internal);
+    new_repr->source = KV_REPR_SOURCE_STRING;
+    new_repr->is_loaded = true;
+
+    // TODO: Check that parsing of _repr_ will succeed.
+    kv_repr_push_state (store, new_repr, str, strlen (str));
 }
 
 // NOTE: path is expected to be absolute.
@@ -469,32 +951,17 @@ void kv_repr_store_push_file (struct kv_repr_store_t *store, char *path)
 
     if (!g_str_has_suffix(fname, ".autosave.lrep") && g_str_has_suffix(fname, ".lrep")) {
         char *name = remove_extension (&pool_l, fname);
-        char *str = full_file_read (&pool_l, path, NULL);
-        kv_push_representation_str (store, name, str, false);
+        struct kv_repr_t *new_repr = kv_repr_store_push_new (store, name, false);
+        new_repr->source = KV_REPR_SOURCE_FILE;
+        new_repr->path = pom_strdup (&store->pool, path);
 
     } else {
-        // The push failed, restore pool as it whas when we started.
         printf ("File representation load failed: %s\n", path);
     }
 
     mem_pool_destroy (&pool_l);
 }
 
-struct kv_repr_t* kv_repr_get_by_name (struct kv_repr_store_t *store, const char *name)
-{
-    struct kv_repr_t *curr_repr = store->reprs;
-    while (curr_repr != NULL) {
-        if (strcmp (name, curr_repr->name) == 0) {
-            break;
-        }
-        curr_repr = curr_repr->next;
-    }
-    return curr_repr;
-}
-
-#define kv_repr_store_push_func_simple(store,func_name) \
-    kv_repr_store_push_func(store, #func_name, func_name);
-
 struct kv_repr_store_t* kv_repr_store_new (char *repr_path)
 {
     struct kv_repr_store_t *store;
@@ -504,10 +971,15 @@ struct kv_repr_store_t* kv_repr_store_new (char *repr_path)
         *store = ZERO_INIT (struct kv_repr_store_t);
         store->pool = bootstrap;
     }
+    store->history_max_size = KV_REPR_HISTORY_MAX_SIZE;
 
-    kv_repr_store_push_func (store, "Simple", kv_build_default_geometry);
+    for (int i=0; i<ARRAY_SIZE(kv_builtin_geometries); i++) {
+        if (!kv_builtin_geometries[i].is_debug) {
+            kv_repr_store_push_builtin (store, &kv_builtin_geometries[i]);
+        }
+    }
 
-    // Load internal representations from GResource
+    // Index internal representations from GResource
     {
         GResource *gresource = gresource_get_resource ();
         string_t path = str_new ("/com/github/santileortiz/iconoscope/data/repr/");
@@ -517,100 +989,85 @@ struct kv_repr_store_t* kv_repr_store_new (char *repr_path)
                                                        str_data(&path),
                                                        G_RESOURCE_LOOKUP_FLAGS_NONE,
                                                        &error);
-        while (*fnames) {
-            if (!g_str_has_suffix(*fnames, ".autosave.lrep") && g_str_has_suffix(*fnames, ".lrep")) {
-
-                str_put_c (&path, path_len, *fnames);
-                GBytes *bytes = g_resources_lookup_data (str_data(&path), G_RESOURCE_LOOKUP_FLAGS_NONE, &error);
-                gsize bytes_size;
-                const char *str = g_bytes_get_data (bytes, &bytes_size);
-                char *name = remove_extension (NULL, *fnames);
-
-                kv_push_representation_str (store, name, str, true);
+        for (char **fname = fnames; fname != NULL && *fname; fname++) {
+            if (!g_str_has_suffix(*fname, ".autosave.lrep") && g_str_has_suffix(*fname, ".lrep")) {
+                str_put_c (&path, path_len, *fname);
+                char *name = remove_extension (NULL, *fname);
+
+                struct kv_repr_t *new_repr = kv_repr_store_push_new (store, name, true);
+                new_repr->source = KV_REPR_SOURCE_GRESOURCE;
+                new_repr->path = pom_strdup (&store->pool, str_data(&path));
                 free (name);
             }
-            fnames++;
         }
 
+        g_strfreev (fnames);
         str_free (&path);
     }
 
 #ifndef NDEBUG
     // Push debug geometries
-    kv_repr_store_push_func_simple (store, multirow_test);
-    kv_repr_store_push_func_simple (store, edge_resize_leave_original_pos_1);
-    kv_repr_store_push_func_simple (store, edge_resize_leave_original_pos_2);
-    kv_repr_store_push_func_simple (store, edge_resize_test_1);
-    kv_repr_store_push_func_simple (store, edge_resize_test_2);
-    kv_repr_store_push_func_simple (store, edge_resize_test_3);
-    kv_repr_store_push_func_simple (store, adjust_left_edge_test);
-    kv_repr_store_push_func_simple (store, vertical_extend_test_1);
-    kv_repr_store_push_func_simple (store, vertical_extend_test_2);
-    kv_repr_store_push_func_simple (store, vertical_extend_test_3);
+    for (int i=0; i<ARRAY_SIZE(kv_builtin_geometries); i++) {
+        if (kv_builtin_geometries[i].is_debug) {
+            kv_repr_store_push_builtin (store, &kv_builtin_geometries[i]);
+        }
+    }
 #endif
 
+    // Index saved representations and autosaves in a single pass over the
+    // directory. Autosaves are matched once all representations are known,
+    // they can belong to internal ones too.
     if (repr_path != NULL) {
         string_t repr_path_str = str_new (repr_path);
         size_t repr_path_len = str_len (&repr_path_str);
 
-        // Load all saved representations (ignore autosave files)
-        {
-            DIR *d = opendir (str_data(&repr_path_str));
-            if (d != NULL) {
-                struct dirent *entry_info;
-                while (read_dir (d, &entry_info)) {
-                    if (entry_info->d_name[0] != '.' &&
-                        !g_str_has_suffix (entry_info->d_name, ".autosave.lrep") &&
-                        g_str_has_suffix (entry_info->d_name, ".lrep")) {
-
-                        str_put_c (&repr_path_str, repr_path_len, entry_info->d_name);
-                        kv_repr_store_push_file (store, str_data(&repr_path_str));
-                    }
+        mem_pool_t pool_l = {0};
+        struct autosave_fname_t {
+            char *fname;
+            struct autosave_fname_t *next;
+        } *autosaves = NULL;
+
+        DIR *d = opendir (str_data(&repr_path_str));
+        if (d != NULL) {
+            struct dirent *entry_info;
+            while (read_dir (d, &entry_info)) {
+                if (entry_info->d_name[0] == '.') {
+                    continue;
                 }
 
-                closedir (d);
+                if (g_str_has_suffix (entry_info->d_name, ".autosave.lrep")) {
+                    struct autosave_fname_t *autosave = mem_pool_push_struct (&pool_l, struct autosave_fname_t);
+                    autosave->fname = pom_strdup (&pool_l, entry_info->d_name);
+                    autosave->next = autosaves;
+                    autosaves = autosave;
 
-            } else {
-                printf ("Error opening %s: %s\n", str_data(&repr_path_str), strerror(errno));
+                } else if (g_str_has_suffix (entry_info->d_name, ".lrep")) {
+                    str_put_c (&repr_path_str, repr_path_len, entry_info->d_name);
+                    kv_repr_store_push_file (store, str_data(&repr_path_str));
+                }
             }
+
+            closedir (d);
+
+        } else {
+            printf ("Error opening %s: %s\n", str_data(&repr_path_str), strerror(errno));
         }
 
-        // Push autosaves as a state into the corresponding representation
-        // FIXME: This is O(n^2) @performance
-        {
-            str_data(&repr_path_str)[repr_path_len] = '\0';
-
-            DIR *d = opendir (str_data(&repr_path_str));
-            if (d != NULL) {
-                struct dirent *entry_info;
-                while (read_dir (d, &entry_info)) {
-                    if (entry_info->d_name[0] != '.' &&
-                        g_str_has_suffix (entry_info->d_name, ".autosave.lrep")) {
-
-                        char *name = remove_multiple_extensions (NULL, entry_info->d_name, 2);
-                        struct kv_repr_t *repr = kv_repr_get_by_name (store, name);
-
-                        if (repr != NULL) {
-                            str_put_c (&repr_path_str, repr_path_len, entry_info->d_name);
-                            char *str = full_file_read (&store->pool, str_data(&repr_path_str), NULL);
-                            kv_repr_push_state_no_dup (store, repr, str);
-
-                        } else {
-                            // TODO: Should we remove this dangling autosave?
-                            printf ("Autosave for non existent representation \"%s\".\n", name);
-                        }
-
-                        free (name);
-                    }
-                }
+        for (struct autosave_fname_t *autosave = autosaves; autosave; autosave = autosave->next) {
+            char *name = remove_multiple_extensions (&pool_l, autosave->fname, 2);
+            struct kv_repr_t *repr = kv_repr_get_by_name (store, name);
 
-                closedir (d);
+            if (repr != NULL) {
+                str_put_c (&repr_path_str, repr_path_len, autosave->fname);
+                repr->autosave_path = pom_strdup (&store->pool, str_data(&repr_path_str));
 
             } else {
-                printf ("Error opening %s: %s\n", str_data(&repr_path_str), strerror(errno));
+                // TODO: Should we remove this dangling autosave?
+                printf ("Autosave for non existent representation \"%s\".\n", name);
             }
         }
 
+        mem_pool_destroy (&pool_l);
         str_free (&repr_path_str);
     }
 
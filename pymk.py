@@ -22,14 +22,14 @@ def default():
 
 def keyboard_layout_editor ():
     ex ('glib-compile-resources data/gresource.xml --internal --generate-source --target=gresource.c')
-    ex ('gcc {FLAGS} -o bin/keyboard-layout-editor keyboard_layout_editor.c -I/usr/include/libxml2 -lxml2 {GTK3_FLAGS} -lm -lxkbcommon')
+    ex ('gcc {FLAGS} -o bin/keyboard-layout-editor keyboard_layout_editor.c -I/usr/include/libxml2 -lxml2 {GTK3_FLAGS} -lm -lxkbcommon -lpthread')
 
 def xkbcommon_view ():
     # The test uses the keyboard layout editor to install the layout so we
     # depend on it. We build it first.
     keyboard_layout_editor ()
 
-    ex ('gcc {FLAGS} -o bin/xkbcommon-view libxkbcommon_view.c -I/usr/include/libxml2 -lxml2 {GTK3_FLAGS} -lm -lxkbcommon')
+    ex ('gcc {FLAGS} -o bin/xkbcommon-view libxkbcommon_view.c -I/usr/include/libxml2 -lxml2 {GTK3_FLAGS} -lm -lxkbcommon -lpthread')
 
 def xkb_keymap_getter():
     ex ('gcc {FLAGS} -o bin/xkb_keymap_getter xkb_keymap_getter.c -lm -lxkbcommon')
@@ -51,6 +51,59 @@ def im_gtk2 ():
 def xkb_tests ():
     ex ('gcc {FLAGS} -o bin/xkb_tests tests/xkb_tests.c -I. -lm -lrt -lxkbcommon')
 
+def kv_tests ():
+    """
+    Builds and runs bin/kv_tests, tests of the keyboard view that don't need a
+    display.
+    """
+    ex ('glib-compile-resources data/gresource.xml --internal --generate-source --target=gresource.c')
+    ex ('gcc {FLAGS} -o bin/kv_tests tests/kv_tests.c -I. {GTK3_FLAGS} -lm -lxkbcommon -lpthread')
+    ex ('./bin/kv_tests')
+
+def bench ():
+    """
+    Builds the benchmark driver bin/kle_bench. Benchmark numbers only make
+    sense for optimized builds, use './pymk bench -M release'. Results can be
+    written to a JSON file with --output and compared against a previous run
+    with --compare.
+    """
+    ex ('glib-compile-resources data/gresource.xml --internal --generate-source --target=gresource.c')
+    ex ('gcc {FLAGS} -o bin/kle_bench tests/kle_bench.c -I. {GTK3_FLAGS} -lm -lxkbcommon -lpthread')
+
+def keyboard_view_renderer ():
+    """
+    Builds bin/keyboard-view-renderer, renders keyboard views for all
+    combinations of geometries, layouts and modifier states into PNG or SVG
+    files without a display. Run it with no arguments to render the geometries
+    in data/repr with the layouts in tests/XKeyboardConfig.
+    """
+    ex ('glib-compile-resources data/gresource.xml --internal --generate-source --target=gresource.c')
+    ex ('gcc {FLAGS} -o bin/keyboard-view-renderer keyboard_view_renderer.c -I. {GTK3_FLAGS} -lm -lxkbcommon -lpthread')
+
+def generate_builtin_geometries ():
+    """
+    Serializes the geometries built from code in keyboard_view_repr_store.c
+    into data/repr/builtin/, these files are bundled in the GResource so they
+    don't need to be built at startup. Run it after changing one of them, the
+    kv_tests target fails if the bundled files are out of date. When adding a new
+    one, add it to kv_builtin_geometries and its file to data/gresource.xml.
+    """
+    global g_dry_run
+    if g_dry_run:
+        return
+
+    # Compiling the GResource needs all files it lists to exist, new ones are
+    # created empty and then written by the generator.
+    os.makedirs ('data/repr/builtin', exist_ok=True)
+    gresource_xml = open ('data/gresource.xml').read ()
+    for fname in re.findall (r'<file>(data/repr/builtin/[^<]+)</file>', gresource_xml):
+        if not path_exists (fname):
+            open (fname, 'a').close ()
+
+    ex ('glib-compile-resources data/gresource.xml --internal --generate-source --target=gresource.c')
+    ex ('gcc {FLAGS} -o bin/generate-builtin-geometries generate_builtin_geometries.c -I. {GTK3_FLAGS} -lm -lxkbcommon -lpthread')
+    ex ('./bin/generate-builtin-geometries data/repr/builtin/')
+
 def generate_base_layout_tests ():
     """
     This target flattens out all available layouts from the installed
@@ -0,0 +1,487 @@
+/*
+ * Copiright (C) 2019 Santiago León O.
+ */
+
+#define _GNU_SOURCE // Used to enable strcasestr()
+#include "common.h"
+#include "bit_operations.c"
+#include "status.c"
+#include "scanner.c"
+#include "cli_parser.c"
+#include "binary_tree.c"
+
+#include <xkbcommon/xkbcommon.h>
+#include <linux/input-event-codes.h>
+#include "xkb_keycode_names.h"
+#include "kernel_keycode_names.h"
+#include "keysym_names.h"
+
+#include <gtk/gtk.h>
+#include "gresource.c"
+#include "gtk_utils.c"
+#include "fk_popover.c"
+#include "fk_searchable_list.c"
+
+#include "keyboard_view.h"
+#include "keyboard_view_builder.c"
+#include "keyboard_view_as_string.c"
+#include "keyboard_view_repr_store.c"
+#include "keyboard_view.c"
+
+#include "keyboard_layout.c"
+#include "xkb_file_backend.c"
+#include "synthetic_keymap.c"
+
+// Benchmark driver for the performance critical paths of the editor. Each
+// benchmark processes all of its inputs once per sample, we report statistics
+// over the time taken by samples. Results can be written to a JSON file and
+// compared against the one of a previous run to detect regressions.
+//
+// Usage:
+//   ./bin/kle_bench [-n SAMPLES] [--output FILE] [--compare FILE] [--threshold PERCENT]
+//                   [--seed SEED]
+
+#define BENCH_DEFAULT_SAMPLES 20
+#define BENCH_DEFAULT_THRESHOLD 10
+
+// Scales of the synthetic keymaps used to see how the xkb backend behaves as
+// keymaps grow, see synthetic_keymap_params_scaled().
+#define BENCH_SYNTHETIC_SCALES {0.125, 0.25, 0.5, 1.0}
+
+// Layout used to compute labels in the render benchmark.
+#define BENCH_RENDER_KEYMAP "tests/XKeyboardConfig/us.xkb"
+
+struct bench_input_t {
+    char *fname;
+    char *data;
+    uint64_t size;
+
+    // Precomputed state so benchmarks only measure what they are meant to
+    // measure. Not all of them are set for all inputs.
+    struct keyboard_layout_t keymap;
+    struct keyboard_view_t *kv;
+    cairo_surface_t *surface;
+
+    struct bench_input_t *next;
+};
+
+#define BENCH_FUNC(name) void name(struct bench_input_t *input)
+typedef BENCH_FUNC(bench_func_t);
+
+struct bench_result_t {
+    char *name;
+    int num_inputs;
+    uint64_t bytes;
+
+    int num_samples;
+    double *samples_ms;
+
+    double min_ms;
+    double median_ms;
+    double p99_ms;
+    double mb_per_s;
+
+    struct bench_result_t *next;
+};
+
+struct bench_t {
+    mem_pool_t pool;
+    int num_samples;
+
+    struct bench_result_t *results;
+    struct bench_result_t *last_result;
+};
+
+templ_sort (bench_sort_samples, double, *a < *b)
+
+struct collect_inputs_clsr_t {
+    mem_pool_t *pool;
+    char *extension;
+
+    int num_inputs;
+    struct bench_input_t *inputs;
+};
+
+ITERATE_DIR_CB(collect_inputs)
+{
+    struct collect_inputs_clsr_t *clsr = (struct collect_inputs_clsr_t*)data;
+
+    char *extension = get_extension (fname);
+    if (!is_dir && extension != NULL && strcmp (extension, clsr->extension) == 0) {
+        struct bench_input_t *new_input = mem_pool_push_struct (clsr->pool, struct bench_input_t);
+        *new_input = ZERO_INIT (struct bench_input_t);
+        new_input->fname = pom_strdup (clsr->pool, fname);
+        new_input->data = full_file_read (clsr->pool, fname, &new_input->size);
+
+        new_input->next = clsr->inputs;
+        clsr->inputs = new_input;
+        clsr->num_inputs++;
+    }
+}
+
+templ_sort_ll (bench_input_sort, struct bench_input_t, strcmp (a->fname, b->fname) < 0)
+
+// Returns all files with the given extension inside path, sorted by name so
+// runs are comparable.
+struct bench_input_t* bench_load_inputs (mem_pool_t *pool, char *path, char *extension)
+{
+    struct collect_inputs_clsr_t clsr = {0};
+    clsr.pool = pool;
+    clsr.extension = extension;
+
+    if (path_exists (path)) {
+        iterate_dir (path, collect_inputs, &clsr);
+    }
+
+    bench_input_sort (&clsr.inputs, clsr.num_inputs);
+    return clsr.inputs;
+}
+
+void bench_run (struct bench_t *bench, char *name, struct bench_input_t *inputs, bench_func_t *func)
+{
+    struct bench_result_t *result = mem_pool_push_struct (&bench->pool, struct bench_result_t);
+    *result = ZERO_INIT (struct bench_result_t);
+    result->name = name;
+    result->num_samples = bench->num_samples;
+    result->samples_ms = mem_pool_push_array (&bench->pool, bench->num_samples, double);
+
+    for (struct bench_input_t *curr_input = inputs; curr_input; curr_input = curr_input->next) {
+        result->num_inputs++;
+        result->bytes += curr_input->size;
+    }
+
+    // Warm up caches and lazily initialized state, this one isn't measured.
+    for (struct bench_input_t *curr_input = inputs; curr_input; curr_input = curr_input->next) {
+        func (curr_input);
+    }
+
+    for (int i=0; i<bench->num_samples; i++) {
+        double start = get_wall_time_ms ();
+        for (struct bench_input_t *curr_input = inputs; curr_input; curr_input = curr_input->next) {
+            func (curr_input);
+        }
+        result->samples_ms[i] = get_wall_time_ms () - start;
+    }
+
+    bench_sort_samples (result->samples_ms, result->num_samples);
+    result->min_ms = result->samples_ms[0];
+    result->median_ms = result->samples_ms[result->num_samples/2];
+    result->p99_ms = result->samples_ms[(int)ceil(0.99*result->num_samples) - 1];
+    if (result->median_ms > 0) {
+        result->mb_per_s = (result->bytes/1e6)/(result->median_ms/1000);
+    }
+
+    printf ("%-24s %5d inputs %10.3f MB  min %9.3f ms  median %9.3f ms  p99 %9.3f ms  %8.2f MB/s\n",
+            result->name, result->num_inputs, result->bytes/1e6,
+            result->min_ms, result->median_ms, result->p99_ms, result->mb_per_s);
+
+    if (bench->results == NULL) {
+        bench->results = result;
+    } else {
+        bench->last_result->next = result;
+    }
+    bench->last_result = result;
+}
+
+BENCH_FUNC(bench_xkb_parse)
+{
+    struct keyboard_layout_t keymap = {0};
+    xkb_file_parse (input->data, &keymap);
+    keyboard_layout_destroy (&keymap);
+}
+
+BENCH_FUNC(bench_xkb_write)
+{
+    string_t xkb_str = {0};
+    struct status_t status = {0};
+    xkb_file_write (&input->keymap, &xkb_str, &status);
+    str_free (&xkb_str);
+}
+
+BENCH_FUNC(bench_xkb_round_trip)
+{
+    struct keyboard_layout_t keymap = {0};
+    xkb_file_parse (input->data, &keymap);
+
+    string_t xkb_str = {0};
+    struct status_t status = {0};
+    xkb_file_write (&keymap, &xkb_str, &status);
+
+    struct keyboard_layout_t written_keymap = {0};
+    xkb_file_parse (str_data(&xkb_str), &written_keymap);
+
+    keyboard_layout_destroy (&written_keymap);
+    str_free (&xkb_str);
+    keyboard_layout_destroy (&keymap);
+}
+
+BENCH_FUNC(bench_kv_set_from_string)
+{
+    kv_set_from_string (input->kv, input->data);
+}
+
+BENCH_FUNC(bench_kv_to_string)
+{
+    mem_pool_t pool = {0};
+    kv_to_string (&pool, input->kv);
+    mem_pool_destroy (&pool);
+}
+
+BENCH_FUNC(bench_kv_render)
+{
+    cairo_t *cr = cairo_create (input->surface);
+    keyboard_view_render (NULL, cr, input->kv);
+    cairo_destroy (cr);
+}
+
+// Removes inputs that our parser fails to parse, the rest get their keymap
+// set.
+struct bench_input_t* bench_filter_parseable (struct bench_input_t *inputs)
+{
+    struct bench_input_t *res = NULL, **next_ptr = &res;
+    for (struct bench_input_t *curr_input = inputs; curr_input; curr_input = curr_input->next) {
+        if (xkb_file_parse (curr_input->data, &curr_input->keymap)) {
+            *next_ptr = curr_input;
+            next_ptr = &curr_input->next;
+        } else {
+            keyboard_layout_destroy (&curr_input->keymap);
+        }
+    }
+    *next_ptr = NULL;
+
+    return res;
+}
+
+void bench_write_json (struct bench_t *bench, char *path)
+{
+    string_t json = {0};
+    str_cat_c (&json, "{\n  \"benchmarks\": [\n");
+    for (struct bench_result_t *curr_result = bench->results; curr_result; curr_result = curr_result->next) {
+        str_cat_printf (&json,
+                        "    {\"name\": \"%s\", \"inputs\": %d, \"bytes\": %"PRIu64", \"samples\": %d, "
+                        "\"min_ms\": %f, \"median_ms\": %f, \"p99_ms\": %f, \"mb_per_s\": %f}%s\n",
+                        curr_result->name, curr_result->num_inputs, curr_result->bytes, curr_result->num_samples,
+                        curr_result->min_ms, curr_result->median_ms, curr_result->p99_ms, curr_result->mb_per_s,
+                        curr_result->next != NULL ? "," : "");
+    }
+    str_cat_c (&json, "  ]\n}\n");
+
+    if (full_file_write (str_data(&json), str_len(&json), path)) {
+        printf ("Could not write results to '%s'.\n", path);
+    } else {
+        printf ("Wrote results to '%s'.\n", path);
+    }
+    str_free (&json);
+}
+
+// Looks up the value of field in the object of the benchmark called name
+// inside a JSON file written by bench_write_json(). This isn't a JSON parser,
+// it only understands the format we write.
+bool bench_json_get_field (char *json, char *name, char *field, double *value)
+{
+    string_t key = {0};
+    str_set_printf (&key, "\"name\": \"%s\",", name);
+    char *obj = strstr (json, str_data(&key));
+
+    bool found = false;
+    if (obj != NULL) {
+        char *obj_end = strchr (obj, '}');
+
+        str_set_printf (&key, "\"%s\": ", field);
+        char *pos = strstr (obj, str_data(&key));
+        if (pos != NULL && (obj_end == NULL || pos < obj_end)) {
+            *value = strtod (pos + str_len(&key), NULL);
+            found = true;
+        }
+    }
+
+    str_free (&key);
+    return found;
+}
+
+// Compares the median of each benchmark against the one in a previous run.
+// Returns the number of benchmarks that got slower by more than threshold
+// percent.
+int bench_compare (struct bench_t *bench, char *path, double threshold)
+{
+    mem_pool_t pool = {0};
+    char *json = full_file_read (&pool, path, NULL);
+    if (json == NULL) {
+        printf ("Could not read previous results from '%s'.\n", path);
+        mem_pool_destroy (&pool);
+        return 0;
+    }
+
+    int num_regressions = 0;
+    printf ("\nComparison against '%s' (median):\n", path);
+    for (struct bench_result_t *curr_result = bench->results; curr_result; curr_result = curr_result->next) {
+        double prev_median_ms;
+        if (!bench_json_get_field (json, curr_result->name, "median_ms", &prev_median_ms)) {
+            printf ("  %-24s %9.3f ms  (new)\n", curr_result->name, curr_result->median_ms);
+            continue;
+        }
+
+        double change = 0;
+        if (prev_median_ms > 0) {
+            change = 100*(curr_result->median_ms - prev_median_ms)/prev_median_ms;
+        }
+
+        printf ("  %-24s %9.3f ms -> %9.3f ms  %+7.1f%%", curr_result->name,
+                prev_median_ms, curr_result->median_ms, change);
+        if (change > threshold) {
+            printf (" " ECMA_RED("REGRESSION"));
+            num_regressions++;
+        }
+        printf ("\n");
+    }
+
+    mem_pool_destroy (&pool);
+    return num_regressions;
+}
+
+int main (int argc, char **argv)
+{
+    init_kernel_keycode_names ();
+    init_xkb_keycode_names ();
+
+    struct bench_t bench = {0};
+    bench.num_samples = BENCH_DEFAULT_SAMPLES;
+
+    char *num_samples_str = get_cli_arg_opt ("-n", argv, argc);
+    if (num_samples_str != NULL) {
+        bench.num_samples = atoi (num_samples_str);
+        if (bench.num_samples < 1) {
+            printf ("Invalid number of samples: %s.\n", num_samples_str);
+            return 1;
+        }
+    }
+
+    double threshold = BENCH_DEFAULT_THRESHOLD;
+    char *threshold_str = get_cli_arg_opt ("--threshold", argv, argc);
+    if (threshold_str != NULL) {
+        threshold = strtod (threshold_str, NULL);
+    }
+
+    unsigned int seed = 0;
+    char *seed_str = get_cli_arg_opt ("--seed", argv, argc);
+    if (seed_str != NULL) {
+        seed = strtoul (seed_str, NULL, 10);
+    }
+
+    char *output_path = get_cli_arg_opt ("--output", argv, argc);
+    char *compare_path = get_cli_arg_opt ("--compare", argv, argc);
+
+#ifndef NDEBUG
+    printf (ECMA_YELLOW("WARNING:") " benchmarking a debug build, use './pymk bench -M release'.\n\n");
+#endif
+
+    // Layouts
+    {
+        struct bench_input_t *xkb_inputs = bench_load_inputs (&bench.pool, "./tests", "xkb");
+        xkb_inputs = bench_filter_parseable (xkb_inputs);
+
+        bench_run (&bench, "xkb_parse", xkb_inputs, bench_xkb_parse);
+        bench_run (&bench, "xkb_write", xkb_inputs, bench_xkb_write);
+        bench_run (&bench, "xkb_round_trip", xkb_inputs, bench_xkb_round_trip);
+
+        for (struct bench_input_t *curr_input = xkb_inputs; curr_input; curr_input = curr_input->next) {
+            keyboard_layout_destroy (&curr_input->keymap);
+        }
+    }
+
+    // Synthetic keymaps, each scale is benchmarked separately so times can be
+    // plotted against size.
+    {
+        double scales[] = BENCH_SYNTHETIC_SCALES;
+        for (int i=0; i<ARRAY_SIZE(scales); i++) {
+            struct synthetic_keymap_params_t params;
+            synthetic_keymap_params_scaled (&params, seed, scales[i]);
+
+            string_t xkb_str = {0};
+            synthetic_keymap_xkb_str (&params, &xkb_str);
+
+            struct bench_input_t *input = mem_pool_push_struct (&bench.pool, struct bench_input_t);
+            *input = ZERO_INIT (struct bench_input_t);
+            input->fname = "synthetic";
+            input->data = pom_strdup (&bench.pool, str_data(&xkb_str));
+            input->size = str_len(&xkb_str);
+            str_free (&xkb_str);
+
+            input = bench_filter_parseable (input);
+            if (input == NULL) {
+                printf ("Could not parse synthetic keymap of scale %.3f, skipping it.\n", scales[i]);
+                continue;
+            }
+
+            string_t name = {0};
+            str_set_printf (&name, "xkb_parse/%.3f", scales[i]);
+            bench_run (&bench, pom_strdup (&bench.pool, str_data(&name)), input, bench_xkb_parse);
+            str_set_printf (&name, "xkb_write/%.3f", scales[i]);
+            bench_run (&bench, pom_strdup (&bench.pool, str_data(&name)), input, bench_xkb_write);
+            str_set_printf (&name, "xkb_round_trip/%.3f", scales[i]);
+            bench_run (&bench, pom_strdup (&bench.pool, str_data(&name)), input, bench_xkb_round_trip);
+            str_free (&name);
+
+            keyboard_layout_destroy (&input->keymap);
+        }
+    }
+
+    // Keyboard view geometries
+    {
+        struct bench_input_t *lrep_inputs = bench_load_inputs (&bench.pool, "./data/repr", "lrep");
+
+        // Also include the default geometry, it's built in code so get its
+        // string representation.
+        {
+            struct keyboard_view_t *kv = kv_new ();
+            kv_build_default_geometry (kv);
+
+            struct bench_input_t *new_input = mem_pool_push_struct (&bench.pool, struct bench_input_t);
+            *new_input = ZERO_INIT (struct bench_input_t);
+            new_input->fname = "default";
+            new_input->data = kv_to_string (&bench.pool, kv);
+            new_input->size = strlen (new_input->data);
+            new_input->next = lrep_inputs;
+            lrep_inputs = new_input;
+
+            keyboard_view_destroy (kv);
+        }
+
+        char *keymap_str = full_file_read (&bench.pool, BENCH_RENDER_KEYMAP, NULL);
+        for (struct bench_input_t *curr_input = lrep_inputs; curr_input; curr_input = curr_input->next) {
+            curr_input->kv = kv_new ();
+            kv_set_from_string (curr_input->kv, curr_input->data);
+
+            if (keymap_str == NULL || !keyboard_view_set_keymap (curr_input->kv, keymap_str)) {
+                // Without a keymap we can't compute keysym labels.
+                curr_input->kv->label_mode = KV_KEYCODE_LABELS;
+            }
+
+            double width, height;
+            kv_get_size (curr_input->kv, &width, &height);
+            curr_input->surface =
+                cairo_image_surface_create (CAIRO_FORMAT_ARGB32, ceil(width) + 1, ceil(height) + 1);
+        }
+
+        bench_run (&bench, "kv_set_from_string", lrep_inputs, bench_kv_set_from_string);
+        bench_run (&bench, "kv_to_string", lrep_inputs, bench_kv_to_string);
+        bench_run (&bench, "kv_render", lrep_inputs, bench_kv_render);
+
+        for (struct bench_input_t *curr_input = lrep_inputs; curr_input; curr_input = curr_input->next) {
+            cairo_surface_destroy (curr_input->surface);
+            keyboard_view_destroy (curr_input->kv);
+        }
+    }
+
+    int num_regressions = 0;
+    if (compare_path != NULL) {
+        num_regressions = bench_compare (&bench, compare_path, threshold);
+    }
+
+    if (output_path != NULL) {
+        bench_write_json (&bench, output_path);
+    }
+
+    mem_pool_destroy (&bench.pool);
+    return num_regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copiright (C) 2019 Santiago León O.
+ */
+
+// Tests for the keyboard view that don't need a display. Run them after
+// building with './pymk kv_tests':
+//
+//   ./bin/kv_tests
+
+#include "common.h"
+#include "bit_operations.c"
+#include "status.c"
+#include "scanner.c"
+#include "cli_parser.c"
+#include "binary_tree.c"
+
+#include <xkbcommon/xkbcommon.h>
+#include <linux/input-event-codes.h>
+#include "xkb_keycode_names.h"
+#include "kernel_keycode_names.h"
+#include "keysym_names.h"
+
+#include <gtk/gtk.h>
+#include "gresource.c"
+#include "gtk_utils.c"
+#include "fk_popover.c"
+#include "fk_searchable_list.c"
+
+#include "keyboard_view.h"
+#include "keyboard_view_builder.c"
+#include "keyboard_view_as_string.c"
+#include "keyboard_view_repr_store.c"
+#include "keyboard_view.c"
+
+#define SUCCESS ECMA_GREEN("OK")"\n"
+#define FAIL ECMA_RED("FAILED")"\n"
+#define TEST_NAME_WIDTH 40
+
+bool print_test_result (char *name, bool success)
+{
+    printf ("%-*s%s", TEST_NAME_WIDTH, name, success ? SUCCESS : FAIL);
+    return success;
+}
+
+// Compares the geometry in _kv_ with the one bundled in the GResource for the
+// built in geometry _name_, see generate_builtin_geometries.c.
+bool builtin_geometry_is_bundled (struct keyboard_view_t *kv, char *name)
+{
+    string_t path = str_new (KV_BUILTIN_GEOMETRIES_RESOURCE_PATH);
+    str_cat_c (&path, name);
+    str_cat_c (&path, ".lrep");
+
+    bool is_bundled = false;
+    GBytes *bytes = g_resources_lookup_data (str_data(&path), G_RESOURCE_LOOKUP_FLAGS_NONE, NULL);
+    if (bytes != NULL) {
+        mem_pool_t pool = {0};
+        char *str = kv_to_string (&pool, kv);
+
+        gsize bytes_size;
+        const char *data = g_bytes_get_data (bytes, &bytes_size);
+        is_bundled = bytes_size == strlen (str) && memcmp (data, str, bytes_size) == 0;
+
+        mem_pool_destroy (&pool);
+        g_bytes_unref (bytes);
+    }
+
+    str_free (&path);
+    return is_bundled;
+}
+
+int main (int argc, char **argv)
+{
+    init_kernel_keycode_names ();
+    init_xkb_keycode_names ();
+
+    bool success = true;
+
+    // Numbers in geometries are formatted and parsed by our own code, check it
+    // agrees with printf() and strtof().
+    success = print_test_result ("Distance formatting", kv_test_distance_format ()) && success;
+
+    // Blobs store states of the repr store, like the undo history and
+    // autosaves. Built in geometries cover multirow keys.
+    {
+        bool blob_success = true;
+        for (int i=0; i<ARRAY_SIZE(kv_builtin_geometries); i++) {
+            struct keyboard_view_t *kv = kv_new ();
+            kv_builtin_geometries[i].func (kv);
+
+            if (!kv_test_blob (kv)) {
+                printf ("Blob round trip of '%s' failed.\n", kv_builtin_geometries[i].name);
+                blob_success = false;
+            }
+            keyboard_view_destroy (kv);
+        }
+        success = print_test_result ("Blob round trip", blob_success) && success;
+    }
+
+    // The editor loads built in geometries from the files bundled in the
+    // GResource instead of calling their functions.
+    {
+        bool bundled_success = true;
+        for (int i=0; i<ARRAY_SIZE(kv_builtin_geometries); i++) {
+            struct keyboard_view_t *kv = kv_new ();
+            kv_builtin_geometries[i].func (kv);
+
+            if (!builtin_geometry_is_bundled (kv, kv_builtin_geometries[i].name)) {
+                printf ("Bundled geometry '%s' is out of date, run './pymk generate_builtin_geometries'.\n",
+                        kv_builtin_geometries[i].name);
+                bundled_success = false;
+            }
+            keyboard_view_destroy (kv);
+        }
+        success = print_test_result ("Bundled built in geometries", bundled_success) && success;
+    }
+
+    return success ? 0 : 1;
+}
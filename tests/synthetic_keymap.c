@@ -0,0 +1,274 @@
+/*
+ * Copiright (C) 2019 Santiago León O.
+ */
+
+// Generator of random but valid keymaps. All layouts in the test directory
+// have a similar, modest size, these are used to see how the parser, the
+// simplifier and the writer behave as keymaps grow towards the limits of the
+// internal representation.
+//
+// The same seed and parameters always generate the same keymap (as long as
+// the libc's rand() doesn't change).
+//
+// Some limits are tighter than the ones of the internal representation because
+// we want the result to be something xkb_file_write() can output and
+// libxkbcommon can compile:
+//
+//   - Keys are only generated for keycodes that have a name in the writer and
+//     fit in the 8-255 range of the keycodes section it writes.
+//
+//   - Modifiers beyond the 8 real ones are defined as virtual modifiers, but
+//     types, actions and leds only use real modifiers. The writer never maps
+//     virtual modifiers to real ones, so libxkbcommon would resolve them to
+//     an empty mask.
+//
+//   - The compatibility section we write only contains indicators, so its
+//     size is bounded by KEYBOARD_LAYOUT_MAX_LEDS.
+
+#define SYNTHETIC_KEYMAP_MAX_TYPES 500
+#define SYNTHETIC_KEYMAP_REAL_MODIFIERS 8
+
+struct synthetic_keymap_params_t {
+    unsigned int seed;
+
+    int num_modifiers; // Includes real modifiers, clamped to [8, 32].
+    int num_types;
+    int num_keys;
+    int num_leds;
+};
+
+// Returns an integer in [min,max], unlike rand_int_range() this works when
+// both are equal.
+static inline
+int synthetic_rand (int min, int max)
+{
+    return min == max ? min : (int)rand_int_range (min, max);
+}
+
+int synthetic_keymap_writable_keycodes (int *kcs)
+{
+    int num_kcs = 0;
+    for (int kc=1; kc<KEY_CNT && kc+8 <= 255; kc++) {
+        if (*get_writer_keycode_name (kc) != '\0') {
+            if (kcs != NULL) {
+                kcs[num_kcs] = kc;
+            }
+            num_kcs++;
+        }
+    }
+
+    return num_kcs;
+}
+
+// Parameters that grow linearly with scale. A scale of 1 is the largest
+// keymap we can generate, 0 is the smallest.
+void synthetic_keymap_params_scaled (struct synthetic_keymap_params_t *params,
+                                     unsigned int seed, double scale)
+{
+    scale = CLAMP (scale, 0, 1);
+
+    *params = ZERO_INIT (struct synthetic_keymap_params_t);
+    params->seed = seed;
+    params->num_modifiers = SYNTHETIC_KEYMAP_REAL_MODIFIERS +
+        (int)round (scale*(KEYBOARD_LAYOUT_MAX_MODIFIERS - SYNTHETIC_KEYMAP_REAL_MODIFIERS));
+    params->num_types = MAX (1, (int)round (scale*SYNTHETIC_KEYMAP_MAX_TYPES));
+    params->num_keys = MAX (1, (int)round (scale*synthetic_keymap_writable_keycodes (NULL)));
+    params->num_leds = (int)round (scale*(KEYBOARD_LAYOUT_MAX_LEDS - 1));
+}
+
+void str_cat_synthetic_keymap_params (string_t *str, struct synthetic_keymap_params_t *params)
+{
+    str_cat_printf (str, "seed: %u, modifiers: %d, types: %d, keys: %d, leds: %d\n",
+                    params->seed, params->num_modifiers, params->num_types,
+                    params->num_keys, params->num_leds);
+}
+
+static inline
+key_modifier_mask_t synthetic_real_modifier (key_modifier_mask_t real_modifiers)
+{
+    key_modifier_mask_t mask;
+    do {
+        mask = 1 << synthetic_rand (0, SYNTHETIC_KEYMAP_REAL_MODIFIERS-1);
+    } while (!(mask & real_modifiers));
+
+    return mask;
+}
+
+void synthetic_keymap_new_type (struct keyboard_layout_t *keymap, char *name,
+                                key_modifier_mask_t real_modifiers)
+{
+    int num_levels = synthetic_rand (1, KEYBOARD_LAYOUT_MAX_LEVELS);
+
+    // Use enough modifiers so that each level can have a distinct mask. Level
+    // 1 always gets the empty mask.
+    int num_type_modifiers = 0;
+    while ((1 << num_type_modifiers) < num_levels) {
+        num_type_modifiers++;
+    }
+    num_type_modifiers = synthetic_rand (num_type_modifiers, MAX(num_type_modifiers, 4));
+
+    key_modifier_mask_t type_mask = 0;
+    for (int i=0; i<num_type_modifiers;) {
+        key_modifier_mask_t modifier = synthetic_real_modifier (real_modifiers);
+        if (!(type_mask & modifier)) {
+            type_mask |= modifier;
+            i++;
+        }
+    }
+
+    struct key_type_t *type = keyboard_layout_new_type (keymap, name, type_mask);
+    keyboard_layout_type_new_level_map (keymap, type, 1, 0, NULL);
+
+    // Assign submasks of the type's mask to the other levels. Once all levels
+    // have one, some of the remaining submasks are mapped too so that levels
+    // have multiple mappings, like in real layouts.
+    int level = 2;
+    int num_submasks = 1 << num_type_modifiers;
+    for (int i=0; i<2*num_submasks; i++) {
+        key_modifier_mask_t submask = rand () & type_mask;
+        if (submask == 0) continue;
+
+        if (level <= num_levels) {
+            enum type_level_mapping_result_status_t status;
+            keyboard_layout_type_new_level_map (keymap, type, level, submask, &status);
+            if (status == KEYBOARD_LAYOUT_MOD_MAP_SUCCESS) {
+                level++;
+            }
+
+        } else if (num_levels > 1 && synthetic_rand (0, 3) == 0) {
+            keyboard_layout_type_new_level_map (keymap, type,
+                                                synthetic_rand (2, num_levels), submask, NULL);
+        }
+    }
+
+    // Random submasks may have missed some, fill the remaining levels
+    // deterministically so levels stay contiguous.
+    for (key_modifier_mask_t submask=1; level <= num_levels && submask <= type_mask; submask++) {
+        if ((submask & type_mask) != submask) continue;
+
+        enum type_level_mapping_result_status_t status;
+        keyboard_layout_type_new_level_map (keymap, type, level, submask, &status);
+        if (status == KEYBOARD_LAYOUT_MOD_MAP_SUCCESS) {
+            level++;
+        }
+    }
+}
+
+static inline
+xkb_keysym_t synthetic_keysym ()
+{
+    xkb_keysym_t keysym;
+    if (synthetic_rand (0, 3) != 0) {
+        // Printable Latin-1
+        keysym = synthetic_rand (XKB_KEY_space, XKB_KEY_asciitilde);
+    } else {
+        // Unicode keysyms, these get written as UXXXX.
+        keysym = 0x1000000 + synthetic_rand (0x100, 0x2fff);
+    }
+
+    return keysym;
+}
+
+// Fills keymap, which must be zero initialized, with a random keymap of the
+// sizes in params. The result must be destroyed with keyboard_layout_destroy().
+void synthetic_keymap_generate (struct synthetic_keymap_params_t *params,
+                                struct keyboard_layout_t *keymap)
+{
+    srand (params->seed);
+
+    // :predefined_real_modifiers
+    key_modifier_mask_t real_modifiers = 0;
+    char *real_modifier_names[] = XKB_FILE_BACKEND_REAL_MODIFIER_NAMES_LIST;
+    for (int i=0; i<ARRAY_SIZE(real_modifier_names); i++) {
+        real_modifiers |= keyboard_layout_new_modifier (keymap, real_modifier_names[i], NULL);
+    }
+
+    int num_modifiers = CLAMP (params->num_modifiers,
+                               SYNTHETIC_KEYMAP_REAL_MODIFIERS, KEYBOARD_LAYOUT_MAX_MODIFIERS);
+    string_t name = {0};
+    for (int i=SYNTHETIC_KEYMAP_REAL_MODIFIERS; i<num_modifiers; i++) {
+        str_set_printf (&name, "VMod%d", i - SYNTHETIC_KEYMAP_REAL_MODIFIERS + 1);
+        keyboard_layout_new_modifier (keymap, str_data(&name), NULL);
+    }
+
+    int num_types = MAX (1, params->num_types);
+    struct key_type_t **types = malloc (num_types*sizeof(struct key_type_t*));
+    {
+        types[0] = keyboard_layout_new_type (keymap, "ONE_LEVEL", 0);
+        keyboard_layout_type_new_level_map (keymap, types[0], 1, 0, NULL);
+
+        for (int i=1; i<num_types; i++) {
+            str_set_printf (&name, "SYNTHETIC_%d", i);
+            synthetic_keymap_new_type (keymap, str_data(&name), real_modifiers);
+        }
+
+        // Types are appended to the end of the list, store them in an array so
+        // picking one for each key is constant time.
+        int i = 0;
+        for (struct key_type_t *curr_type = keymap->types; curr_type; curr_type = curr_type->next) {
+            types[i++] = curr_type;
+        }
+    }
+
+    int *kcs = malloc (KEY_CNT*sizeof(int));
+    int num_kcs = synthetic_keymap_writable_keycodes (kcs);
+    {
+        // Pick a random subset of keycodes.
+        int num_keys = CLAMP (params->num_keys, 0, num_kcs);
+        for (int i=0; i<num_keys; i++) {
+            int j = synthetic_rand (i, num_kcs-1);
+            swap (kcs+i, kcs+j);
+        }
+
+        for (int i=0; i<num_keys; i++) {
+            struct key_type_t *type = types[synthetic_rand (0, num_types-1)];
+            struct key_t *key = keyboard_layout_new_key (keymap, kcs[i], type);
+
+            // A few keys become modifier keys. The action is only set in level
+            // 1, like it's normally done.
+            struct key_action_t action = {0};
+            int action_type = synthetic_rand (0, 31);
+            if (action_type < 3) {
+                action.type = (enum action_type_t[]){
+                    KEY_ACTION_TYPE_MOD_SET, KEY_ACTION_TYPE_MOD_LATCH, KEY_ACTION_TYPE_MOD_LOCK
+                }[action_type];
+                action.modifiers = synthetic_real_modifier (real_modifiers);
+            }
+
+            int num_levels = keyboard_layout_type_get_num_levels (type);
+            for (int level=1; level<=num_levels; level++) {
+                keyboard_layout_key_set_level (key, level, synthetic_keysym (),
+                                               level == 1 ? &action : NULL);
+            }
+        }
+    }
+
+    int num_leds = CLAMP (params->num_leds, 0, KEYBOARD_LAYOUT_MAX_LEDS-1);
+    for (int i=1; i<=num_leds; i++) {
+        keyboard_layout_new_led (keymap, i, synthetic_real_modifier (real_modifiers));
+    }
+
+    free (kcs);
+    free (types);
+    str_free (&name);
+}
+
+// Generates a keymap and writes it to xkb_str. Returns false if the writer
+// failed.
+bool synthetic_keymap_xkb_str (struct synthetic_keymap_params_t *params, string_t *xkb_str)
+{
+    struct keyboard_layout_t keymap = {0};
+    synthetic_keymap_generate (params, &keymap);
+
+    struct status_t status = {0};
+    xkb_file_write (&keymap, xkb_str, &status);
+
+    bool success = !status_is_error (&status);
+    if (!success) {
+        status_print (&status);
+    }
+
+    mem_pool_destroy (&status.pool);
+    keyboard_layout_destroy (&keymap);
+    return success;
+}
@@ -16,16 +16,19 @@
 
 #include "keyboard_layout.c"
 #include "xkb_file_backend.c"
+#include "synthetic_keymap.c"
 
 #include <sys/wait.h>
-#include <sys/mman.h>
+#include <poll.h>
 
 #define SUCCESS ECMA_GREEN("OK")"\n"
 #define FAIL ECMA_RED("FAILED")"\n"
 #define TEST_NAME_WIDTH 40
 #define TEST_INDENT 4
 
-#define MAX_MODIFIERS_TO_TEST 20
+// Limit on the number of modifier key class multisets tested by
+// modifier_equality_test() and led_equality_test().
+#define MAX_MODIFIER_COMBINATIONS_TO_TEST (1<<20)
 
 void str_cat_kc (string_t *str, xkb_keycode_t kc)
 {
@@ -145,6 +148,7 @@ struct modifier_key_t {
     int kc;
     key_modifier_mask_t modifiers;
     enum action_type_t type;
+    bool clears_locks; // SetMods() with the clearLocks flag
 
     struct modifier_key_t *next;
 };
@@ -167,6 +171,7 @@ void append_modifier_key (struct get_modifier_keys_list_clsr_t *clsr,
     new_key->next = NULL;
     new_key->kc = kc;
     new_key->type = type;
+    new_key->clears_locks = false;
 
     new_key->modifiers = mask;
 
@@ -241,6 +246,21 @@ void get_modifier_keys_list_foreach (struct xkb_keymap *keymap, xkb_keycode_t kc
             key_modifier_mask_t mask =
                 get_canonical_real_mod_state (keymap, xkb_state, clsr->num_mods, XKB_STATE_MODS_DEPRESSED);
             append_modifier_key (clsr, kc, mask, KEY_ACTION_TYPE_MOD_SET);
+
+            // libxkbcommon doesn't expose action flags. A key with clearLocks
+            // unlocks the modifiers it sets when released, so lock them, tap
+            // the key and check if they are still locked.
+            xkb_mod_mask_t mods = xkb_state_serialize_mods (xkb_state, XKB_STATE_MODS_DEPRESSED);
+            struct xkb_state *lock_state = xkb_state_new(keymap);
+            assert (lock_state);
+
+            xkb_state_update_mask (lock_state, 0, 0, mods, 0, 0, 0);
+            xkb_state_update_key (lock_state, kc+8, XKB_KEY_DOWN);
+            xkb_state_update_key (lock_state, kc+8, XKB_KEY_UP);
+            clsr->modifier_list_end->clears_locks =
+                xkb_state_serialize_mods (lock_state, XKB_STATE_MODS_LOCKED) != mods;
+
+            xkb_state_unref(lock_state);
         }
     }
 
@@ -262,10 +282,17 @@ struct modifier_key_t* get_modifier_keys_list (mem_pool_t *pool, struct xkb_keym
     return clsr.modifier_list;
 }
 
-struct compare_key_states_foreach_clsr_t {
+struct compare_key_states_clsr_t {
     struct modifier_key_t *mod_keys;
     int num_mod_keys;
 
+    // Keycodes of non modifier keys that have more than one level in any of
+    // the keymaps. These are the only keys that can produce different keysyms
+    // when the modifier state changes, so they are the only ones we compare.
+    struct xkb_keymap *k2;
+    xkb_keycode_t *keys;
+    int num_keys;
+
     struct xkb_state *s1;
     struct xkb_state *s2;
 
@@ -301,26 +328,71 @@ bool is_kc_mod_key (int kc, struct modifier_key_t *mod_keys, int num_mod_keys)
     return false;
 }
 
-void compare_key_states_foreach (struct xkb_keymap *keymap, xkb_keycode_t kc, void *data)
+bool key_has_multiple_levels (struct xkb_keymap *keymap, xkb_keycode_t kc)
 {
-    struct compare_key_states_foreach_clsr_t *clsr =
-        (struct compare_key_states_foreach_clsr_t*)data;
+    int num_layouts = xkb_keymap_num_layouts_for_key (keymap, kc);
+    for (int layout=0; layout<num_layouts; layout++) {
+        if (xkb_keymap_num_levels_for_key (keymap, kc, layout) > 1) {
+            return true;
+        }
+    }
 
-    if (!is_kc_mod_key (kc, clsr->mod_keys, clsr->num_mod_keys)) {
-        xkb_state_update_key (clsr->s1, kc+8, XKB_KEY_DOWN);
-        xkb_state_update_key (clsr->s2, kc+8, XKB_KEY_DOWN);
+    return false;
+}
+
+void count_multilevel_keys_foreach (struct xkb_keymap *keymap, xkb_keycode_t kc, void *data)
+{
+    struct compare_key_states_clsr_t *clsr = (struct compare_key_states_clsr_t*)data;
+
+    if (!is_kc_mod_key (kc, clsr->mod_keys, clsr->num_mod_keys) &&
+        (key_has_multiple_levels (keymap, kc) || key_has_multiple_levels (clsr->k2, kc))) {
+        if (clsr->keys != NULL) {
+            clsr->keys[clsr->num_keys] = kc;
+        }
+        clsr->num_keys++;
+    }
+}
+
+// Fills clsr->keys with the keycodes of keys whose keysyms may change with the
+// modifier state. Single level keys always produce the same keysyms so there
+// is no point in comparing them after each modifier change.
+void compute_multilevel_keys (mem_pool_t *pool, struct xkb_keymap *k1, struct xkb_keymap *k2,
+                              struct compare_key_states_clsr_t *clsr)
+{
+    clsr->k2 = k2;
+    clsr->keys = NULL;
+    clsr->num_keys = 0;
+    xkb_keymap_key_for_each (k1, count_multilevel_keys_foreach, clsr);
+
+    clsr->keys = mem_pool_push_array (pool, clsr->num_keys, xkb_keycode_t);
+    clsr->num_keys = 0;
+    xkb_keymap_key_for_each (k1, count_multilevel_keys_foreach, clsr);
+}
+
+// NOTE: We don't press the compared keys, xkb_state_key_get_syms() only
+// depends on the modifier and group state. Pressing them on the long lived
+// states used by the modifier tests could leave them changed if a key has an
+// action in some level.
+void compare_key_states (struct compare_key_states_clsr_t *clsr)
+{
+    clsr->equal_states = true;
+
+    for (int i=0; clsr->equal_states && i<clsr->num_keys; i++) {
+        xkb_keycode_t kc = clsr->keys[i];
 
         const xkb_keysym_t *syms_1, *syms_2;
         int num_syms_1 = xkb_state_key_get_syms (clsr->s1, kc, &syms_1);
         int num_syms_2 = xkb_state_key_get_syms (clsr->s2, kc, &syms_2);
 
         if (num_syms_1 == num_syms_2) {
-            for (int i=0; clsr->equal_states && i<num_syms_1; i++) {
-                if (syms_1[i] != syms_2[i]) {
+            for (int j=0; clsr->equal_states && j<num_syms_1; j++) {
+                if (syms_1[j] != syms_2[j]) {
                     clsr->equal_states = false;
                     clsr->differing_kc = kc-8;
-                    clsr->sym_1 = syms_1[i];
-                    clsr->sym_2 = syms_2[i];
+                    clsr->num_syms_1 = num_syms_1;
+                    clsr->num_syms_2 = num_syms_2;
+                    clsr->sym_1 = syms_1[j];
+                    clsr->sym_2 = syms_2[j];
                 }
             }
 
@@ -330,78 +402,290 @@ void compare_key_states_foreach (struct xkb_keymap *keymap, xkb_keycode_t kc, vo
             clsr->num_syms_1 = num_syms_1;
             clsr->num_syms_2 = num_syms_2;
         }
-
-        xkb_state_update_key (clsr->s1, kc+8, XKB_KEY_UP);
-        xkb_state_update_key (clsr->s2, kc+8, XKB_KEY_UP);
     }
 }
 
-// This function takes pressed_keys, interpret each bit as a mask where each bit
-// index refers to an element of the modifier_keys array, then it activates the
-// modifiers of the corresponding keys. Keys that set a modifier are pressed,
-// those that lock a modifier are pressed and released.
+// Changes the state of a single modifier key. Keys that set a modifier are
+// pressed when activated and released when deactivated, those that lock a
+// modifier are pressed and released in both cases (locking and unlocking the
+// modifier).
+//
+// NOTE: Releasing a key with clearLocks also unlocks its modifiers, callers
+// recreate the states instead of deactivating these, see
+// modifier_combinations_next().
 // TODO: Keys that latch modifiers are currently ignored.
-void set_active_modifier_keys (uint32_t active_modifier_keys, struct modifier_key_t *mod_keys,
-                               struct xkb_state *s1, struct xkb_state *s2)
+void toggle_modifier_key (struct modifier_key_t *mod_key, bool activate,
+                          struct xkb_state *s1, struct xkb_state *s2)
+{
+    // We don't test latch modifiers. They need a special treatment because
+    // they are unset everytime a key is pressed. Currently we press modifier
+    // keys, then compare the keysyms produced by each non modifier key.
+    //
+    // They are considered modifier keys, though. Because we don't want to
+    // compare them (as if they were non modifier keys) when comparing keysyms.
+    if (mod_key->type == KEY_ACTION_TYPE_MOD_SET) {
+        enum xkb_key_direction dir = activate ? XKB_KEY_DOWN : XKB_KEY_UP;
+        xkb_state_update_key (s1, mod_key->kc+8, dir);
+        xkb_state_update_key (s2, mod_key->kc+8, dir);
+
+    } else if (mod_key->type == KEY_ACTION_TYPE_MOD_LOCK) {
+        xkb_state_update_key (s1, mod_key->kc+8, XKB_KEY_DOWN);
+        xkb_state_update_key (s2, mod_key->kc+8, XKB_KEY_DOWN);
+        xkb_state_update_key (s1, mod_key->kc+8, XKB_KEY_UP);
+        xkb_state_update_key (s2, mod_key->kc+8, XKB_KEY_UP);
+    }
+}
+
+// Modifier keys that perform the same action in both keymaps are
+// interchangeable, pressing left or right Shift leaves the state in the same
+// place. Instead of testing all subsets of modifier keys we group them into
+// classes and test all multisets of classes, that is, for each class we only
+// care about how many of its keys are active, not which ones. We always
+// activate the first keys of a class.
+//
+// Keys that latch a modifier aren't put in any class because we don't press
+// them, see toggle_modifier_key(). This also skips latchToLock, which only
+// applies to latches.
+struct modifier_class_t {
+    enum action_type_t type_k1;
+    enum action_type_t type_k2;
+    bool clears_locks_k1;
+    bool clears_locks_k2;
+    key_modifier_mask_t modifiers;
+
+    int num_keys;
+    struct modifier_key_t **keys;
+};
+
+// Multisets are enumerated in reflected mixed radix Gray code order, so from one
+// combination to the next only the count of a single class changes by one.
+// This lets us keep a single xkb_state per keymap for all the test, instead of
+// creating new states and pressing all active keys again for each combination.
+struct modifier_combinations_t {
+    int num_classes;
+    struct modifier_class_t *classes;
+
+    int *counts;
+    int *directions;
+
+    int num_mod_keys;
+    uint64_t num_combinations;
+};
+
+// Builds the classes of modifier keys. Both arrays must be sorted by keycode
+// and contain the same keys, which is true for keymaps that passed the first
+// part of modifier_equality_test().
+void modifier_combinations_init (mem_pool_t *pool,
+                                 struct modifier_key_t *mod_keys_k1, struct modifier_key_t *mod_keys_k2,
+                                 int num_mod_keys, struct modifier_combinations_t *combs)
 {
-    while (active_modifier_keys) {
-        key_modifier_mask_t next_bit_mask = active_modifier_keys & -active_modifier_keys;
-
-        struct modifier_key_t mod_key = mod_keys[bit_pos(next_bit_mask)];
-        if (mod_key.type != KEY_ACTION_TYPE_MOD_LATCH) {
-            // We don't test latch modifiers. They need a special
-            // treatment because they are unset everytime a key is
-            // pressed. Currently we press modifier keys, then press
-            // each non modifier key compare the keysyms produced.
-            //
-            // They are considered modifier keys, though. Because we
-            // don't want to press them (as if they were non
-            // modifier keys) when comparing keysyms.
-            xkb_state_update_key (s1, mod_key.kc+8, XKB_KEY_DOWN);
-            xkb_state_update_key (s2, mod_key.kc+8, XKB_KEY_DOWN);
-
-            // If the modifier is locked, then release the key.
-            if (mod_key.type == KEY_ACTION_TYPE_MOD_LOCK) {
-                xkb_state_update_key (s1, mod_key.kc+8, XKB_KEY_UP);
-                xkb_state_update_key (s2, mod_key.kc+8, XKB_KEY_UP);
+    *combs = ZERO_INIT (struct modifier_combinations_t);
+    combs->num_mod_keys = num_mod_keys;
+    combs->classes = mem_pool_push_array (pool, num_mod_keys, struct modifier_class_t);
+
+    int *key_class = mem_pool_push_array (pool, num_mod_keys, int);
+    for (int i=0; i<num_mod_keys; i++) {
+        key_class[i] = -1;
+        if (mod_keys_k1[i].type == KEY_ACTION_TYPE_MOD_LATCH) {
+            continue;
+        }
+
+        for (int j=0; j<combs->num_classes; j++) {
+            struct modifier_class_t *class = &combs->classes[j];
+            if (class->type_k1 == mod_keys_k1[i].type &&
+                class->type_k2 == mod_keys_k2[i].type &&
+                class->clears_locks_k1 == mod_keys_k1[i].clears_locks &&
+                class->clears_locks_k2 == mod_keys_k2[i].clears_locks &&
+                class->modifiers == mod_keys_k1[i].modifiers) {
+                key_class[i] = j;
+                break;
             }
         }
 
-        active_modifier_keys = active_modifier_keys & (active_modifier_keys-1);
+        if (key_class[i] == -1) {
+            key_class[i] = combs->num_classes;
+
+            struct modifier_class_t *new_class = &combs->classes[combs->num_classes++];
+            *new_class = ZERO_INIT (struct modifier_class_t);
+            new_class->type_k1 = mod_keys_k1[i].type;
+            new_class->type_k2 = mod_keys_k2[i].type;
+            new_class->clears_locks_k1 = mod_keys_k1[i].clears_locks;
+            new_class->clears_locks_k2 = mod_keys_k2[i].clears_locks;
+            new_class->modifiers = mod_keys_k1[i].modifiers;
+        }
+
+        combs->classes[key_class[i]].num_keys++;
     }
 
+    combs->num_combinations = 1;
+    for (int j=0; j<combs->num_classes; j++) {
+        struct modifier_class_t *class = &combs->classes[j];
+
+        // Saturate instead of overflowing, callers only compare this against
+        // a limit.
+        if (combs->num_combinations <= UINT32_MAX) {
+            combs->num_combinations *= class->num_keys + 1;
+        }
+
+        class->keys = mem_pool_push_array (pool, class->num_keys, struct modifier_key_t*);
+        class->num_keys = 0;
+    }
+
+    for (int i=0; i<num_mod_keys; i++) {
+        if (key_class[i] != -1) {
+            struct modifier_class_t *class = &combs->classes[key_class[i]];
+            class->keys[class->num_keys++] = &mod_keys_k1[i];
+        }
+    }
+
+    combs->counts = mem_pool_push_array (pool, combs->num_classes, int);
+    combs->directions = mem_pool_push_array (pool, combs->num_classes, int);
 }
 
-void str_cat_active_modifier_keys (string_t *str, uint32_t active_modifier_keys,
-                                   struct modifier_key_t *mod_keys)
+// Sets the iterator to the combination where no modifier key is active.
+void modifier_combinations_reset (struct modifier_combinations_t *combs)
 {
-    if (active_modifier_keys == 0) {
-        str_cat_c (str, " none");
+    for (int j=0; j<combs->num_classes; j++) {
+        combs->counts[j] = 0;
+        combs->directions[j] = 1;
+    }
+}
 
-    } else {
-        while (active_modifier_keys) {
-            key_modifier_mask_t next_bit_mask = active_modifier_keys & -active_modifier_keys;
-            struct modifier_key_t mod_key = mod_keys[bit_pos(next_bit_mask)];
+// Replaces s1 and s2 with new states where the keys of the current combination
+// are active.
+void modifier_combinations_set_states (struct modifier_combinations_t *combs,
+                                       struct xkb_state **s1, struct xkb_state **s2)
+{
+    struct xkb_state *new_s1 = xkb_state_new(xkb_state_get_keymap (*s1));
+    assert (new_s1);
+
+    struct xkb_state *new_s2 = xkb_state_new(xkb_state_get_keymap (*s2));
+    assert (new_s2);
+
+    for (int j=0; j<combs->num_classes; j++) {
+        for (int i=0; i<combs->counts[j]; i++) {
+            toggle_modifier_key (combs->classes[j].keys[i], true, new_s1, new_s2);
+        }
+    }
+
+    xkb_state_unref(*s1);
+    xkb_state_unref(*s2);
+    *s1 = new_s1;
+    *s2 = new_s2;
+}
+
+// Moves to the next combination, activating or deactivating a single modifier
+// key in s1 and s2 (if they aren't NULL). Returns false when all combinations
+// have been enumerated.
+bool modifier_combinations_next (struct modifier_combinations_t *combs,
+                                 struct xkb_state **s1, struct xkb_state **s2)
+{
+    for (int j=0; j<combs->num_classes; j++) {
+        struct modifier_class_t *class = &combs->classes[j];
+        int next_count = combs->counts[j] + combs->directions[j];
+
+        if (next_count >= 0 && next_count <= class->num_keys) {
+            bool activate = next_count > combs->counts[j];
+            struct modifier_key_t *mod_key =
+                class->keys[activate ? combs->counts[j] : next_count];
+            combs->counts[j] = next_count;
+
+            if (s1 != NULL && s2 != NULL) {
+                if (!activate && (class->clears_locks_k1 || class->clears_locks_k2)) {
+                    // Releasing the key could also unlock modifiers locked by
+                    // other keys of the combination.
+                    modifier_combinations_set_states (combs, s1, s2);
+                } else {
+                    toggle_modifier_key (mod_key, activate, *s1, *s2);
+                }
+            }
+            return true;
+        }
+
+        combs->directions[j] = -combs->directions[j];
+    }
+
+    return false;
+}
+
+void str_cat_modifier_combination (string_t *str, struct modifier_combinations_t *combs)
+{
+    bool is_empty = true;
+    for (int j=0; j<combs->num_classes; j++) {
+        for (int i=0; i<combs->counts[j]; i++) {
             str_cat_c (str, " ");
-            str_cat_kc (str, mod_key.kc);
-            active_modifier_keys = active_modifier_keys & (active_modifier_keys-1);
+            str_cat_kc (str, combs->classes[j].keys[i]->kc);
+            is_empty = false;
         }
     }
+
+    if (is_empty) {
+        str_cat_c (str, " none");
+    }
     str_cat_c (str, "\n");
 }
 
-void str_cat_passed_modifier_tests (string_t *str, uint32_t last_active_modifier_keys,
-                                    struct modifier_key_t *mod_keys)
+void str_cat_modifier_combinations_info (string_t *str, struct modifier_combinations_t *combs)
+{
+    str_cat_printf (str, "Modifier keys: %d\n", combs->num_mod_keys);
+    str_cat_printf (str, "Modifier key classes: %d\n", combs->num_classes);
+    for (int j=0; j<combs->num_classes; j++) {
+        str_cat_c (str, " -");
+        for (int i=0; i<combs->classes[j].num_keys; i++) {
+            str_cat_c (str, " ");
+            str_cat_kc (str, combs->classes[j].keys[i]->kc);
+        }
+        str_cat_c (str, "\n");
+    }
+
+    str_cat_printf (str, "Tested combinations: %" PRIu64 "\n", combs->num_combinations);
+    if (combs->num_mod_keys < 64) {
+        uint64_t num_subsets = (uint64_t)1 << combs->num_mod_keys;
+        str_cat_printf (str, "Reduction factor: %.1fx (%" PRIu64 " subsets)\n",
+                        (double)num_subsets/combs->num_combinations, num_subsets);
+    }
+}
+
+// Prints the combinations tested before failed_step, in the order they were
+// tested, followed by the one that failed.
+// NOTE: This resets combs.
+void str_cat_passed_modifier_tests (string_t *str, uint64_t failed_step,
+                                    struct modifier_combinations_t *combs)
 {
+    modifier_combinations_reset (combs);
+
     str_cat_c (str, " PASSED MODIFIER COMBINATIONS:\n");
-    for (int passed_test = 0; passed_test < last_active_modifier_keys; passed_test++) {
+    for (uint64_t passed_step = 0; passed_step < failed_step; passed_step++) {
         str_cat_c (str, " -");
-        str_cat_active_modifier_keys (str, passed_test, mod_keys);
+        str_cat_modifier_combination (str, combs);
+        modifier_combinations_next (combs, NULL, NULL);
     }
     str_cat_c (str, "\n");
 
     str_cat_c (str, " FAILED MODIFIER COMBINATION:");
-    str_cat_active_modifier_keys (str, last_active_modifier_keys, mod_keys);
+    str_cat_modifier_combination (str, combs);
+}
+
+// Returns the modifier keys of keymap as an array sorted by keycode. This is
+// required so we can check in a fast way if a keycode is a modifier key.
+struct modifier_key_t* get_modifier_keys_array (mem_pool_t *pool, struct xkb_keymap *keymap, int *len)
+{
+    int num_mod_keys;
+    struct modifier_key_t *mod_list = get_modifier_keys_list (pool, keymap, &num_mod_keys);
+    modifier_key_sort (&mod_list, num_mod_keys);
+
+    struct modifier_key_t *mod_keys = mem_pool_push_array (pool, num_mod_keys, struct modifier_key_t);
+    for (int i=0; i<num_mod_keys; i++) {
+        mod_keys[i] = *mod_list;
+        mod_keys[i].next = NULL;
+
+        mod_list = mod_list->next;
+    }
+
+    if (len != NULL) {
+        *len = num_mod_keys;
+    }
+    return mod_keys;
 }
 
 // This test is a more functional equality test of the keymaps. The idea is to
@@ -412,10 +696,16 @@ void str_cat_passed_modifier_tests (string_t *str, uint32_t last_active_modifier
 //  - We only get modifiers from the first level, actions that set modifiers in
 //    other key levels are ignored and not checked.
 //  - We currently ignore latched modifiers.
+//  - Keys with clearLocks are released by recreating the state without them,
+//    so we never check that releasing them unlocks modifiers. Our internal
+//    representation doesn't store the flag yet.
 //  - We only compare the keysyms of keys that don't set a modifier in their
 //    first level. It's possible to have modifier keys that in an other level
 //    produces a keysym, differences here won't be caught.
 //  - We ignore keysyms of keys that set/lock modifiers (modifier keys).
+//  - Modifier keys with the same action are considered interchangeable, see
+//    struct modifier_class_t. We only test combinations that activate the first
+//    keys of each class.
 //
 // NOTE: This assumes that the keymaps passed the keymap_equality_test.
 // NOTE: This has exponential complexity on the number of keys that trigger
@@ -427,87 +717,60 @@ bool modifier_equality_test (struct xkb_keymap *k1, struct xkb_keymap *k2, strin
 {
     mem_pool_t pool = {0};
     bool are_equal = true;
-    int num_mod_keys = 0;
-
-    int mod_list_k1_len;
-    struct modifier_key_t *mod_list_k1 = get_modifier_keys_list (&pool, k1, &mod_list_k1_len);
-    modifier_key_sort (&mod_list_k1, mod_list_k1_len);
+    int num_mod_keys;
+    struct modifier_key_t *mod_keys_k1 = get_modifier_keys_array (&pool, k1, &num_mod_keys);
 
-    int mod_list_k2_len;
-    struct modifier_key_t *mod_list_k2 = get_modifier_keys_list (&pool, k2, &mod_list_k2_len);
-    modifier_key_sort (&mod_list_k2, mod_list_k2_len);
+    int num_mod_keys_k2;
+    struct modifier_key_t *mod_keys_k2 = get_modifier_keys_array (&pool, k2, &num_mod_keys_k2);
 
-    if (mod_list_k1_len != mod_list_k2_len) {
+    if (num_mod_keys != num_mod_keys_k2) {
         str_cat_c (msg, "Keymaps don't have the same number of modifier keys.\n");
         are_equal = false;
     }
 
     // Check that both keymaps have the same modifiers.
-    if (are_equal) {
-        struct modifier_key_t *curr_mod_k1 = mod_list_k1, *curr_mod_k2 = mod_list_k2;
-        while (are_equal == true && curr_mod_k1 != NULL && curr_mod_k2 != NULL) {
-            if (curr_mod_k1->kc != curr_mod_k2->kc) {
-                str_cat_c (msg, "Keymaps don't map modifiers to the same keys.\n");
-                are_equal = false;
-
-            } else if (curr_mod_k1->modifiers != curr_mod_k2->modifiers) {
-                str_cat_printf (msg, "Keymaps set, lock or latch different real modifiers with key %d.\n",
-                                curr_mod_k1->kc);
-                are_equal = false;
-            }
-
-            num_mod_keys++;
-
-            curr_mod_k1 = curr_mod_k1->next;
-            curr_mod_k2 = curr_mod_k2->next;
+    for (int i=0; are_equal && i<num_mod_keys; i++) {
+        if (mod_keys_k1[i].kc != mod_keys_k2[i].kc) {
+            str_cat_c (msg, "Keymaps don't map modifiers to the same keys.\n");
+            are_equal = false;
+
+        } else if (mod_keys_k1[i].modifiers != mod_keys_k2[i].modifiers) {
+            str_cat_printf (msg, "Keymaps set, lock or latch different real modifiers with key %d.\n",
+                            mod_keys_k1[i].kc);
+            are_equal = false;
         }
-
-
-        // We checked the lengths of the lists of modifier keys before. This
-        // must hold here
-        assert (curr_mod_k1 == NULL && curr_mod_k2 == NULL);
     }
 
-    int max_mod_keys = MAX_MODIFIERS_TO_TEST;
+    uint64_t max_combinations = MAX_MODIFIER_COMBINATIONS_TO_TEST;
+    struct modifier_combinations_t combs = {0};
     if (are_equal) {
-        struct compare_key_states_foreach_clsr_t clsr = {0};
-
-        // Put modifier key nodes into an array sorted by keycode. This is required
-        // so we can check in a fast way if a keycode is a modifier key.
-        struct modifier_key_t *curr_mod_k1 = mod_list_k1;
+        struct compare_key_states_clsr_t clsr = {0};
+        clsr.mod_keys = mod_keys_k1;
         clsr.num_mod_keys = num_mod_keys;
-        clsr.mod_keys = mem_pool_push_array (&pool, num_mod_keys, struct modifier_key_t);
-        for (int i=0; i<num_mod_keys; i++) {
-            clsr.mod_keys[i] = *curr_mod_k1;
-            clsr.mod_keys[i].next = NULL;
-
-            curr_mod_k1 = curr_mod_k1->next;
-        }
-
-        // Iterate all num_mod_keys^2 combinations and check that the resulting
-        // keysyms are the same.
-        // NOTE: This grows exponentially with the number of modifier keys in a
-        // layout!
-        if (num_mod_keys <= max_mod_keys) {
-            for (uint32_t pressed_keys = 0; are_equal && pressed_keys<(1<<num_mod_keys); pressed_keys++) {
+        modifier_combinations_init (&pool, mod_keys_k1, mod_keys_k2, num_mod_keys, &combs);
 
-                struct xkb_state *s1 = xkb_state_new(k1);
-                assert (s1);
+        // Iterate all multisets of modifier key classes and check that the
+        // resulting keysyms are the same.
+        // NOTE: This still grows exponentially with the number of modifier key
+        // classes in a layout!
+        if (combs.num_combinations <= max_combinations) {
+            compute_multilevel_keys (&pool, k1, k2, &clsr);
 
-                struct xkb_state *s2 = xkb_state_new(k2);
-                assert (s2);
+            clsr.s1 = xkb_state_new(k1);
+            assert (clsr.s1);
 
-                set_active_modifier_keys (pressed_keys, clsr.mod_keys, s1, s2);
+            clsr.s2 = xkb_state_new(k2);
+            assert (clsr.s2);
 
-                clsr.s1 = s1;
-                clsr.s2 = s2;
-                clsr.equal_states = true;
-                xkb_keymap_key_for_each (k1, compare_key_states_foreach, &clsr);
+            modifier_combinations_reset (&combs);
+            uint64_t step = 0;
+            do {
+                compare_key_states (&clsr);
 
                 if (!clsr.equal_states && msg != NULL) {
                     str_cat_printf (msg, "Modifiers produce different keysyms.\n");
 
-                    str_cat_passed_modifier_tests (msg, pressed_keys, clsr.mod_keys);
+                    str_cat_passed_modifier_tests (msg, step, &combs);
 
                     str_cat_c (msg, " kc: ");
                     str_cat_kc (msg, clsr.differing_kc);
@@ -524,19 +787,23 @@ bool modifier_equality_test (struct xkb_keymap *k1, struct xkb_keymap *k2, strin
                         str_cat_printf (msg, " num_syms_1: %d\n", clsr.num_syms_1);
                         str_cat_printf (msg, " num_syms_2: %d\n", clsr.num_syms_2);
                     }
+                }
 
+                if (!clsr.equal_states) {
                     are_equal = false;
                 }
 
-                xkb_state_unref(s1);
-                xkb_state_unref(s2);
-            }
+                step++;
+            } while (are_equal && modifier_combinations_next (&combs, &clsr.s1, &clsr.s2));
+
+            xkb_state_unref(clsr.s1);
+            xkb_state_unref(clsr.s2);
         }
     }
 
-    if (are_equal && num_mod_keys > max_mod_keys) {
-        str_cat_printf (msg, "We don't do modifier tests on keymaps with more than %d modifier keys.\n",
-                        max_mod_keys);
+    if (are_equal && combs.num_combinations > max_combinations) {
+        str_cat_printf (msg, "We don't do modifier tests on keymaps with more than %" PRIu64 " modifier key combinations.\n",
+                        max_combinations);
     }
 
     mem_pool_destroy (&pool);
@@ -553,18 +820,14 @@ bool led_equality_test (struct xkb_keymap *k1, struct xkb_keymap *k2, string_t *
 {
     mem_pool_t pool = {0};
     bool are_equal = true;
-    int num_mod_keys = 0;
 
-    int mod_list_k1_len;
-    struct modifier_key_t *mod_list_k1 = get_modifier_keys_list (&pool, k1, &mod_list_k1_len);
-    modifier_key_sort (&mod_list_k1, mod_list_k1_len);
+    int num_mod_keys;
+    struct modifier_key_t *mod_keys_k1 = get_modifier_keys_array (&pool, k1, &num_mod_keys);
 
-    int mod_list_k2_len;
-    struct modifier_key_t *mod_list_k2 = get_modifier_keys_list (&pool, k2, &mod_list_k2_len);
-    modifier_key_sort (&mod_list_k2, mod_list_k2_len);
+    int num_mod_keys_k2;
+    struct modifier_key_t *mod_keys_k2 = get_modifier_keys_array (&pool, k2, &num_mod_keys_k2);
 
-    assert (mod_list_k1_len == mod_list_k2_len);
-    num_mod_keys = mod_list_k1_len;
+    assert (num_mod_keys == num_mod_keys_k2);
 
     int num_leds_k1 = xkb_keymap_num_leds (k1);
     int num_leds_k2 = xkb_keymap_num_leds (k2);
@@ -574,34 +837,25 @@ bool led_equality_test (struct xkb_keymap *k1, struct xkb_keymap *k2, string_t *
     // Indicators for groups may be useful if we ever support groups, currently
     // those are removed too.
 
-    int max_mod_keys = MAX_MODIFIERS_TO_TEST;
+    uint64_t max_combinations = MAX_MODIFIER_COMBINATIONS_TO_TEST;
+    struct modifier_combinations_t combs = {0};
     if (are_equal) {
-        // Put modifier key nodes into an array sorted by keycode. This is used
-        // for quick lookuop of modifier keys.
-        struct modifier_key_t *curr_mod_k1 = mod_list_k1;
-        struct modifier_key_t *mod_keys = mem_pool_push_array (&pool, num_mod_keys, struct modifier_key_t);
-        for (int i=0; i<num_mod_keys; i++) {
-            mod_keys[i] = *curr_mod_k1;
-            mod_keys[i].next = NULL;
-
-            curr_mod_k1 = curr_mod_k1->next;
-        }
-
-        // Iterate all num_mod_keys^2 combinations and check that LEDs work the
-        // same.
-        // NOTE: This grows exponentially with the number of modifier keys in a
-        // layout!
-        if (num_mod_keys <= max_mod_keys) {
-            for (uint32_t pressed_keys = 0; are_equal && pressed_keys<(1<<num_mod_keys); pressed_keys++) {
-
-                struct xkb_state *s1 = xkb_state_new(k1);
-                assert (s1);
-
-                struct xkb_state *s2 = xkb_state_new(k2);
-                assert (s2);
-
-                set_active_modifier_keys (pressed_keys, mod_keys, s1, s2);
-
+        modifier_combinations_init (&pool, mod_keys_k1, mod_keys_k2, num_mod_keys, &combs);
+
+        // Iterate all multisets of modifier key classes and check that LEDs
+        // work the same.
+        // NOTE: This still grows exponentially with the number of modifier key
+        // classes in a layout!
+        if (combs.num_combinations <= max_combinations) {
+            struct xkb_state *s1 = xkb_state_new(k1);
+            assert (s1);
+
+            struct xkb_state *s2 = xkb_state_new(k2);
+            assert (s2);
+
+            modifier_combinations_reset (&combs);
+            uint64_t step = 0;
+            do {
                 const char *ind_name;
                 bool ind_1, ind_2;
                 {
@@ -645,22 +899,24 @@ bool led_equality_test (struct xkb_keymap *k1, struct xkb_keymap *k2, string_t *
                 if (!are_equal && msg != NULL) {
                     str_cat_printf (msg, "Modifiers produce different keysyms.\n");
 
-                    str_cat_passed_modifier_tests (msg, pressed_keys, mod_keys);
+                    str_cat_passed_modifier_tests (msg, step, &combs);
                     str_cat_printf (msg, "  Indicator 1: %s -> %d\n", ind_name, ind_1?1:0);
                     str_cat_printf (msg, "  Indicator 2: %s -> %d\n", ind_name, ind_2?1:0);
 
                     are_equal = false;
                 }
 
-                xkb_state_unref(s1);
-                xkb_state_unref(s2);
-            }
+                step++;
+            } while (are_equal && modifier_combinations_next (&combs, &s1, &s2));
+
+            xkb_state_unref(s1);
+            xkb_state_unref(s2);
         }
     }
 
-    if (are_equal && num_mod_keys > max_mod_keys) {
-        str_cat_printf (msg, "We don't do modifier tests on keymaps with more than %d modifier keys.\n",
-                        max_mod_keys);
+    if (are_equal && combs.num_combinations > max_combinations) {
+        str_cat_printf (msg, "We don't do modifier tests on keymaps with more than %" PRIu64 " modifier key combinations.\n",
+                        max_combinations);
     }
 
     mem_pool_destroy (&pool);
@@ -775,7 +1031,8 @@ void str_cat_xkbcommon_modifier_info (string_t *str, struct xkb_keymap *keymap)
 enum input_type_t {
     INPUT_NONE,
     INPUT_RMLVO_NAMES,
-    INPUT_XKB_FILE
+    INPUT_XKB_FILE,
+    INPUT_SYNTHETIC
 };
 
 enum crash_safety_mode_t {
@@ -817,7 +1074,7 @@ bool writer_test (struct keyboard_layout_t *internal_keymap,
     return success;
 }
 
-void printf_successful_layout (char *layout)
+void printf_successful_layout (char *layout, double wall_time_ms)
 {
     int width = strlen(layout) + 2;
     printf ("%s: ", layout);
@@ -825,7 +1082,7 @@ void printf_successful_layout (char *layout)
         printf (".");
         width++;
     }
-    printf (" %s", SUCCESS);
+    printf (" " ECMA_GREEN("OK") " (%.1f ms)\n", wall_time_ms);
 }
 
 void str_cat_test_name (string_t *str, char *test_name)
@@ -839,48 +1096,110 @@ void str_cat_test_name (string_t *str, char *test_name)
     str_cat_c (str, " ");
 }
 
-// Names for shared memory objects are global to the system and they will still
-// be defined if the object wasn't unlinked or the last execution of the program
-// crashed. This macro is used to create a name that will not collide.
-// TODO: If we had a full language at compile time like in JAI we could create a
-// much more meaningful name here. Create a version that is scoped and
-// automatically calls UNLINK_SHARED then for variables that span multiple
-// scopes get a handle that UNLINK_SHARED receives.
+// Forks a child process with its stdout and stderr redirected to pipes. Like
+// fork() it returns 0 in the child and the child's pid in the parent, where
+// stdout_fd and stderr_fd are set to the read end of the pipes.
 //
-// TODO: Stop doing this. I don't think obscuring the fact that you need to
-// choose a name for a shared variable is useful. Better make it part of the
-// macro so the user has to think about how to handle this.
-#define SHARED_VARIABLE_NAME(NAME) "/" #NAME ":SHARED_VARIABLE_WM1WNTK8XM"
-
-#define NEW_SHARED_VARIABLE(TYPE,SYMBOL,VALUE) \
-    NEW_SHARED_VARIABLE_NAMED(TYPE,SYMBOL,VALUE,SHARED_VARIABLE_NAME(SYMBOL))
-#define UNLINK_SHARED_VARIABLE(SYMBOL) UNLINK_SHARED_VARIABLE_NAMED(SHARED_VARIABLE_NAME(SYMBOL))
-
-void wait_and_cat_output (mem_pool_t *pool, bool *success,
-                          char *stdout_fname, char *stderr_fname,
-                          string_t *result)
+// We use pipes instead of files with a fixed name so several instances of
+// the tests can run at the same time.
+pid_t fork_with_output_pipes (int *stdout_fd, int *stderr_fd)
 {
-    int child_status;
-    wait (&child_status);
+    int stdout_pipe[2], stderr_pipe[2];
+    if (pipe (stdout_pipe) == -1 || pipe (stderr_pipe) == -1) {
+        printf ("Error creating pipes: %s\n", strerror(errno));
+        exit (1);
+    }
 
-    if (!WIFEXITED(child_status)) {
-        *success = false;
+    // Don't let the child inherit pending output, it would be written twice.
+    fflush (stdout);
+    fflush (stderr);
+
+    pid_t pid = fork ();
+    if (pid == 0) {
+        close (stdout_pipe[0]);
+        close (stderr_pipe[0]);
+
+        dup2 (stdout_pipe[1], STDOUT_FILENO);
+        setvbuf (stdout, NULL, _IONBF, 0);
+        close (stdout_pipe[1]);
+
+        dup2 (stderr_pipe[1], STDERR_FILENO);
+        setvbuf (stderr, NULL, _IONBF, 0);
+        close (stderr_pipe[1]);
+
+    } else {
+        close (stdout_pipe[1]);
+        close (stderr_pipe[1]);
+
+        *stdout_fd = stdout_pipe[0];
+        *stderr_fd = stderr_pipe[0];
+    }
+
+    return pid;
+}
+
+// Appends everything written to fd until it's closed. Returns false on EOF.
+bool read_available_output (int fd, string_t *str)
+{
+    char buff[4096];
+    ssize_t bytes_read = read (fd, buff, ARRAY_SIZE(buff));
+    if (bytes_read > 0) {
+        strn_cat_c (str, buff, bytes_read);
+    }
+
+    return bytes_read > 0 || (bytes_read == -1 && errno == EINTR);
+}
+
+// Reads both pipes until the child closes them. Reading them in turns would
+// deadlock if the child fills the one we aren't reading.
+void read_child_output (int stdout_fd, int stderr_fd, string_t *stdout_str, string_t *stderr_str)
+{
+    struct pollfd fds[2] = {{stdout_fd, POLLIN, 0}, {stderr_fd, POLLIN, 0}};
+    string_t *outputs[2] = {stdout_str, stderr_str};
+    int num_open = 2;
+
+    while (num_open > 0) {
+        if (poll (fds, ARRAY_SIZE(fds), -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i=0; i<ARRAY_SIZE(fds); i++) {
+            if (fds[i].fd != -1 && fds[i].revents != 0) {
+                if (!read_available_output (fds[i].fd, outputs[i])) {
+                    close (fds[i].fd);
+                    fds[i].fd = -1;
+                    num_open--;
+                }
+            }
+        }
     }
+}
+
+// Collects the output of a child created with fork_with_output_pipes() and
+// waits for it to finish. The child reports success by exiting with status 0.
+bool wait_and_cat_output (pid_t pid, int stdout_fd, int stderr_fd, string_t *result)
+{
+    string_t stdout_str = {0};
+    string_t stderr_str = {0};
+    read_child_output (stdout_fd, stderr_fd, &stdout_str, &stderr_str);
+
+    int child_status;
+    waitpid (pid, &child_status, 0);
 
-    if (!*success) {
+    bool success = WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0;
+    if (!success) {
         str_cat_c (result, FAIL);
 
         string_t child_output = {0};
-        char *stdout_str = full_file_read (pool, stdout_fname, NULL);
-        if (*stdout_str != '\0') {
+        if (str_len (&stdout_str) > 0) {
             str_cat_c (&child_output, ECMA_CYAN("stdout:\n"));
-            str_cat_indented_c (&child_output, stdout_str, 2);
+            str_cat_indented_c (&child_output, str_data(&stdout_str), 2);
         }
 
-        char *stderr_str = full_file_read (pool, stderr_fname, NULL);
-        if (*stderr_str != '\0') {
+        if (str_len (&stderr_str) > 0) {
             str_cat_c (&child_output, ECMA_CYAN("stderr:\n"));
-            str_cat_indented_c (&child_output, stderr_str, 2);
+            str_cat_indented_c (&child_output, str_data(&stderr_str), 2);
         }
 
         if (!WIFEXITED(child_status)) {
@@ -894,8 +1213,10 @@ void wait_and_cat_output (mem_pool_t *pool, bool *success,
         str_cat_c (result, SUCCESS);
     }
 
-    unlink (stdout_fname);
-    unlink (stderr_fname);
+    str_free (&stdout_str);
+    str_free (&stderr_str);
+
+    return success;
 }
 
 bool test_file_parsing (enum crash_safety_mode_t crash_safety,
@@ -905,20 +1226,13 @@ bool test_file_parsing (enum crash_safety_mode_t crash_safety,
                         string_t *result)
 {
     bool retval = true;
-    char *stdout_fname = "tmp_stdout";
-    char *stderr_fname = "tmp_stderr";
-    mem_pool_t pool = {0};
-
-    NEW_SHARED_VARIABLE (bool, success, true);
+    int stdout_fd, stderr_fd;
 
     str_cat_test_name (result, "libxkbcommon parser");
     {
-        if (fork() == 0) {
-            freopen (stdout_fname, "w", stdout);
-            setvbuf (stdout, NULL, _IONBF, 0);
-
-            freopen (stderr_fname, "w", stderr);
-            setvbuf (stderr, NULL, _IONBF, 0);
+        pid_t pid = fork_with_output_pipes (&stdout_fd, &stderr_fd);
+        if (pid == 0) {
+            bool success = true;
 
             // Here we use the xkb_ctx created before, because this is a process
             // and not a thread, unrefing it should cause no problems as it's a
@@ -928,7 +1242,7 @@ bool test_file_parsing (enum crash_safety_mode_t crash_safety,
                                            XKB_KEYMAP_FORMAT_TEXT_V1,
                                            XKB_KEYMAP_COMPILE_NO_FLAGS);
             if (!keymap) {
-                *success = false;
+                success = false;
             } else {
                 assert_consecutive_modifiers (keymap);
             }
@@ -936,43 +1250,34 @@ bool test_file_parsing (enum crash_safety_mode_t crash_safety,
             if (keymap) xkb_keymap_unref(keymap);
             if (xkb_ctx) xkb_context_unref(xkb_ctx);
 
-            exit(0);
+            exit(success ? 0 : 1);
         }
 
-        wait_and_cat_output (&pool, success, stdout_fname, stderr_fname, result);
+        retval = wait_and_cat_output (pid, stdout_fd, stderr_fd, result);
     }
-    retval = *success;
 
     str_cat_test_name (result, "internal parser");
     {
-        *success = true;
-
-        if (fork() == 0) {
-            freopen (stdout_fname, "w", stdout);
-            setvbuf (stdout, NULL, _IONBF, 0);
-
-            freopen (stderr_fname, "w", stderr);
-            setvbuf (stderr, NULL, _IONBF, 0);
+        pid_t pid = fork_with_output_pipes (&stdout_fd, &stderr_fd);
+        if (pid == 0) {
+            bool success = true;
 
             struct keyboard_layout_t keymap = {0};
             string_t log = {0};
             if (!xkb_file_parse_verbose (xkb_str, &keymap, &log)) {
-                *success = false;
+                success = false;
                 printf ("%s", str_data(&log));
             }
 
             str_free (&log);
             keyboard_layout_destroy (&keymap);
 
-            exit(0);
+            exit(success ? 0 : 1);
         }
 
-        wait_and_cat_output (&pool, success, stdout_fname, stderr_fname, result);
+        retval = wait_and_cat_output (pid, stdout_fd, stderr_fd, result) && retval;
     }
 
-    retval = retval && *success;
-    UNLINK_SHARED_VARIABLE (success);
-
     // If none of the parsers failed, and the caller wants the paring keymaps,
     // parse layouts again and set them.
     if (retval || crash_safety == CRASH_MODE_UNSAFE) {
@@ -989,8 +1294,6 @@ bool test_file_parsing (enum crash_safety_mode_t crash_safety,
         }
     }
 
-    mem_pool_destroy (&pool);
-
     return retval;
 }
 
@@ -1156,6 +1459,29 @@ bool test_xkb_file (enum crash_safety_mode_t crash_safety,
             keyboard_layout_destroy (&keymap);
             str_free (&tmp);
         }
+
+        if (input_libxkbcommon_keymap && writer_output_libxkbcommon_keymap) {
+            mem_pool_t pool = {0};
+            int num_mod_keys, num_mod_keys_k2;
+            struct modifier_key_t *mod_keys_k1 =
+                get_modifier_keys_array (&pool, input_libxkbcommon_keymap, &num_mod_keys);
+            struct modifier_key_t *mod_keys_k2 =
+                get_modifier_keys_array (&pool, writer_output_libxkbcommon_keymap, &num_mod_keys_k2);
+
+            if (num_mod_keys == num_mod_keys_k2) {
+                str_cat_c (info, ECMA_MAGENTA("\nModifier combinations:\n"));
+
+                struct modifier_combinations_t combs;
+                modifier_combinations_init (&pool, mod_keys_k1, mod_keys_k2, num_mod_keys, &combs);
+
+                string_t tmp = {0};
+                str_cat_modifier_combinations_info (&tmp, &combs);
+                str_cat_indented (info, &tmp, 1);
+                str_free (&tmp);
+            }
+
+            mem_pool_destroy (&pool);
+        }
     }
 
     keyboard_layout_destroy (&input_internal_keymap);
@@ -1243,14 +1569,22 @@ void xkb_str_from_file (char *fname, string_t *xkb_str)
     mem_pool_destroy (&tmp);
 }
 
-struct iterate_tests_dir_clsr_t {
-    string_t *result;
-    string_t *writer_keymap_str;
-    string_t *writer_keymap_str_2;
+struct test_file_t {
+    char *fname;
+
+    pid_t pid;
+    int result_fd;
+    double start_time_ms;
 
-    // Just used for layout output styling. We want to add a linebreak between
-    // blocks of successful layouts and failures.
-    bool prev_layout_success;
+    bool done;
+    bool success;
+    double wall_time_ms;
+    string_t result;
+};
+
+struct iterate_tests_dir_clsr_t {
+    mem_pool_t *pool;
+    DYNAMIC_ARRAY_DEFINE (struct test_file_t, files);
 };
 
 ITERATE_DIR_CB(iterate_tests_dir)
@@ -1258,34 +1592,161 @@ ITERATE_DIR_CB(iterate_tests_dir)
     if (!is_dir) {
         char *extension = get_extension (fname);
         if (extension && strncmp (extension, "xkb", 3) == 0) {
-            string_t input_str = {0};
             struct iterate_tests_dir_clsr_t *clsr = (struct iterate_tests_dir_clsr_t*)data;
-            xkb_str_from_file (fname, &input_str);
 
-            str_set (clsr->result, "");
-            str_set (clsr->writer_keymap_str, "");
-            str_set (clsr->writer_keymap_str_2, "");
-            bool success =
-                test_xkb_file (CRASH_MODE_SAFE,
-                               &input_str, clsr->result, NULL,
-                               clsr->writer_keymap_str, clsr->writer_keymap_str_2);
+            struct test_file_t new_file = {0};
+            new_file.fname = pom_strdup (clsr->pool, fname);
+            new_file.result_fd = -1;
+            DYNAMIC_ARRAY_APPEND (clsr->files, new_file);
+        }
+    }
+}
 
-            if (success) {
-                printf_successful_layout (fname);
-                clsr->prev_layout_success = true;
+templ_sort (test_file_sort, struct test_file_t, strcmp (a->fname, b->fname) < 0)
 
-            } else {
-                if (clsr->prev_layout_success) {
-                    printf ("\n");
-                }
-                printf ("%s:\n", fname);
-                printf_indented (str_data(clsr->result), TEST_INDENT);
-                printf ("\n");
-                clsr->prev_layout_success = false;
+// Starts a worker process that runs all tests on file. The worker writes the
+// test report to a pipe and reports success with its exit status. Having each
+// file tested in its own process also means a crash only affects that file.
+void test_file_start (struct test_file_t *file)
+{
+    int result_pipe[2];
+    if (pipe (result_pipe) == -1) {
+        printf ("Error creating pipe: %s\n", strerror(errno));
+        exit (1);
+    }
+
+    fflush (stdout);
+    fflush (stderr);
+
+    file->start_time_ms = get_wall_time_ms ();
+    file->pid = fork ();
+    if (file->pid == 0) {
+        close (result_pipe[0]);
+
+        string_t input_str = {0};
+        string_t result = {0};
+        string_t writer_keymap_str = {0};
+        string_t writer_keymap_str_2 = {0};
+
+        xkb_str_from_file (file->fname, &input_str);
+        bool success =
+            test_xkb_file (CRASH_MODE_SAFE,
+                           &input_str, &result, NULL,
+                           &writer_keymap_str, &writer_keymap_str_2);
+
+        char *data = str_data(&result);
+        size_t len = str_len(&result);
+        while (len > 0) {
+            ssize_t bytes_written = write (result_pipe[1], data, len);
+            if (bytes_written == -1) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            data += bytes_written;
+            len -= bytes_written;
+        }
+        close (result_pipe[1]);
+
+        // Don't run atexit handlers or flush stdio buffers copied from the
+        // parent.
+        _exit (success ? 0 : 1);
+    }
+
+    close (result_pipe[1]);
+    file->result_fd = result_pipe[0];
+}
+
+void test_file_finish (struct test_file_t *file)
+{
+    close (file->result_fd);
+    file->result_fd = -1;
+
+    int child_status;
+    waitpid (file->pid, &child_status, 0);
+    file->wall_time_ms = get_wall_time_ms () - file->start_time_ms;
+
+    file->success = WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0;
+    if (!WIFEXITED(child_status)) {
+        str_cat_printf (&file->result, "Tests crashed with status: %d\n", child_status);
+    }
+
+    file->done = true;
+}
+
+void print_test_file_result (struct test_file_t *file, bool *prev_layout_success)
+{
+    if (file->success) {
+        printf_successful_layout (file->fname, file->wall_time_ms);
+        *prev_layout_success = true;
+
+    } else {
+        if (*prev_layout_success) {
+            printf ("\n");
+        }
+        printf ("%s: (%.1f ms)\n", file->fname, file->wall_time_ms);
+        printf_indented (str_data(&file->result), TEST_INDENT);
+        printf ("\n");
+        *prev_layout_success = false;
+    }
+}
+
+// Tests all files using up to num_jobs worker processes at the same time.
+// Results are printed in the same order as files, as soon as all previous
+// files finished. Returns the number of files that failed.
+int run_test_files (struct test_file_t *files, int num_files, int num_jobs)
+{
+    mem_pool_t pool = {0};
+    struct pollfd *fds = mem_pool_push_array (&pool, num_jobs, struct pollfd);
+    struct test_file_t **running = mem_pool_push_array (&pool, num_jobs, struct test_file_t*);
+    int num_running = 0;
+
+    int next_to_start = 0, next_to_print = 0;
+    int num_failed = 0;
+    bool prev_layout_success = false;
+    while (next_to_print < num_files) {
+        while (num_running < num_jobs && next_to_start < num_files) {
+            struct test_file_t *file = &files[next_to_start++];
+            test_file_start (file);
+            running[num_running++] = file;
+        }
+
+        for (int i=0; i<num_running; i++) {
+            fds[i].fd = running[i]->result_fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll (fds, num_running, -1) == -1 && errno != EINTR) {
+            printf ("Error waiting for test results: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i=0; i<num_running; i++) {
+            if (fds[i].revents != 0 &&
+                !read_available_output (running[i]->result_fd, &running[i]->result)) {
+                test_file_finish (running[i]);
+
+                // Keep the running array packed, fds is rebuilt on the next
+                // iteration.
+                running[i] = running[num_running-1];
+                fds[i] = fds[num_running-1];
+                num_running--;
+                i--;
             }
-            str_free (&input_str);
+        }
+
+        while (next_to_print < num_files && files[next_to_print].done) {
+            struct test_file_t *file = &files[next_to_print++];
+            print_test_file_result (file, &prev_layout_success);
+            if (!file->success) {
+                num_failed++;
+            }
+            str_free (&file->result);
         }
     }
+
+    mem_pool_destroy (&pool);
+    return num_failed;
 }
 
 int main (int argc, char **argv)
@@ -1339,8 +1800,33 @@ int main (int argc, char **argv)
         input_type = INPUT_RMLVO_NAMES;
     }
 
+    // Data if input_type is INPUT_SYNTHETIC
+    struct synthetic_keymap_params_t synthetic_params = {0};
+    char *synthetic_scale_str = get_cli_arg_opt ("--synthetic", argv, argc);
+    if (synthetic_scale_str != NULL) {
+        unsigned int seed = 0;
+        char *seed_str = get_cli_arg_opt ("--seed", argv, argc);
+        if (seed_str != NULL) {
+            seed = strtoul (seed_str, NULL, 10);
+        }
+
+        synthetic_keymap_params_scaled (&synthetic_params, seed, strtod (synthetic_scale_str, NULL));
+        input_type = INPUT_SYNTHETIC;
+    }
+
     bool file_output_enabled = get_cli_bool_opt ("--write-output", argv, argc);
 
+    // Number of files tested in parallel when running all tests.
+    int num_jobs = 1;
+    char *num_jobs_str = get_cli_arg_opt ("-j", argv, argc);
+    if (num_jobs_str != NULL) {
+        num_jobs = atoi (num_jobs_str);
+        if (num_jobs < 1) {
+            printf ("Invalid number of jobs: %s.\n", num_jobs_str);
+            success = false;
+        }
+    }
+
     if (!success) {
         // TODO: Show a message here. Usage documentation?
         return 1;
@@ -1352,17 +1838,21 @@ int main (int argc, char **argv)
     string_t writer_keymap_str_2 = {0};
 
     if (input_type == INPUT_NONE) {
-        char *absolute_path = abs_path ("./tests", NULL);
-        struct iterate_tests_dir_clsr_t clsr;
-        clsr.result = &result;
-        clsr.writer_keymap_str = &writer_keymap_str;
-        clsr.writer_keymap_str_2 = &writer_keymap_str_2;
-        clsr.prev_layout_success = false;
+        mem_pool_t pool = {0};
+        char *absolute_path = abs_path ("./tests", &pool);
+
+        struct iterate_tests_dir_clsr_t clsr = {0};
+        clsr.pool = &pool;
+        DYNAMIC_ARRAY_INIT (&pool, clsr.files, 0);
         iterate_dir (absolute_path, iterate_tests_dir, &clsr);
+        test_file_sort (clsr.files, clsr.files_len);
+
+        double start_time_ms = get_wall_time_ms ();
+        int num_failed = run_test_files (clsr.files, clsr.files_len, num_jobs);
+        printf ("\nTested %d files in %.1f ms using %d jobs, %d failed.\n",
+                clsr.files_len, get_wall_time_ms () - start_time_ms, num_jobs, num_failed);
 
-        free (absolute_path);
-        str_free (&input_str);
-        str_free (&result);
+        mem_pool_destroy (&pool);
 
     } else {
         string_t info = {0};
@@ -1372,6 +1862,10 @@ int main (int argc, char **argv)
             xkb_str_from_rmlvo (rules, model, layout, variant, options, &input_str);
         } else if (input_type == INPUT_XKB_FILE) {
             xkb_str_from_file (input_file, &input_str);
+        } else if (input_type == INPUT_SYNTHETIC) {
+            synthetic_keymap_xkb_str (&synthetic_params, &input_str);
+            str_cat_c (&info, "\nSynthetic keymap: ");
+            str_cat_synthetic_keymap_params (&info, &synthetic_params);
         }
 
         enum crash_safety_mode_t crash_safety = CRASH_MODE_SAFE;
@@ -2505,11 +2505,13 @@ void scan_metadata_value (mem_pool_t *pool, struct scanner_t *scnr, char **val)
 bool xkb_file_parse_verbose (char *xkb_str, struct keyboard_layout_t *keymap, string_t *log)
 {
     struct xkb_parser_state_t state = {0};
+    // NOTE: The parser state keeps a pointer to this array, it must live until
+    // the end of the function.
+    char *real_modifiers[] = XKB_FILE_BACKEND_REAL_MODIFIER_NAMES_LIST;
     {
         state.scnr.pos = xkb_str;
         state.keymap = keymap;
 
-        char *real_modifiers[] = XKB_FILE_BACKEND_REAL_MODIFIER_NAMES_LIST;
         state.real_modifiers = real_modifiers;
         state.real_modifiers_len = ARRAY_SIZE(real_modifiers);
 
@@ -2740,6 +2742,7 @@ MOD_MASK_BINARY_TREE_FOREACH_CB(print_modifiers_foreach)
     // Print only virtual modifiers
     if (!(clsr->state->real_modifiers & mask)) {
         if (clsr->is_first == true) {
+            str_cat_c (clsr->xkb_str, "    virtual_modifiers ");
             clsr->is_first = false;
         } else {
             str_cat_c (clsr->xkb_str, ",");
@@ -2853,17 +2856,19 @@ void xkb_file_write_types (struct xkb_writer_state_t *state,
 {
     str_cat_c (xkb_str, "xkb_types \"keys_t\" {\n");
 
-    str_cat_c (xkb_str, "    virtual_modifiers ");
     // NOTE: We print modifier definitions from the internal representation's
     // tree and not from the reverse mapping because we want them in alphabetic
     // order so their ordering does not depend on the value of the mask assigned
-    // to it.
+    // to it. The statement is omitted if there are no virtual modifiers, an
+    // empty list is a syntax error.
     struct print_modifiers_foreach_clsr_t clsr = {0};
     clsr.is_first = true;
     clsr.xkb_str = xkb_str;
     clsr.state = state;
     mod_mask_binary_tree_foreach (&keymap->modifiers, print_modifiers_foreach, &clsr);
-    str_cat_c (xkb_str, ";\n\n");
+    if (!clsr.is_first) {
+        str_cat_c (xkb_str, ";\n\n");
+    }
 
     struct key_type_t *curr_type = keymap->types;
     while (curr_type != NULL) {
@@ -2935,7 +2940,8 @@ void xkb_file_write_symbols (struct xkb_writer_state_t *state,
     str_cat_c (xkb_str, "xkb_symbols \"keys_s\" {\n");
     for (int i=0; i<KEY_CNT; i++) {
         struct key_t *curr_key = keymap->keys[i];
-        if (curr_key != NULL) {
+        // Keys can be left without a type by the editor, they have no symbols.
+        if (curr_key != NULL && curr_key->type != NULL) {
             int num_levels = keyboard_layout_type_get_num_levels (curr_key->type);
 
             str_cat_printf (xkb_str, "    key <%s> {\n", get_writer_keycode_name(i));